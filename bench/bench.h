@@ -0,0 +1,172 @@
+/*
+ * bench.h - taiwins benchmark helpers
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_BENCH_H
+#define TW_BENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The benchmarks run the server and its clients in one thread, the clients
+ * talk to the server through libwayland-client over a socketpair, so the
+ * commits take the same path as in a real compositor. The client and server
+ * libraries both have a struct wl_display, the helpers keep them in separated
+ * files, here it is always the server one. The tests use them as well.
+ */
+
+struct wl_display;
+struct wl_event_loop;
+struct tw_surface;
+struct tw_compositor;
+struct tw_layers_manager;
+struct tw_layer;
+
+struct bench_client;
+struct bench_surface;
+
+typedef void (*bench_new_surface_t)(struct tw_surface *surface, void *data);
+
+struct bench_server {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct tw_compositor *compositor;
+	struct tw_layers_manager *layers;
+	/** a desktop layer the benchmarks put the surfaces in */
+	struct tw_layer *layer;
+
+	/** the tw_surfaces in the order of creation */
+	struct tw_surface **surfaces;
+	size_t n_surfaces, cap_surfaces;
+	bench_new_surface_t new_surface;
+	void *new_surface_data;
+};
+
+uint64_t
+bench_now_ns(void);
+
+bool
+bench_server_init(struct bench_server *server);
+
+void
+bench_server_fini(struct bench_server *server);
+
+/**
+ * @brief serve a client on the socket, the fd is owned by the server.
+ */
+bool
+bench_server_add_client(struct bench_server *server, int fd);
+
+/**
+ * @brief dispatch the server once, returns the nanoseconds spent in it.
+ */
+uint64_t
+bench_server_dispatch(struct bench_server *server, int timeout);
+
+/**
+ * @brief put the surface on the top of the benchmark layer at (x, y).
+ */
+void
+bench_server_show_surface(struct bench_server *server,
+                          struct tw_surface *surface, int x, int y);
+
+/**
+ * @brief connect a client to the server, it is not flushed until
+ * bench_client_dispatch.
+ */
+struct bench_client *
+bench_client_connect(struct bench_server *server);
+
+void
+bench_client_destroy(struct bench_client *client);
+
+/**
+ * @brief send the queued requests and dispatch the events received, never
+ * blocks.
+ */
+void
+bench_client_dispatch(struct bench_client *client);
+
+/**
+ * @brief queue a wl_display.sync, bench_client_synced returns true once the
+ * server has dispatched every request before it.
+ */
+void
+bench_client_sync(struct bench_client *client);
+
+bool
+bench_client_synced(struct bench_client *client);
+
+/**
+ * @brief run the server and the client until the client is synced, returns
+ * the nanoseconds the server spent dispatching.
+ */
+uint64_t
+bench_roundtrip(struct bench_server *server, struct bench_client *client);
+
+/**
+ * @brief create a surface with a shm buffer of the size, a subsurface of
+ * parent at (x, y) if parent is not NULL.
+ *
+ * The buffer is XRGB8888 if opaque, ARGB8888 otherwise, filled with a
+ * gradient.
+ */
+struct bench_surface *
+bench_surface_create(struct bench_client *client,
+                     struct bench_surface *parent, int x, int y,
+                     int width, int height, bool opaque);
+
+/**
+ * @brief change a row of the buffer, attach, damage the whole buffer and
+ * commit.
+ */
+void
+bench_surface_commit(struct bench_surface *surface);
+
+/**
+ * @brief attach the buffer as it is, damage the rect in surface coordinates
+ * and commit.
+ */
+void
+bench_surface_commit_damage(struct bench_surface *surface, int x, int y,
+                            int width, int height);
+
+/**
+ * @brief set the buffer transform and scale for the next commit.
+ */
+void
+bench_surface_set_transform(struct bench_surface *surface, int32_t transform,
+                            int32_t scale);
+
+/**
+ * @brief the pixels of the buffer, width * height of them, top row first.
+ */
+uint32_t *
+bench_surface_get_data(struct bench_surface *surface);
+
+/**
+ * @brief true while the server holds the buffer.
+ */
+bool
+bench_surface_busy(struct bench_surface *surface);
+
+#endif /* EOF */
@@ -0,0 +1,326 @@
+/*
+ * bench_client.c - taiwins benchmark clients
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <wayland-client.h>
+
+#include "bench.h"
+
+struct bench_client {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
+	struct wl_shm *shm;
+	struct wl_callback *sync;
+	struct wl_list surfaces;
+};
+
+struct bench_surface {
+	struct wl_list link;
+	struct bench_client *client;
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct wl_buffer *buffer;
+	uint32_t *data;
+	size_t size;
+	int width, height;
+	unsigned int frame;
+	bool busy;
+};
+
+static void
+handle_registry_global(void *data, struct wl_registry *registry,
+                       uint32_t name, const char *interface,
+                       uint32_t version)
+{
+	struct bench_client *client = data;
+
+	if (!strcmp(interface, wl_compositor_interface.name))
+		client->compositor =
+			wl_registry_bind(registry, name,
+			                 &wl_compositor_interface, 4);
+	else if (!strcmp(interface, wl_subcompositor_interface.name))
+		client->subcompositor =
+			wl_registry_bind(registry, name,
+			                 &wl_subcompositor_interface, 1);
+	else if (!strcmp(interface, wl_shm_interface.name))
+		client->shm = wl_registry_bind(registry, name,
+		                               &wl_shm_interface, 1);
+}
+
+static void
+handle_registry_global_remove(void *data, struct wl_registry *registry,
+                              uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = handle_registry_global,
+	.global_remove = handle_registry_global_remove,
+};
+
+struct bench_client *
+bench_client_connect(struct bench_server *server)
+{
+	struct bench_client *client = calloc(1, sizeof(*client));
+	int fds[2];
+
+	if (!client)
+		return NULL;
+	wl_list_init(&client->surfaces);
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		goto err;
+	if (!bench_server_add_client(server, fds[0])) {
+		close(fds[0]);
+		close(fds[1]);
+		goto err;
+	}
+	if (!(client->display = wl_display_connect_to_fd(fds[1])))
+		goto err;
+	client->registry = wl_display_get_registry(client->display);
+	wl_registry_add_listener(client->registry, &registry_listener,
+	                         client);
+	bench_roundtrip(server, client);
+	if (!client->compositor || !client->subcompositor || !client->shm) {
+		bench_client_destroy(client);
+		return NULL;
+	}
+	return client;
+err:
+	free(client);
+	return NULL;
+}
+
+static void
+bench_surface_destroy(struct bench_surface *surface)
+{
+	if (surface->subsurface)
+		wl_subsurface_destroy(surface->subsurface);
+	wl_surface_destroy(surface->surface);
+	wl_buffer_destroy(surface->buffer);
+	munmap(surface->data, surface->size);
+	wl_list_remove(&surface->link);
+	free(surface);
+}
+
+void
+bench_client_destroy(struct bench_client *client)
+{
+	struct bench_surface *surface, *tmp;
+
+	//children first
+	wl_list_for_each_safe(surface, tmp, &client->surfaces, link)
+		bench_surface_destroy(surface);
+	if (client->sync)
+		wl_callback_destroy(client->sync);
+	if (client->shm)
+		wl_shm_destroy(client->shm);
+	if (client->subcompositor)
+		wl_subcompositor_destroy(client->subcompositor);
+	if (client->compositor)
+		wl_compositor_destroy(client->compositor);
+	wl_registry_destroy(client->registry);
+	wl_display_disconnect(client->display);
+	free(client);
+}
+
+void
+bench_client_dispatch(struct bench_client *client)
+{
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(client->display),
+		.events = POLLIN,
+	};
+
+	while (wl_display_prepare_read(client->display) != 0)
+		wl_display_dispatch_pending(client->display);
+	wl_display_flush(client->display);
+	if (poll(&pfd, 1, 0) > 0)
+		wl_display_read_events(client->display);
+	else
+		wl_display_cancel_read(client->display);
+	wl_display_dispatch_pending(client->display);
+}
+
+static void
+handle_sync_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct bench_client *client = data;
+
+	wl_callback_destroy(callback);
+	client->sync = NULL;
+}
+
+static const struct wl_callback_listener sync_listener = {
+	.done = handle_sync_done,
+};
+
+void
+bench_client_sync(struct bench_client *client)
+{
+	if (client->sync)
+		return;
+	client->sync = wl_display_sync(client->display);
+	wl_callback_add_listener(client->sync, &sync_listener, client);
+}
+
+bool
+bench_client_synced(struct bench_client *client)
+{
+	return client->sync == NULL;
+}
+
+/******************************************************************************
+ * surfaces
+ *****************************************************************************/
+
+static void
+handle_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct bench_surface *surface = data;
+
+	surface->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = handle_buffer_release,
+};
+
+static bool
+surface_create_buffer(struct bench_surface *surface, bool opaque)
+{
+	struct bench_client *client = surface->client;
+	struct wl_shm_pool *pool;
+	int stride = surface->width * 4;
+	int fd;
+
+	surface->size = (size_t)stride * surface->height;
+	if ((fd = memfd_create("bench-buffer", MFD_CLOEXEC)) < 0)
+		return false;
+	if (ftruncate(fd, surface->size) < 0)
+		goto err;
+	surface->data = mmap(NULL, surface->size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED, fd, 0);
+	if (surface->data == MAP_FAILED) {
+		surface->data = NULL;
+		goto err;
+	}
+	//premultiplied, half transparent if not opaque
+	for (int y = 0; y < surface->height; y++)
+		for (int x = 0; x < surface->width; x++)
+			surface->data[y * surface->width + x] =
+				(opaque ? 0xff000000 : 0x80000000) |
+				(x & 0x7f) << 16 | (y & 0x7f) << 8;
+
+	pool = wl_shm_create_pool(client->shm, fd, surface->size);
+	surface->buffer =
+		wl_shm_pool_create_buffer(pool, 0, surface->width,
+		                          surface->height, stride, opaque ?
+		                          WL_SHM_FORMAT_XRGB8888 :
+		                          WL_SHM_FORMAT_ARGB8888);
+	wl_shm_pool_destroy(pool);
+	wl_buffer_add_listener(surface->buffer, &buffer_listener, surface);
+	close(fd);
+	return true;
+err:
+	close(fd);
+	return false;
+}
+
+struct bench_surface *
+bench_surface_create(struct bench_client *client,
+                     struct bench_surface *parent, int x, int y,
+                     int width, int height, bool opaque)
+{
+	struct bench_surface *surface = calloc(1, sizeof(*surface));
+
+	if (!surface)
+		return NULL;
+	surface->client = client;
+	surface->width = width;
+	surface->height = height;
+	if (!surface_create_buffer(surface, opaque)) {
+		free(surface);
+		return NULL;
+	}
+	surface->surface = wl_compositor_create_surface(client->compositor);
+	if (parent) {
+		surface->subsurface =
+			wl_subcompositor_get_subsurface(client->subcompositor,
+			                                surface->surface,
+			                                parent->surface);
+		wl_subsurface_set_position(surface->subsurface, x, y);
+	}
+	wl_list_insert(&client->surfaces, &surface->link);
+	return surface;
+}
+
+void
+bench_surface_commit(struct bench_surface *surface)
+{
+	uint32_t *row = surface->data +
+		(surface->frame++ % surface->height) * surface->width;
+
+	for (int x = 0; x < surface->width; x++)
+		row[x] ^= 0x003f3f3f;
+	wl_surface_attach(surface->surface, surface->buffer, 0, 0);
+	wl_surface_damage_buffer(surface->surface, 0, 0,
+	                         surface->width, surface->height);
+	wl_surface_commit(surface->surface);
+	surface->busy = true;
+}
+
+void
+bench_surface_commit_damage(struct bench_surface *surface, int x, int y,
+                            int width, int height)
+{
+	wl_surface_attach(surface->surface, surface->buffer, 0, 0);
+	wl_surface_damage(surface->surface, x, y, width, height);
+	wl_surface_commit(surface->surface);
+	surface->busy = true;
+}
+
+void
+bench_surface_set_transform(struct bench_surface *surface, int32_t transform,
+                            int32_t scale)
+{
+	wl_surface_set_buffer_transform(surface->surface, transform);
+	wl_surface_set_buffer_scale(surface->surface, scale);
+}
+
+uint32_t *
+bench_surface_get_data(struct bench_surface *surface)
+{
+	return surface->data;
+}
+
+bool
+bench_surface_busy(struct bench_surface *surface)
+{
+	return surface->busy;
+}
@@ -0,0 +1,157 @@
+/*
+ * bench_server.c - taiwins benchmark server side
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/compositor.h>
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/layers.h>
+
+#include "bench.h"
+
+struct bench_server_priv {
+	struct tw_compositor compositor;
+	struct tw_layers_manager layers;
+	struct tw_layer layer;
+	struct wl_listener surface_created;
+	struct bench_server *server;
+};
+
+uint64_t
+bench_now_ns(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+static void
+notify_bench_surface_created(struct wl_listener *listener, void *data)
+{
+	struct bench_server_priv *priv =
+		wl_container_of(listener, priv, surface_created);
+	struct bench_server *server = priv->server;
+	struct tw_surface *surface = data;
+
+	if (server->n_surfaces == server->cap_surfaces) {
+		size_t cap = server->cap_surfaces ?
+			server->cap_surfaces * 2 : 64;
+		struct tw_surface **surfaces =
+			realloc(server->surfaces, cap * sizeof(*surfaces));
+		if (!surfaces)
+			abort();
+		server->surfaces = surfaces;
+		server->cap_surfaces = cap;
+	}
+	server->surfaces[server->n_surfaces++] = surface;
+	if (server->new_surface)
+		server->new_surface(surface, server->new_surface_data);
+}
+
+bool
+bench_server_init(struct bench_server *server)
+{
+	struct bench_server_priv *priv = calloc(1, sizeof(*priv));
+
+	memset(server, 0, sizeof(*server));
+	if (!priv || !(server->display = wl_display_create()))
+		goto err;
+	if (wl_display_init_shm(server->display) ||
+	    !tw_compositor_init(&priv->compositor, server->display))
+		goto err;
+	tw_layers_manager_init(&priv->layers, server->display);
+	tw_layer_init(&priv->layer);
+	tw_layer_set_position(&priv->layer, TW_LAYER_POS_DESKTOP_MID,
+	                      &priv->layers);
+
+	priv->server = server;
+	wl_list_init(&priv->surface_created.link);
+	priv->surface_created.notify = notify_bench_surface_created;
+	wl_signal_add(&priv->compositor.surface_created,
+	              &priv->surface_created);
+
+	server->loop = wl_display_get_event_loop(server->display);
+	server->compositor = &priv->compositor;
+	server->layers = &priv->layers;
+	server->layer = &priv->layer;
+	return true;
+err:
+	if (server->display)
+		wl_display_destroy(server->display);
+	free(priv);
+	return false;
+}
+
+void
+bench_server_fini(struct bench_server *server)
+{
+	struct bench_server_priv *priv =
+		wl_container_of(server->compositor, priv, compositor);
+
+	wl_display_destroy_clients(server->display);
+	wl_list_remove(&priv->surface_created.link);
+	wl_display_destroy(server->display);
+	free(server->surfaces);
+	free(priv);
+	memset(server, 0, sizeof(*server));
+}
+
+bool
+bench_server_add_client(struct bench_server *server, int fd)
+{
+	return wl_client_create(server->display, fd) != NULL;
+}
+
+uint64_t
+bench_server_dispatch(struct bench_server *server, int timeout)
+{
+	uint64_t start = bench_now_ns();
+
+	wl_event_loop_dispatch(server->loop, timeout);
+	wl_display_flush_clients(server->display);
+	return bench_now_ns() - start;
+}
+
+void
+bench_server_show_surface(struct bench_server *server,
+                          struct tw_surface *surface, int x, int y)
+{
+	tw_layer_add_surface(server->layer, surface);
+	tw_surface_set_position(surface, x, y);
+}
+
+uint64_t
+bench_roundtrip(struct bench_server *server, struct bench_client *client)
+{
+	uint64_t spent = 0;
+
+	bench_client_sync(client);
+	while (!bench_client_synced(client)) {
+		bench_client_dispatch(client);
+		spent += bench_server_dispatch(server, 100);
+		bench_client_dispatch(client);
+	}
+	return spent;
+}
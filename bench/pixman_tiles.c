@@ -0,0 +1,161 @@
+/*
+ * pixman_tiles.c - scaling of the tiled pixman renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pixman.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/pixman_renderer.h>
+
+#include "bench.h"
+
+/*
+ * Composites a synthetic desktop, an opaque background and a cascade of half
+ * transparent windows, with full damage into 1080p and 4K targets, for 1 to
+ * N render threads.
+ *
+ * usage: pixman_tiles [max_threads]
+ */
+
+#define N_WINDOWS 6
+#define N_WARMUP 3
+
+static const struct {
+	int width, height, frames;
+} sizes[] = {
+	{1920, 1080, 60},
+	{3840, 2160, 20},
+};
+
+static void
+init_surface(struct tw_surface *surface, void *data)
+{
+	tw_pixman_renderer_init_surface(data, surface);
+}
+
+static double
+run_frames(struct tw_pixman_renderer *renderer, pixman_image_t *target,
+           struct tw_layers_manager *layers, int frames)
+{
+	uint64_t start;
+
+	for (int i = 0; i < N_WARMUP; i++)
+		tw_pixman_renderer_draw(renderer, target, 0, 0, layers, NULL);
+	start = bench_now_ns();
+	for (int i = 0; i < frames; i++)
+		tw_pixman_renderer_draw(renderer, target, 0, 0, layers, NULL);
+	return (bench_now_ns() - start) / 1e6 / frames;
+}
+
+static bool
+bench_size(int width, int height, int frames, int max_threads)
+{
+	struct tw_pixman_renderer importer, renderer;
+	struct bench_server server;
+	struct bench_client *client;
+	pixman_image_t *target;
+	int w = width / 2, h = height / 2;
+	double base = 0.0, ms;
+
+	//surfaces import their buffers through this one
+	if (!tw_pixman_renderer_init(&importer, 1))
+		return false;
+	if (!bench_server_init(&server))
+		goto err_server;
+	server.new_surface = init_surface;
+	server.new_surface_data = &importer;
+	if (!(client = bench_client_connect(&server)))
+		goto err_client;
+	for (int i = 0; i <= N_WINDOWS; i++) {
+		//the first one is the background
+		struct bench_surface *surface =
+			bench_surface_create(client, NULL, 0, 0,
+			                     i ? w : width, i ? h : height, !i);
+		if (!surface)
+			goto err_surfaces;
+		bench_surface_commit(surface);
+	}
+	bench_roundtrip(&server, client);
+	if (server.n_surfaces != N_WINDOWS + 1)
+		goto err_surfaces;
+
+	bench_server_show_surface(&server, server.surfaces[0], 0, 0);
+	for (int i = 1; i <= N_WINDOWS; i++)
+		bench_server_show_surface(&server, server.surfaces[i],
+		                          (width - w) * (i - 1) /
+		                          (N_WINDOWS - 1),
+		                          (height - h) * (i - 1) /
+		                          (N_WINDOWS - 1));
+
+	target = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+	                                  NULL, width * 4);
+	if (!target)
+		goto err_surfaces;
+	for (int n = 1; n <= max_threads; n++) {
+		if (!tw_pixman_renderer_init(&renderer, n))
+			break;
+		ms = run_frames(&renderer, target, server.layers, frames);
+		tw_pixman_renderer_fini(&renderer);
+		if (n == 1)
+			base = ms;
+		printf("%dx%d\t%d\t%.3f\t%.2f\n", width, height, n, ms,
+		       base / ms);
+	}
+	pixman_image_unref(target);
+
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	tw_pixman_renderer_fini(&importer);
+	return true;
+err_surfaces:
+	bench_client_destroy(client);
+err_client:
+	bench_server_fini(&server);
+err_server:
+	tw_pixman_renderer_fini(&importer);
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (max_threads < 1)
+		max_threads = 1;
+	if (max_threads > TW_PIXMAN_MAX_THREADS)
+		max_threads = TW_PIXMAN_MAX_THREADS;
+
+	printf("size\tthreads\tms/frame\tspeedup\n");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		if (!bench_size(sizes[i].width, sizes[i].height,
+		                sizes[i].frames, max_threads)) {
+			fprintf(stderr, "failed to setup %dx%d\n",
+			        sizes[i].width, sizes[i].height);
+			return EXIT_FAILURE;
+		}
+	return EXIT_SUCCESS;
+}
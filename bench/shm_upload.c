@@ -0,0 +1,272 @@
+/*
+ * shm_upload.c - commit latency with and without the shm uploader
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/pixman_renderer.h>
+#include <taiwins/objects/shm_upload.h>
+
+#include "bench.h"
+
+/*
+ * Ten clients commit a full damaged 4K shm buffer every frame. The dispatch
+ * latency is the time the event loop takes to get through the commits of all
+ * of them, which is what delays input and frame callbacks of every other
+ * client. Without the uploader the copies happen in there, with it they run
+ * on the worker and the completion is the time until all the buffers are
+ * released.
+ *
+ * In the lockstep runs the clients wait for every release before the next
+ * commit. In the pipelined runs a client commits again as soon as its buffer
+ * is released, so each of them has an upload in flight all the time, the
+ * frames shown are the updates of the surface textures.
+ *
+ * usage: shm_upload [frames]
+ */
+
+#define N_CLIENTS 10
+#define WIDTH 3840
+#define HEIGHT 2160
+
+struct stats {
+	uint64_t dispatch_sum, dispatch_max, done_sum, done_max;
+};
+
+struct shown_counter {
+	struct wl_listener listener;
+	unsigned int frames;
+};
+
+static void
+init_surface(struct tw_surface *surface, void *data)
+{
+	tw_pixman_renderer_init_surface(data, surface);
+}
+
+static void
+notify_frame_shown(struct wl_listener *listener, void *data)
+{
+	struct shown_counter *counter =
+		wl_container_of(listener, counter, listener);
+
+	counter->frames++;
+}
+
+static bool
+clients_synced(struct bench_client **clients)
+{
+	for (int i = 0; i < N_CLIENTS; i++)
+		if (!bench_client_synced(clients[i]))
+			return false;
+	return true;
+}
+
+static bool
+surfaces_released(struct bench_surface **surfaces)
+{
+	for (int i = 0; i < N_CLIENTS; i++)
+		if (bench_surface_busy(surfaces[i]))
+			return false;
+	return true;
+}
+
+static void
+dispatch_clients(struct bench_client **clients)
+{
+	for (int i = 0; i < N_CLIENTS; i++)
+		bench_client_dispatch(clients[i]);
+}
+
+/* commit on every client and wait for the dispatch and the releases */
+static void
+run_frame(struct bench_server *server, struct bench_client **clients,
+          struct bench_surface **surfaces, struct stats *stats)
+{
+	uint64_t start, dispatch, done;
+
+	for (int i = 0; i < N_CLIENTS; i++) {
+		bench_surface_commit(surfaces[i]);
+		bench_client_sync(clients[i]);
+	}
+	dispatch_clients(clients);
+
+	start = bench_now_ns();
+	while (!clients_synced(clients)) {
+		bench_server_dispatch(server, 100);
+		dispatch_clients(clients);
+	}
+	dispatch = bench_now_ns() - start;
+	while (!surfaces_released(surfaces)) {
+		bench_server_dispatch(server, 100);
+		dispatch_clients(clients);
+	}
+	done = bench_now_ns() - start;
+
+	stats->dispatch_sum += dispatch;
+	stats->dispatch_max = dispatch > stats->dispatch_max ?
+		dispatch : stats->dispatch_max;
+	stats->done_sum += done;
+	stats->done_max = done > stats->done_max ? done : stats->done_max;
+}
+
+static void
+run_lockstep(bool async, struct bench_server *server,
+             struct bench_client **clients, struct bench_surface **surfaces,
+             int frames)
+{
+	struct stats stats = {0};
+
+	for (int i = 0; i < frames; i++)
+		run_frame(server, clients, surfaces, &stats);
+	printf("%s\tlockstep\t%.3f\t%.3f\t%.3f\t%.3f\t-\n",
+	       async ? "uploader" : "inline",
+	       stats.dispatch_sum / 1e6 / frames, stats.dispatch_max / 1e6,
+	       stats.done_sum / 1e6 / frames, stats.done_max / 1e6);
+}
+
+/* every client commits again once released until it has committed frames */
+static void
+run_pipelined(bool async, struct bench_server *server,
+              struct bench_client **clients, struct bench_surface **surfaces,
+              int frames)
+{
+	struct shown_counter shown[N_CLIENTS];
+	int commits[N_CLIENTS] = {0}, total = 0;
+	uint64_t start, spent, dispatch = 0, dispatch_max = 0;
+	unsigned int min_shown = ~0u;
+
+	for (int i = 0; i < N_CLIENTS; i++) {
+		struct tw_pixman_texture *texture =
+			server->surfaces[i]->buffer.handle.ptr;
+
+		shown[i].frames = 0;
+		wl_list_init(&shown[i].listener.link);
+		shown[i].listener.notify = notify_frame_shown;
+		if (async)
+			wl_signal_add(&texture->staging.signals.ready,
+			              &shown[i].listener);
+	}
+
+	start = bench_now_ns();
+	while (total < N_CLIENTS * frames ||
+	       !surfaces_released(surfaces)) {
+		for (int i = 0; i < N_CLIENTS; i++) {
+			if (commits[i] == frames ||
+			    bench_surface_busy(surfaces[i]))
+				continue;
+			bench_surface_commit(surfaces[i]);
+			commits[i]++;
+			total++;
+		}
+		dispatch_clients(clients);
+		spent = bench_server_dispatch(server, 100);
+		dispatch += spent;
+		dispatch_max = spent > dispatch_max ? spent : dispatch_max;
+		dispatch_clients(clients);
+	}
+	spent = bench_now_ns() - start;
+
+	for (int i = 0; i < N_CLIENTS; i++) {
+		unsigned int n = async ? shown[i].frames : (unsigned)frames;
+
+		min_shown = n < min_shown ? n : min_shown;
+		wl_list_remove(&shown[i].listener.link);
+	}
+	printf("%s\tpipelined\t%.3f\t%.3f\t%.3f\t-\t%u\n",
+	       async ? "uploader" : "inline",
+	       dispatch / 1e6 / frames, dispatch_max / 1e6,
+	       spent / 1e6 / frames, min_shown);
+}
+
+static bool
+bench_mode(bool async, int frames)
+{
+	struct tw_pixman_renderer renderer;
+	struct tw_shm_uploader uploader;
+	struct bench_server server;
+	struct bench_client *clients[N_CLIENTS] = {0};
+	struct bench_surface *surfaces[N_CLIENTS] = {0};
+	struct stats stats = {0};
+	bool ret = false;
+
+	if (!tw_pixman_renderer_init(&renderer, 1))
+		return false;
+	if (!bench_server_init(&server))
+		goto out_server;
+	if (async) {
+		if (!tw_shm_uploader_init(&uploader, server.display))
+			goto out_uploader;
+		tw_pixman_renderer_set_uploader(&renderer, &uploader);
+	}
+	server.new_surface = init_surface;
+	server.new_surface_data = &renderer;
+
+	for (int i = 0; i < N_CLIENTS; i++) {
+		if (!(clients[i] = bench_client_connect(&server)))
+			goto out;
+		surfaces[i] = bench_surface_create(clients[i], NULL, 0, 0,
+		                                   WIDTH, HEIGHT, true);
+		if (!surfaces[i])
+			goto out;
+	}
+	//first upload allocates the storage
+	run_frame(&server, clients, surfaces, &stats);
+	if (server.n_surfaces != N_CLIENTS)
+		goto out;
+
+	run_lockstep(async, &server, clients, surfaces, frames);
+	run_pipelined(async, &server, clients, surfaces, frames);
+	ret = true;
+out:
+	for (int i = 0; i < N_CLIENTS; i++)
+		if (clients[i])
+			bench_client_destroy(clients[i]);
+	//the staging of the surfaces goes with them
+	wl_display_destroy_clients(server.display);
+	if (async)
+		tw_shm_uploader_fini(&uploader);
+out_uploader:
+	bench_server_fini(&server);
+out_server:
+	tw_pixman_renderer_fini(&renderer);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 30;
+
+	if (frames < 1)
+		frames = 1;
+	printf("%d clients committing %dx%d shm buffers, in ms per frame\n",
+	       N_CLIENTS, WIDTH, HEIGHT);
+	printf("mode\tclients\tdispatch\tdispatch_max\tdone\tdone_max"
+	       "\tshown\n");
+	if (!bench_mode(false, frames) || !bench_mode(true, frames)) {
+		fprintf(stderr, "failed to setup the clients\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
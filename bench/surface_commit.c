@@ -0,0 +1,116 @@
+/*
+ * surface_commit.c - commit cost of subsurface trees
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+
+#include "bench.h"
+
+/*
+ * A client commits every surface of a tree of synchronized subsurfaces each
+ * frame, the children first, then the root, which applies the whole tree. The
+ * time is what the server spent dispatching until the roundtrip after the
+ * root commit, for a chain of nested subsurfaces (depth) and for subsurfaces
+ * all under the root (width).
+ *
+ * usage: surface_commit [frames]
+ */
+
+#define MAX_NODES 64
+#define SURFACE_SIZE 32
+
+enum tree_shape {
+	TREE_DEPTH,
+	TREE_WIDTH,
+};
+
+static bool
+bench_tree(enum tree_shape shape, int n_nodes, int frames)
+{
+	struct bench_server server;
+	struct bench_client *client;
+	struct bench_surface *surfaces[MAX_NODES + 1];
+	uint64_t spent = 0;
+	double us;
+
+	if (!bench_server_init(&server))
+		return false;
+	if (!(client = bench_client_connect(&server))) {
+		bench_server_fini(&server);
+		return false;
+	}
+	//surfaces[0] is the root, the others are subsurfaces
+	for (int i = 0; i <= n_nodes; i++) {
+		struct bench_surface *parent = !i ? NULL :
+			shape == TREE_DEPTH ? surfaces[i-1] : surfaces[0];
+
+		surfaces[i] = bench_surface_create(client, parent, i, i,
+		                                   SURFACE_SIZE, SURFACE_SIZE,
+		                                   false);
+		if (!surfaces[i])
+			goto err;
+	}
+	for (int i = n_nodes; i >= 0; i--)
+		bench_surface_commit(surfaces[i]);
+	bench_roundtrip(&server, client);
+	if (server.n_surfaces != (size_t)n_nodes + 1)
+		goto err;
+	bench_server_show_surface(&server, server.surfaces[0], 0, 0);
+
+	for (int f = 0; f < frames; f++) {
+		//deepest first, so every parent commit applies its children
+		for (int i = n_nodes; i >= 0; i--)
+			bench_surface_commit(surfaces[i]);
+		spent += bench_roundtrip(&server, client);
+	}
+	us = spent / 1e3 / frames;
+	printf("%s\t%d\t%.2f\t%.3f\n",
+	       shape == TREE_DEPTH ? "depth" : "width", n_nodes, us,
+	       us / (n_nodes + 1));
+
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	return true;
+err:
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 1000;
+
+	if (frames < 1)
+		frames = 1;
+	printf("tree\tnodes\tus/frame\tus/commit\n");
+	for (int shape = TREE_DEPTH; shape <= TREE_WIDTH; shape++)
+		for (int n = 1; n <= MAX_NODES; n *= 2)
+			if (!bench_tree(shape, n, frames)) {
+				fprintf(stderr, "failed to setup the tree\n");
+				return EXIT_FAILURE;
+			}
+	return EXIT_SUCCESS;
+}
@@ -25,6 +25,7 @@
 #include <wayland-server-core.h>
 #include <wayland-server.h>
 #include "utils.h"
+#include "damage.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -43,6 +44,12 @@ struct tw_compositor {
         /** allocator for objects */
 	const struct tw_allocator *obj_alloc;
 
+	/** damage simplification of the surfaces created here */
+	struct {
+		struct tw_damage_policy policy;
+		struct tw_damage_stats stats;
+	} damage;
+
 	struct wl_listener destroy_listener;
 };
 
@@ -75,6 +82,24 @@ bool
 tw_compositor_init(struct tw_compositor *compositor,
                    struct wl_display *display);
 
+/**
+ * @brief set the damage simplification policy applied at every commit.
+ *
+ * Both surface damage and buffer damage of the committed state are simplified
+ * for the surfaces of this compositor, the policy is disabled by default.
+ */
+void
+tw_compositor_set_damage_policy(struct tw_compositor *compositor,
+                                const struct tw_damage_policy *policy);
+
+/**
+ * @brief the rectangles of the buffer damage before and after simplification,
+ * summed over the commits. The surface damage is not counted.
+ */
+void
+tw_compositor_get_damage_stats(struct tw_compositor *compositor,
+                               struct tw_damage_stats *stats);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,147 @@
+/*
+ * damage.h - taiwins output damage tracker
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_DAMAGE_H
+#define TW_DAMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pixman.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/** number of previous frames kept by the damage tracker */
+#define TW_DAMAGE_HISTORY 4
+
+struct tw_surface;
+
+/**
+ * @brief per-output damage history
+ *
+ * The tracker accumulates the damage of the frame in construction and keeps
+ * the damage of the last TW_DAMAGE_HISTORY frames in a ring, so a backend can
+ * repaint only the region that is out of date in a back buffer of a given
+ * age(EGL_EXT_buffer_age) instead of the whole output.
+ *
+ * All the damages are in the global coordinates, clipped by the output
+ * geometry.
+ */
+struct tw_damage_tracker {
+	pixman_box32_t geometry;
+	/* damage for the frame in construction */
+	pixman_region32_t current;
+	pixman_region32_t history[TW_DAMAGE_HISTORY];
+	/* index of the last swapped frame */
+	unsigned int head;
+	/* number of valid frames in history */
+	unsigned int count;
+};
+
+/**
+ * @brief policy for limiting the complexity of a damage region
+ *
+ * Clients may post hundreds of tiny damages per frame, a merged region is
+ * usually cheaper for transforming, uploading and scissoring.
+ */
+struct tw_damage_policy {
+	/** two rectangles merges if the bbox wastes less than this percentage
+	 * of area, 0 disables merging */
+	unsigned int merge_waste;
+	/** collapse to the extents when there are more rectangles than this,
+	 * 0 disables collapsing */
+	unsigned int max_rects;
+};
+
+struct tw_damage_stats {
+	uint64_t rects_in;
+	uint64_t rects_out;
+};
+
+/**
+ * @brief simplify the damage region by the policy
+ *
+ * The resulted region always covers the original one, stats is optional and
+ * accumulates the number of rectangles before and after simplification.
+ */
+void
+tw_damage_simplify(pixman_region32_t *region,
+                   const struct tw_damage_policy *policy,
+                   struct tw_damage_stats *stats);
+
+void
+tw_damage_tracker_init(struct tw_damage_tracker *tracker);
+
+void
+tw_damage_tracker_fini(struct tw_damage_tracker *tracker);
+
+/**
+ * @brief set the output geometry in global coordinates.
+ *
+ * The history is invalidated if geometry changes.
+ */
+void
+tw_damage_tracker_set_geometry(struct tw_damage_tracker *tracker,
+                               int32_t x, int32_t y,
+                               uint32_t width, uint32_t height);
+void
+tw_damage_tracker_add_region(struct tw_damage_tracker *tracker,
+                             pixman_region32_t *damage);
+/**
+ * @brief collect the damage of the surface for this frame.
+ *
+ * It takes both geometry dirty region and the committed surface damage, call
+ * it before tw_surface_flush_frame clears them.
+ */
+void
+tw_damage_tracker_add_surface(struct tw_damage_tracker *tracker,
+                              struct tw_surface *surface);
+/**
+ * @brief damage the whole output for the frame in construction.
+ */
+void
+tw_damage_tracker_damage_whole(struct tw_damage_tracker *tracker);
+
+/**
+ * @brief get the region need repaint for a back buffer of given age.
+ *
+ * Buffer age follows the EGL_EXT_buffer_age, 0 means unknown content, 1 means
+ * the buffer is the last presented frame. The whole output is returned if the
+ * age is out of the history. Returns false in that case.
+ */
+bool
+tw_damage_tracker_get_buffer_damage(struct tw_damage_tracker *tracker,
+                                    int age, pixman_region32_t *damage);
+/**
+ * @brief push the damage of current frame into history.
+ *
+ * Called after the frame is submitted to the output.
+ */
+void
+tw_damage_tracker_swap(struct tw_damage_tracker *tracker);
+
+#ifdef  __cplusplus
+}
+#endif
+
+
+#endif /* EOF */
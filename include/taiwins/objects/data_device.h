@@ -112,6 +112,37 @@ struct tw_data_device {
 
 	struct wl_signal source_added;
 	struct wl_signal source_removed;
+	struct wl_signal destroy_signal;
+};
+
+#define TW_CLIPBOARD_DEFAULT_CAP (16 * 1024 * 1024)
+
+/**
+ * @brief clipboard manager keeps the selection after its client is gone.
+ *
+ * Every selection set on the device is read into memory files by the event
+ * loop, the manager takes over the selection when the source is destroyed
+ * and serves the stored copies without blocking the compositor.
+ */
+struct tw_clipboard_manager {
+	struct tw_data_device *device;
+	struct wl_event_loop *loop;
+	/** the client source being read */
+	struct tw_data_source *watched;
+	/** the stored copy, set as selection once watched is gone */
+	struct tw_data_source source;
+	bool source_set, publish;
+
+	struct wl_list entries;
+	struct wl_list writers;
+	uint32_t reading;
+
+	size_t default_cap;
+	struct wl_array caps;
+
+	struct wl_listener source_added;
+	struct wl_listener source_removed;
+	struct wl_listener device_destroy;
 };
 
 struct tw_data_device_manager {
@@ -131,6 +162,21 @@ tw_data_device_set_selection(struct tw_data_device *device,
 struct tw_data_device_manager *
 tw_data_device_manager_create_global(struct wl_display *display);
 
+bool
+tw_clipboard_manager_init(struct tw_clipboard_manager *manager,
+                          struct tw_data_device *device,
+                          struct wl_display *display);
+void
+tw_clipboard_manager_fini(struct tw_clipboard_manager *manager);
+
+/**
+ * @brief limit the size stored for the mime types starting with the prefix,
+ * 0 disables storing them. The longest matching prefix applies.
+ */
+bool
+tw_clipboard_manager_set_cap(struct tw_clipboard_manager *manager,
+                             const char *mime_prefix, size_t cap);
+
 bool
 tw_data_device_manager_init(struct tw_data_device_manager *manager,
                             struct wl_display *display);
@@ -26,9 +26,12 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <wayland-server-core.h>
 #include <wayland-server.h>
 
+#include "drm_formats.h"
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -36,6 +39,7 @@ extern "C" {
 #define TW_DMA_MAX_PLANES 4
 
 struct tw_linux_dmabuf;
+struct tw_dmabuf_buffer;
 
 enum tw_dmabuf_attributes_flags {
 	TW_DMABUF_ATTRIBUTES_FLAGS_Y_INVERT = 1,
@@ -55,6 +59,36 @@ struct tw_dmabuf_attributes {
 	bool modifier_used;
 };
 
+enum tw_linux_dmabuf_tranche_flags {
+	TW_DMABUF_TRANCHE_FLAGS_SCANOUT = 1,
+};
+
+/* the entry layout of the format table, defined by linux-dmabuf v4 */
+struct tw_linux_dmabuf_table_entry {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+};
+
+struct tw_linux_dmabuf_tranche {
+	dev_t target_device;
+	uint32_t flags;
+	/** uint16_t indices into the format table */
+	struct wl_array indices;
+};
+
+/**
+ * @brief dmabuf feedback for version 4 clients
+ *
+ * Tranches are in the order of preference, the formats are referred by their
+ * indices in the format table of tw_linux_dmabuf, so the feedback is only valid
+ * for the tw_linux_dmabuf it is built with.
+ */
+struct tw_linux_dmabuf_feedback {
+	dev_t main_device;
+	struct wl_array tranches;
+};
+
 struct tw_linux_dmabuf_impl {
 	/**
 	 * the protocol interface need a backend to does the actual IO work, we
@@ -71,16 +105,37 @@ struct tw_linux_dmabuf_impl {
 	                          void *callback, int format,
 	                          uint64_t *modifiers,
 	                          size_t *nmodifiers);
-	bool (*test_import)(struct tw_dmabuf_attributes *attrs,
+	/**
+	 * the image imported for testing may be kept in the image_cache of
+	 * the buffer for later use.
+	 */
+	bool (*test_import)(struct tw_dmabuf_buffer *buffer,
 	                    void *callback);
 };
 
 struct tw_linux_dmabuf {
 	struct wl_display *display;
 	struct wl_global *global;
+	/** version of the global, 4 only once the main device is known */
+	uint32_t version;
 	struct wl_listener destroy_listener;
 	const struct tw_linux_dmabuf_impl *impl;
 	void *impl_userdata;
+
+	/**
+	 * format table built once from the impl, the sealed fd is shared by
+	 * all the clients. The fd is -1 if sealing is not available, every
+	 * client gets a copy then.
+	 */
+	struct {
+		struct tw_linux_dmabuf_table_entry *entries;
+		size_t len;
+		int fd;
+	} table;
+	struct tw_linux_dmabuf_feedback default_feedback;
+	/* feedback resources using the default feedback */
+	struct wl_list default_resources;
+	struct wl_list surface_feedbacks;
 };
 
 /**
@@ -97,6 +152,20 @@ struct tw_dmabuf_buffer {
 	struct wl_resource *buffer_resource;
 
 	struct tw_dmabuf_attributes attributes;
+
+	/**
+	 * image imported from the buffer by the renderer, it lives as long as
+	 * the wl_buffer so re-attaching a buffer does not import it again.
+	 */
+	struct {
+		void *image;
+		void *importer;
+		bool external;
+		/** link in the importer, for releasing the images before it
+		 * is gone */
+		struct wl_list link;
+		void (*release)(struct tw_dmabuf_buffer *buffer);
+	} image_cache;
 };
 
 struct tw_linux_dmabuf *
@@ -105,6 +174,44 @@ tw_dmabuf_create_global(struct wl_display *display);
 bool
 tw_linux_dmabuf_init(struct tw_linux_dmabuf *dma, struct wl_display *display);
 
+/**
+ * @brief set the main device and build the default feedback from all the
+ * formats in the table.
+ *
+ * It shall be called after the impl is set, all the clients using the default
+ * feedback get the update. Until then the global is advertised at version 3,
+ * which has no feedback, so the setups without EGL_EXT_device_drm never send
+ * a made up main device. The first call replaces the global with a version 4
+ * one, better done before any client binds.
+ */
+bool
+tw_linux_dmabuf_set_main_device(struct tw_linux_dmabuf *dma, dev_t device);
+
+/**
+ * @brief use a different feedback for a wl_surface, NULL resets to default.
+ *
+ * The feedback is owned by the caller, it needs to outlive the surface or be
+ * reset before freeing.
+ */
+void
+tw_linux_dmabuf_set_surface_feedback(struct tw_linux_dmabuf *dma,
+                                     struct wl_resource *surface,
+                                     const struct tw_linux_dmabuf_feedback *fb);
+void
+tw_linux_dmabuf_feedback_init(struct tw_linux_dmabuf_feedback *feedback,
+                              dev_t main_device);
+void
+tw_linux_dmabuf_feedback_fini(struct tw_linux_dmabuf_feedback *feedback);
+
+/**
+ * @brief add a tranche of the formats, NULL formats means everything in the
+ * format table. Formats not in the table are ignored.
+ */
+bool
+tw_linux_dmabuf_feedback_add_tranche(struct tw_linux_dmabuf *dma,
+                                     struct tw_linux_dmabuf_feedback *feedback,
+                                     dev_t target_device, uint32_t flags,
+                                     const struct tw_drm_formats *formats);
 bool
 tw_is_wl_buffer_dmabuf(struct wl_resource *resource);
 
@@ -23,6 +23,7 @@
 #define TW_DRM_FORMATS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
 
@@ -41,6 +42,13 @@ struct tw_drm_modifier {
 	bool external;
 };
 
+/**
+ * @brief a set of formats, each with a set of modifiers
+ *
+ * formats are sorted by fourcc and the modifiers of a format are sorted and
+ * unique in the range [cursor, cursor+len) of the modifiers array, so lookups
+ * are binary searches and set operations are linear merges.
+ */
 struct tw_drm_formats {
 	struct wl_array formats;
 	struct wl_array modifiers;
@@ -55,6 +63,9 @@ tw_drm_formats_fini(struct tw_drm_formats *formats);
 size_t
 tw_drm_formats_count(struct tw_drm_formats *formats);
 
+/**
+ * @brief add a format, modifiers are merged if the format exists already
+ */
 bool
 tw_drm_formats_add_format(struct tw_drm_formats *formats, uint32_t format,
                           int n_mods, uint64_t *modifiers,
@@ -65,9 +76,40 @@ tw_drm_format_find(const struct tw_drm_formats *formats, uint32_t format);
 const struct tw_drm_modifier *
 tw_drm_modifiers_get(const struct tw_drm_formats *formats,
                      const struct tw_drm_format *fmt);
+const struct tw_drm_modifier *
+tw_drm_format_find_modifier(const struct tw_drm_formats *formats,
+                            uint32_t format, uint64_t modifier);
 bool
 tw_drm_formats_is_modifier_external(struct tw_drm_formats *formats,
                                     uint32_t format, uint64_t modifier);
+/**
+ * @brief set operations on formats, dst needs to be initialized and its
+ * content is replaced. A modifier is external if it is in either input.
+ *
+ * Formats without modifiers only intersect with formats without modifiers.
+ */
+bool
+tw_drm_formats_intersect(struct tw_drm_formats *dst,
+                         const struct tw_drm_formats *a,
+                         const struct tw_drm_formats *b);
+bool
+tw_drm_formats_union(struct tw_drm_formats *dst,
+                     const struct tw_drm_formats *a,
+                     const struct tw_drm_formats *b);
+bool
+tw_drm_formats_equal(const struct tw_drm_formats *a,
+                     const struct tw_drm_formats *b);
+/**
+ * @brief save the formats to a binary file tagged with a key
+ *
+ * Reading only succeeds if the key matches, formats are left empty otherwise.
+ */
+bool
+tw_drm_formats_write(const struct tw_drm_formats *formats, const char *path,
+                     const char *key);
+bool
+tw_drm_formats_read(struct tw_drm_formats *formats, const char *path,
+                    const char *key);
 
 #ifdef  __cplusplus
 }
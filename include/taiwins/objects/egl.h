@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
 
@@ -49,6 +50,8 @@ struct tw_egl_options {
 
 	const EGLint *context_attribs;
 	const EGLint *platform_attribs;
+	/** optional file caching the probed dmabuf formats, NULL to disable */
+	const char *format_cache;
 };
 
 struct tw_egl {
@@ -63,6 +66,15 @@ struct tw_egl {
 	bool import_dmabuf, import_dmabuf_modifiers;
 	unsigned int internal_format;
 	struct tw_drm_formats drm_formats;
+	/** dmabuf buffers holding images imported by us */
+	struct wl_list dmabuf_images;
+	/** formats loaded from the cache are probed again in the background,
+	 * the file is refreshed for the next start if they differ */
+	struct {
+		char *path, *key;
+		pthread_t thread;
+		bool checking;
+	} format_cache;
 };
 
 
@@ -106,6 +118,16 @@ tw_egl_import_wl_drm_image(struct tw_egl *egl, struct wl_resource *data,
 EGLImageKHR
 tw_egl_import_dmabuf_image(struct tw_egl *egl,
                            struct tw_dmabuf_attributes *attrs, bool *external);
+/**
+ * @brief import the dmabuf buffer with its cached image.
+ *
+ * The image is owned by the buffer and released with the wl_buffer, the
+ * caller shall not destroy it. Renderers should use it for dmabuf buffers so
+ * clients cycling through their swapchain reuse the images.
+ */
+EGLImageKHR
+tw_egl_import_dmabuf_buffer(struct tw_egl *egl,
+                            struct tw_dmabuf_buffer *buffer, bool *external);
 bool
 tw_egl_image_export_dmabuf(struct tw_egl *egl, EGLImage image,
                            int width, int height, uint32_t flags,
@@ -0,0 +1,195 @@
+/*
+ * gles2_renderer.h - taiwins reference GLES2 renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_GLES2_RENDERER_H
+#define TW_GLES2_RENDERER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include "egl.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct tw_surface;
+struct tw_layers_manager;
+
+struct tw_gles2_shader {
+	GLuint prog;
+	GLint proj, texproj, tex;
+	GLint pos;
+};
+
+/**
+ * @brief a reference renderer drawing the layers into offscreen targets.
+ *
+ * It runs on EGL_PLATFORM_SURFACELESS_MESA so it works without a display
+ * server or a GPU (llvmpipe), which makes it usable for measuring and testing
+ * the objects. Textures are uploaded through the tw_surface_buffer import
+ * hook at commit.
+ */
+struct tw_gles2_renderer {
+	struct tw_egl egl;
+	struct wl_display *display;
+
+	struct {
+		struct tw_gles2_shader rgba, rgbx, ext;
+	} shaders;
+	bool has_bgra, has_unpack_subimage, has_external;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+
+	/** the surfaces of tw_gles2_renderer_init_surface */
+	struct wl_list surfaces;
+	/** surface textures, the most recently drawn first */
+	struct {
+		struct wl_list lru;
+		size_t budget, used;
+		uint32_t pass;
+	} textures;
+};
+
+#define TW_GLES2_TEXTURE_CACHE_SIZE 3
+#define TW_GLES2_SNAPSHOT_SIZE 256
+
+/**
+ * @brief the texture of one wl_buffer attached to the surface
+ */
+struct tw_gles2_texture_entry {
+	struct tw_gles2_texture *texture;
+	/** NULL if the entry is unused or the buffer is gone */
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	GLuint id;
+	GLenum target;
+	GLint format; /**< GL format of shm uploads, 0 for images */
+	int width, height;
+	bool has_alpha, y_flip;
+	/** damage committed through other buffers since the last upload */
+	pixman_region32_t stale;
+	uint32_t last_use;
+};
+
+/**
+ * @brief per-surface cache of the textures of its wl_buffers.
+ *
+ * Clients cycle through a few buffers, an attach of a cached buffer does not
+ * import it again. An entry is dropped when its buffer is destroyed, when the
+ * surface is resized or when it is the least recently used.
+ */
+struct tw_gles2_texture {
+	struct tw_gles2_renderer *renderer;
+	struct tw_surface *surface;
+	struct tw_gles2_texture_entry entries[TW_GLES2_TEXTURE_CACHE_SIZE];
+	/** the one on screen */
+	struct tw_gles2_texture_entry *current;
+	uint32_t uses;
+	struct wl_listener surface_destroy;
+
+	struct wl_list lru_link;
+	size_t size; /**< bytes of the cached entries */
+	uint32_t visible_pass;
+	/** downscaled copy drawn after eviction, only the GL fields are used */
+	struct tw_gles2_texture_entry snapshot;
+};
+
+/**
+ * @brief offscreen render target, x, y is its position in global coordinates
+ */
+struct tw_gles2_render_target {
+	GLuint fbo, rbo;
+	int x, y, width, height;
+};
+
+bool
+tw_gles2_renderer_init(struct tw_gles2_renderer *renderer,
+                       struct wl_display *display);
+/**
+ * @brief release the renderer, the textures of the surfaces still alive are
+ * released as well and their import hooks are cleared.
+ */
+void
+tw_gles2_renderer_fini(struct tw_gles2_renderer *renderer);
+
+/**
+ * @brief set the memory budget of the surface textures in bytes.
+ *
+ * Only the shm uploads count, dmabuf and wl_drm textures are backed by client
+ * memory and are never evicted. No limit by default. Over the budget, the
+ * textures of the surfaces which are unmapped, minimized or not in any visible
+ * layer are evicted, the least recently drawn first, 0 evicts all of them. A
+ * snapshot of at most TW_GLES2_SNAPSHOT_SIZE is drawn instead until the surface
+ * commits again.
+ */
+void
+tw_gles2_renderer_set_texture_budget(struct tw_gles2_renderer *renderer,
+                                     size_t budget);
+/**
+ * @brief run the eviction, tw_gles2_renderer_draw does it before drawing.
+ */
+void
+tw_gles2_renderer_evict_textures(struct tw_gles2_renderer *renderer,
+                                 struct tw_layers_manager *manager);
+
+/**
+ * @brief let the renderer upload the buffers of the surface, it shall be
+ * called right after the surface is created.
+ */
+void
+tw_gles2_renderer_init_surface(struct tw_gles2_renderer *renderer,
+                               struct tw_surface *surface);
+bool
+tw_gles2_render_target_init(struct tw_gles2_renderer *renderer,
+                            struct tw_gles2_render_target *target,
+                            int x, int y, int width, int height);
+void
+tw_gles2_render_target_fini(struct tw_gles2_renderer *renderer,
+                            struct tw_gles2_render_target *target);
+/**
+ * @brief draw the layers into the target, clipped to damage.
+ *
+ * damage is in global coordinates, NULL repaints the whole target.
+ */
+void
+tw_gles2_renderer_draw(struct tw_gles2_renderer *renderer,
+                       struct tw_gles2_render_target *target,
+                       struct tw_layers_manager *manager,
+                       pixman_region32_t *damage);
+/**
+ * @brief read back the target as RGBA8888, top row first.
+ *
+ * data needs to hold width * height * 4 bytes.
+ */
+bool
+tw_gles2_render_target_read_pixels(struct tw_gles2_renderer *renderer,
+                                   struct tw_gles2_render_target *target,
+                                   void *data);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* EOF */
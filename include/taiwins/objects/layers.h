@@ -22,6 +22,7 @@
 #ifndef TW_LAYERS_H
 #define TW_LAYERS_H
 
+#include <stdint.h>
 #include <wayland-server.h>
 
 #ifdef  __cplusplus
@@ -70,12 +71,23 @@ enum tw_layer_pos {
 	TW_LAYER_POS_CURSOR           = 0xffffffff,
 };
 
+/* cell size of the spatial index in global coordinates */
+#define TW_LAYERS_GRID_CELL 256
+/* number of hash buckets of the spatial index */
+#define TW_LAYERS_GRID_BUCKETS 256
+
+struct tw_surface;
+
 /**
  * @brief similar to weston_layer
+ *
+ * the views list is ordered from top to bottom.
  */
 struct tw_layer {
 	struct wl_list link;
 	enum tw_layer_pos position;
+	/* set by tw_layer_set_position */
+	struct tw_layers_manager *manager;
 
 	struct wl_list views;
 };
@@ -88,6 +100,20 @@ struct tw_layers_manager {
 	struct wl_listener destroy_listener;
 	//global layers
 	struct tw_layer cursor_layer;
+
+	/**
+	 * uniform grid for picking surfaces, every bucket is a list of grid
+	 * nodes sorted from top to bottom. The surface geometry are updated
+	 * through the surface dirty signal, surfaces join and leave the grid
+	 * with the layer and subsurface changes, see tw_layers_manager_reorder
+	 * for what is not tracked.
+	 */
+	struct {
+		struct wl_list buckets[TW_LAYERS_GRID_BUCKETS];
+		struct wl_list entries;
+		uint32_t generation;
+		uint64_t order;
+	} grid;
 };
 
 void
@@ -99,12 +125,58 @@ tw_layer_set_position(struct tw_layer *layer, enum tw_layer_pos pos,
 void
 tw_layer_unset_position(struct tw_layer *layer);
 
+/**
+ * @brief put the surface on the top of the layer, with its subsurfaces.
+ *
+ * The surface is removed from its previous layer first, so adding it again
+ * raises it. The surfaces are indexed for picking if the layer is positioned.
+ */
+void
+tw_layer_add_surface(struct tw_layer *layer, struct tw_surface *surface);
+
+void
+tw_layer_remove_surface(struct tw_surface *surface);
+
 struct tw_layers_manager *
 tw_layers_manager_create_global(struct wl_display *display);
 
 void
 tw_layers_manager_init(struct tw_layers_manager *manager,
                        struct wl_display *display);
+/**
+ * @brief index all the surfaces in the layers again for picking.
+ *
+ * The surfaces and their subsurfaces in the positioned layers(except the
+ * cursor layer) are indexed for tw_layers_manager_pick_surface. Positioning
+ * layers, tw_layer_add_surface, tw_layer_remove_surface, new subsurfaces
+ * (on the commit of the parent) and destroyed subsurfaces update the index
+ * themselves. It is only needed after restacking without them, like inserting
+ * into tw_layer::views directly, wl_subsurface.place_above/place_below or
+ * subsurface lists changed by the shells such as the popups.
+ *
+ * It costs O(n) in the number of surfaces, plus sorting the nodes into the
+ * buckets of the cells they cover.
+ */
+void
+tw_layers_manager_reorder(struct tw_layers_manager *manager);
+
+/**
+ * @brief compute the visible region of every surface in the layers.
+ *
+ * Going from front to back, the visible region of a surface is its geometry
+ * subtracting the opaque regions of all the surfaces above it. The result
+ * is stored in tw_surface::culling, surfaces fully covered are marked as
+ * occluded so renderers can skip them.
+ */
+void
+tw_layers_manager_cull(struct tw_layers_manager *manager);
+
+/**
+ * @brief find the top most surface accepting input at given global position.
+ */
+struct tw_surface *
+tw_layers_manager_pick_surface(struct tw_layers_manager *manager,
+                               float x, float y);
 
 #ifdef  __cplusplus
 }
@@ -83,12 +83,23 @@ tw_mat3_wl_transform(struct tw_mat3 *dst,
  * @breif transform a (0, 0, width, height) by its size
  *
  * the (width, height) here is needed to move the rect back to origin after
- * multiplied by rotation and scaling matrix
+ * multiplied by rotation matrix, the result is then scaled by scale.
  */
 void
 tw_mat3_transform_rect(struct tw_mat3 *dst, bool yup,
                        enum wl_output_transform transform,
                        uint32_t width, uint32_t height, uint32_t scale);
+/**
+ * @brief transform an array of boxes by wl_transform in integer precision
+ *
+ * It is the exact version of tw_mat3_transform_rect in y-down coordinates for
+ * unscaled boxes, (width, height) is the dimension of the source space. dst
+ * can be the same as src.
+ */
+void
+tw_mat3_wl_transform_boxes(pixman_box32_t *dst, const pixman_box32_t *src,
+                           int n, enum wl_output_transform transform,
+                           int32_t width, int32_t height);
 /**
  * @brief generating matrix mapping coordinates from image space to clip space.
  *
@@ -0,0 +1,73 @@
+/*
+ * pixel_convert.h - taiwins pixel format conversion
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_PIXEL_CONVERT_H
+#define TW_PIXEL_CONVERT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pixman.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct tw_event_buffer_uploading;
+
+/**
+ * @brief returns true if the wl_shm format can be converted to ARGB8888.
+ *
+ * Supported are ARGB8888, XRGB8888, ABGR8888, XBGR8888, RGB565 and YUYV, YUV
+ * is treated as BT.601 limited range. The compositor still needs to advertise
+ * the formats with wl_display_add_shm_format. NV12 is not supported for shm
+ * since libwayland does not check its chroma plane against the pool size.
+ */
+bool
+tw_pixel_convert_supported(uint32_t shm_format);
+
+/**
+ * @brief convert the damaged rectangles of src into dst as ARGB8888.
+ *
+ * dst has the same dimensions as src, NULL damage converts the whole image.
+ * NV12 is accepted for memory owned by the caller, the chroma plane follows
+ * the luma plane with the same stride, src has to hold stride * height * 3/2
+ * bytes.
+ * Rectangles are widened to even columns for the subsampled formats.
+ */
+bool
+tw_pixel_convert_to_argb8888(uint32_t shm_format, const void *src,
+                             int src_stride, int width, int height,
+                             uint32_t *dst, int dst_stride,
+                             pixman_region32_t *damage);
+
+/**
+ * @brief convert the shm buffer being uploaded, only the damaged part unless
+ * it is a new upload.
+ */
+bool
+tw_pixel_convert_shm_upload(struct tw_event_buffer_uploading *event,
+                            uint32_t *dst, int dst_stride);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* EOF */
@@ -0,0 +1,130 @@
+/*
+ * pixman_renderer.h - taiwins tiled pixman renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_PIXMAN_RENDERER_H
+#define TW_PIXMAN_RENDERER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include "shm_upload.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define TW_PIXMAN_TILE_SIZE 128
+#define TW_PIXMAN_MAX_THREADS 64
+
+struct tw_surface;
+struct tw_layers_manager;
+
+/**
+ * @brief a CPU renderer compositing the layers with pixman.
+ *
+ * The damage of a frame is split into tiles, the tiles are composited by a
+ * pool of workers, the thread calling tw_pixman_renderer_draw works as one
+ * of them. Surfaces keep a private copy of their shm buffer since the buffer
+ * is released right after commit.
+ */
+struct tw_pixman_renderer {
+	/** copies shm buffers off the main thread if set */
+	struct tw_shm_uploader *uploader;
+	/** the surfaces of tw_pixman_renderer_init_surface */
+	struct wl_list surfaces;
+	int n_threads;
+	pthread_t threads[TW_PIXMAN_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, done_cond;
+	bool quit;
+
+	/** current frame, protected by the lock */
+	struct {
+		uint32_t generation;
+		pixman_image_t *target;
+		int x, y;
+		/** damage in target coordinates */
+		pixman_region32_t damage;
+		struct wl_array tiles;
+		struct wl_array items;
+		unsigned int n_tiles, next, done;
+	} frame;
+};
+
+struct tw_pixman_texture {
+	struct tw_surface *surface;
+	pixman_image_t *image;
+	bool has_alpha;
+	struct wl_listener surface_destroy;
+
+	bool async;
+	struct tw_shm_staging staging;
+	struct wl_listener staging_ready;
+};
+
+/**
+ * @brief start the renderer with n_threads workers, 0 for one per CPU.
+ */
+bool
+tw_pixman_renderer_init(struct tw_pixman_renderer *renderer, int n_threads);
+
+/**
+ * @brief stop the renderer, the surfaces still alive lose their textures and
+ * their import hooks, the uploader has to be alive until then.
+ */
+void
+tw_pixman_renderer_fini(struct tw_pixman_renderer *renderer);
+
+/**
+ * @brief upload shm buffers through the uploader, the textures are updated
+ * once the copies are done.
+ */
+void
+tw_pixman_renderer_set_uploader(struct tw_pixman_renderer *renderer,
+                                struct tw_shm_uploader *uploader);
+
+/**
+ * @brief let the renderer upload the buffers of the surface, it shall be
+ * called right after the surface is created.
+ */
+void
+tw_pixman_renderer_init_surface(struct tw_pixman_renderer *renderer,
+                                struct tw_surface *surface);
+/**
+ * @brief composite the layers into target, which is placed at (x, y) in the
+ * global coordinates.
+ *
+ * damage is in global coordinates, NULL repaints the whole target.
+ */
+void
+tw_pixman_renderer_draw(struct tw_pixman_renderer *renderer,
+                        pixman_image_t *target, int x, int y,
+                        struct tw_layers_manager *manager,
+                        pixman_region32_t *damage);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* EOF */
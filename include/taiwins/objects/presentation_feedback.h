@@ -42,6 +42,8 @@ struct tw_presentation_feedback {
 	struct tw_presentation *presentation;
 	struct tw_surface *surface;
 	bool committed, presented;
+	/* profiler flow of the commit being presented */
+	uint64_t trace_flow;
 	struct wl_list link;
 	struct wl_list resources;
 
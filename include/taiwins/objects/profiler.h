@@ -23,12 +23,20 @@
 #define TW_PROFILER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <wayland-server-core.h>
 
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief start recording to the file.
+ *
+ * Events are recorded into per-thread lock-free rings and written in binary
+ * by a background thread. The names passed to the timers shall be static
+ * strings, they are recorded by address.
+ */
 bool
 tw_profiler_open(struct wl_display *display, const char *file);
 
@@ -41,6 +49,41 @@ tw_profiler_start_timer(const char *name);
 void
 tw_profiler_stop_timer(const char *name);
 
+/**
+ * @brief record the value of a counter, shown as a graph in the trace.
+ */
+void
+tw_profiler_counter(const char *name, int64_t value);
+
+/**
+ * @brief record a point in time, id identifies the object it happened to.
+ */
+void
+tw_profiler_instant(const char *name, uint64_t id);
+
+/**
+ * @brief flow events link the slices on different stages together.
+ *
+ * Events of the same name and id are linked from begin, through the steps
+ * until end. Each of them binds to the timer slice enclosing it, so call them
+ * between tw_profiler_start_timer and tw_profiler_stop_timer.
+ */
+void
+tw_profiler_flow_begin(const char *name, uint64_t id);
+
+void
+tw_profiler_flow_step(const char *name, uint64_t id);
+
+void
+tw_profiler_flow_end(const char *name, uint64_t id);
+
+/**
+ * @brief convert the binary trace written by the profiler into the chrome
+ * tracing json format.
+ */
+bool
+tw_profiler_convert(const char *trace_file, const char *json_file);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -29,6 +29,8 @@
 #include <wayland-server.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "serial_engine.h"
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -142,6 +144,8 @@ struct tw_keyboard {
 
 	size_t keymap_size;
 	char *keymap_string;
+	/** sealed keymap file shared by all the clients, -1 if unsupported */
+	int keymap_fd;
 	uint32_t modifiers_state;
 	uint32_t led_state; /**< led state reflects lock state */
 
@@ -149,6 +153,23 @@ struct tw_keyboard {
 	struct tw_seat_keyboard_grab *grab;
 };
 
+enum tw_pointer_coalesce_mode {
+	TW_POINTER_COALESCE_NONE = 0,
+	/** merge motion and axis until the next frame from the backend */
+	TW_POINTER_COALESCE_FRAME,
+	/** also hold the frames until tw_pointer_flush_coalesced, which the
+	 * compositor calls once per output refresh */
+	TW_POINTER_COALESCE_REFRESH,
+};
+
+struct tw_pointer_coalesced_axis {
+	bool pending;
+	uint32_t time_msec;
+	double value;
+	int32_t value_discrete;
+	enum wl_pointer_axis_source source;
+};
+
 struct tw_pointer {
 	struct tw_seat_client *focused_client;
 	struct wl_resource *focused_surface;
@@ -157,6 +178,17 @@ struct tw_pointer {
 	struct tw_seat_pointer_grab default_grab;
 	struct tw_seat_pointer_grab *grab;
 	uint32_t btn_count;
+
+	/** coalescing stage in front of the grabs, button and enter events are
+	 * never held, they flush the coalesced events before them */
+	struct {
+		enum tw_pointer_coalesce_mode mode;
+		bool motion_pending, frame_pending, passthrough;
+		uint32_t motion_time;
+		double sx, sy;
+		struct tw_pointer_coalesced_axis axis[2];
+		uint64_t events_saved;
+	} coalesce;
 };
 
 struct tw_touch {
@@ -182,11 +214,19 @@ struct tw_seat {
 	uint32_t last_pointer_serial;
 	uint32_t last_touch_serial;
 	uint32_t last_keyboard_serial;
+	/** all the serials sent by the seat, tagged by the event types */
+	struct tw_serial_engine serials;
 	struct tw_keyboard keyboard;
 	struct tw_pointer pointer;
 	struct tw_touch touch;
 	struct tw_cursor *cursor;
 
+	/** hash from wl_client to tw_seat_client, grows with the clients */
+	struct {
+		struct wl_list *buckets;
+		uint32_t size, count;
+	} client_table;
+
 	struct wl_signal focus_signal;
 	struct wl_signal destroy_signal;
 };
@@ -195,6 +235,7 @@ struct tw_seat_client {
 	struct tw_seat *seat;
 	struct wl_client *client;
 	struct wl_list link;
+	struct wl_list hash_link;
 	struct wl_list resources;
 
 	struct wl_list keyboards;
@@ -230,6 +271,13 @@ tw_seat_client_from_device(struct wl_resource *resource);
 bool
 tw_seat_valid_serial(struct tw_seat *seat, uint32_t serial);
 
+/**
+ * @brief verify the serial is recently sent by the seat for one of the event
+ * types, see enum tw_serial_type.
+ */
+bool
+tw_seat_verify_serial(struct tw_seat *seat, uint32_t serial, uint32_t types);
+
 /******************************** keyboard ***********************************/
 
 struct tw_keyboard *
@@ -250,6 +298,17 @@ tw_keyboard_set_keymap(struct tw_keyboard *keyboard,
 void
 tw_keyboard_send_keymap(struct tw_keyboard *keyboard,
                         struct wl_resource *keyboard_resource);
+/**
+ * @brief get a read-only keymap fd for sending to a client.
+ *
+ * It is the shared sealed keymap if available, otherwise a private copy. Pass
+ * it back to tw_keyboard_release_keymap_fd after sending.
+ */
+int
+tw_keyboard_acquire_keymap_fd(struct tw_keyboard *keyboard);
+
+void
+tw_keyboard_release_keymap_fd(struct tw_keyboard *keyboard, int fd);
 void
 tw_keyboard_set_focus(struct tw_keyboard *keyboard,
                       struct wl_resource *wl_surface,
@@ -307,6 +366,16 @@ tw_pointer_notify_axis(struct tw_pointer *pointer, uint32_t time_msec,
 void
 tw_pointer_notify_frame(struct tw_pointer *pointer);
 
+void
+tw_pointer_set_coalesce_mode(struct tw_pointer *pointer,
+                             enum tw_pointer_coalesce_mode mode);
+/**
+ * @brief send out the held events, in TW_POINTER_COALESCE_REFRESH mode, call
+ * this before every output repaint.
+ */
+void
+tw_pointer_flush_coalesced(struct tw_pointer *pointer);
+
 /***************************** touch *****************************************/
 
 struct tw_touch *
@@ -28,35 +28,70 @@
 extern "C" {
 #endif
 
-#define TW_SERIAL_DEPTH 16
+/* default depth, the depth shall be a power of 2 */
+#define TW_SERIAL_DEPTH 64
+#define TW_SERIAL_MAX_DEPTH 4096
+
+/* the event types the serials are issued for */
+enum tw_serial_type {
+	TW_SERIAL_NONE = 0,
+	TW_SERIAL_POINTER_ENTER = (1 << 0),
+	TW_SERIAL_POINTER_LEAVE = (1 << 1),
+	TW_SERIAL_POINTER_BUTTON = (1 << 2),
+	TW_SERIAL_KEYBOARD_ENTER = (1 << 3),
+	TW_SERIAL_KEYBOARD_LEAVE = (1 << 4),
+	TW_SERIAL_KEYBOARD_KEY = (1 << 5),
+	TW_SERIAL_KEYBOARD_MODIFIERS = (1 << 6),
+	TW_SERIAL_TOUCH_DOWN = (1 << 7),
+	TW_SERIAL_TOUCH_UP = (1 << 8),
+	TW_SERIAL_DND_ENTER = (1 << 9),
+};
+
+/* serials allowed to start a grab like move, resize and popup */
+#define TW_SERIAL_GRAB (TW_SERIAL_POINTER_BUTTON | TW_SERIAL_TOUCH_DOWN)
+/* serials allowed to set the selection */
+#define TW_SERIAL_SELECTION (TW_SERIAL_GRAB | TW_SERIAL_KEYBOARD_ENTER | \
+                             TW_SERIAL_KEYBOARD_KEY)
+#define TW_SERIAL_ANY (~0u)
 
 struct tw_serial_slot {
 	uint32_t serial;
-	struct wl_list link;
+	uint32_t type;
+	int32_t next; /* next slot in the hash bucket, -1 ends */
 };
 
 /**
  * @brief serial engine is used to generate next serial number
  *
- * The engine is essenstially a queue with a fixed depth. We can use to verify
- * the emitted serial.
+ * The engine is a ring of the last depth serials with their event types. A
+ * serial is first checked against the window of the ring then looked up in a
+ * small hash, so verifying is constant time.
  */
 struct tw_serial_engine {
+	/* use the display serials if set, otherwise counting on our own */
+	struct wl_display *display;
 	uint32_t curr_serial;
-	struct wl_list serials;
+	uint32_t depth, head, count;
 
-	struct tw_serial_slot lasts[TW_SERIAL_DEPTH];
+	struct tw_serial_slot *slots;
+	int32_t *buckets;
 };
 
+bool
+tw_serial_engine_init(struct tw_serial_engine *engine,
+                      struct wl_display *display, uint32_t depth);
 void
-tw_serial_engine_init(struct tw_serial_engine *engine);
+tw_serial_engine_fini(struct tw_serial_engine *engine);
 
 uint32_t
-tw_serial_engine_next_serial(struct tw_serial_engine *engine);
-
+tw_serial_engine_next_serial(struct tw_serial_engine *engine,
+                             enum tw_serial_type type);
+/**
+ * @brief verify the serial was issued recently for one of the types
+ */
 bool
 tw_serial_engine_verify_serial(struct tw_serial_engine *engine,
-                               uint32_t serial);
+                               uint32_t serial, uint32_t types);
 
 #ifdef  __cplusplus
 }
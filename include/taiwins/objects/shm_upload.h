@@ -0,0 +1,121 @@
+/*
+ * shm_upload.h - taiwins asynchronous shm upload
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef TW_SHM_UPLOAD_H
+#define TW_SHM_UPLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct tw_event_buffer_uploading;
+
+/**
+ * @brief copies shm buffers on a worker thread.
+ *
+ * Committed shm buffers are pinned and copied (converted to ARGB8888) into
+ * a staging area by the worker, the completion comes back to the event loop
+ * through an eventfd, where the wl_buffer is released and the staging becomes
+ * ready.
+ */
+struct tw_shm_uploader {
+	struct wl_event_source *event;
+	int eventfd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, job_cond;
+	bool quit;
+
+	/** protected by the lock */
+	struct wl_list queued, done;
+	struct tw_shm_upload_job *running;
+};
+
+struct tw_shm_staging_buffer {
+	void *data;
+	int width, height, stride;
+	bool has_alpha;
+};
+
+/**
+ * @brief the staging area of one surface.
+ *
+ * The worker writes into the back buffer, it is swapped to the front when
+ * an upload is done and the worker is not writing another one of the staging,
+ * so the front can be read on the main thread at any time. The uploads still
+ * queued continue on the new back buffer.
+ */
+struct tw_shm_staging {
+	struct tw_shm_uploader *uploader;
+	struct tw_shm_staging_buffer front, back;
+	/** uploads in flight */
+	unsigned int pending;
+	/** damage the back buffer is missing, owned by the worker */
+	pixman_region32_t stale;
+	/** damage of the uploads not yet swapped in, protected by the lock */
+	pixman_region32_t damage;
+	/** the back has uploads not swapped in, protected by the lock */
+	bool back_dirty;
+
+	struct {
+		/** the front is swapped, the data is the damage of front */
+		struct wl_signal ready;
+	} signals;
+};
+
+bool
+tw_shm_uploader_init(struct tw_shm_uploader *uploader,
+                     struct wl_display *display);
+void
+tw_shm_uploader_fini(struct tw_shm_uploader *uploader);
+
+void
+tw_shm_staging_init(struct tw_shm_staging *staging,
+                    struct tw_shm_uploader *uploader);
+/**
+ * @brief drop the queued uploads and wait for the running one, the pinned
+ * buffers are released.
+ */
+void
+tw_shm_staging_fini(struct tw_shm_staging *staging);
+
+/**
+ * @brief queue the upload of a shm buffer, used in buffer_import hooks.
+ *
+ * On success the event is marked release_deferred, the uploader releases the
+ * buffer once the copy is done. Returns false for non-shm buffers and formats
+ * tw_pixel_convert does not support.
+ */
+bool
+tw_shm_staging_queue(struct tw_shm_staging *staging,
+                     struct tw_event_buffer_uploading *event);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* EOF */
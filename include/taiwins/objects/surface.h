@@ -29,6 +29,7 @@
 #include <wayland-server.h>
 #include <pixman.h>
 
+#include "damage.h"
 #include "matrix.h"
 #include "plane.h"
 #include "utils.h"
@@ -60,6 +61,8 @@ struct tw_event_buffer_uploading {
 	pixman_region32_t *damages;
 	struct wl_resource *wl_buffer;
 	bool new_upload;
+	/** set by the importer if it releases the wl_buffer by itself later */
+	bool release_deferred;
 };
 
 typedef void (*tw_surface_commit_cb_t)(struct tw_surface *surface);
@@ -75,6 +78,8 @@ typedef void (*tw_surface_commit_cb_t)(struct tw_surface *surface);
 struct tw_surface_buffer {
 	/* can be a wl_shm_buffer or egl buffer or dma buffer */
 	struct wl_resource *resource;
+	/* resource is released by the importer instead */
+	bool release_deferred;
 	int width, height, stride;
 	enum wl_shm_format format;
 	union {
@@ -149,6 +154,7 @@ struct tw_surface {
 	/* subsurface changes on commit  */
 	struct wl_list subsurfaces_pending;
 
+	/** has a buffer committed, a NULL attach unmaps the surface */
 	bool is_mapped;
 
 	/** transform of the view */
@@ -169,6 +175,26 @@ struct tw_surface {
 
 	} geometry;
 
+	/** visibility of the surface computed by tw_layers_manager_cull, in
+	 * global coordinates */
+	struct {
+		pixman_region32_t visible;
+		bool occluded;
+	} culling;
+
+	/** damage simplification of the tw_compositor creating the surface,
+	 * NULL disables it */
+	struct {
+		const struct tw_damage_policy *policy;
+		struct tw_damage_stats *stats;
+	} damage;
+
+	/** identify the surface and its commits in the profiler traces */
+	struct {
+		uint32_t id;
+		uint32_t commit;
+	} trace;
+
 	struct {
 		const char *name;
 		void *commit_private;
@@ -185,6 +211,13 @@ struct tw_surface {
 	void *user_data;
 };
 
+/** the profiler flow id of the last commit of the surface */
+static inline uint64_t
+tw_surface_trace_flow(struct tw_surface *surface)
+{
+	return ((uint64_t)surface->trace.id << 32) | surface->trace.commit;
+}
+
 /** a good reference about subsurface is here
  * :https://ppaalanen.blogspot.com/2013/11/sub-surfaces-now.html
  */
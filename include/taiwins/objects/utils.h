@@ -86,6 +86,35 @@ struct tw_allocator {
 };
 extern const struct tw_allocator tw_default_allocator;
 
+/**
+ * @brief size-class slab allocator
+ *
+ * Objects are served from fixed size slabs in pools keyed by the
+ * wl_interface, which avoids malloc churn for objects created and destroyed
+ * constantly like wl_region. It can be used as tw_compositor::obj_alloc.
+ */
+extern const struct tw_allocator tw_slab_allocator;
+
+struct tw_slab_stats {
+	size_t pools, slabs;
+	size_t objects; /**< objects in use */
+	size_t allocs, frees; /**< accumulated allocation calls */
+	size_t bytes; /**< memory reserved by the slabs */
+};
+
+void
+tw_slab_allocator_get_stats(struct tw_slab_stats *stats);
+
+/**
+ * @brief release the memory the slabs of the interface do not use, NULL for
+ * all the interfaces.
+ *
+ * Only empty slabs and pools without objects are freed, live objects stay
+ * valid and are freed as usual.
+ */
+void
+tw_slab_allocator_reset(const struct wl_interface *interface);
+
 #define tw_create_wl_resource_for_obj(res, obj, client, id, ver, iface)   \
 	({ \
 		bool ret = true; \
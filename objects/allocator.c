@@ -0,0 +1,281 @@
+/*
+ * allocator.c - taiwins slab allocator
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-server-core.h>
+#include <wayland-util.h>
+#include <taiwins/objects/utils.h>
+
+#define SLAB_SIZE 16384
+#define SLAB_ALIGN 16
+/* objects larger than this goes to calloc directly */
+#define SLAB_MAX_OBJ (SLAB_SIZE / 8)
+
+#define ALIGN_UP(v, a) (((v) + (a) - 1) & ~((size_t)(a) - 1))
+
+struct slab_pool;
+
+/* every object has a header in front, points to the slab it belongs to, or
+ * NULL if it is allocated by calloc. */
+struct slab_header {
+	struct slab *slab;
+} __attribute__((aligned(SLAB_ALIGN)));
+
+struct slab_free_slot {
+	struct slab_free_slot *next;
+};
+
+struct slab {
+	struct wl_list link; /* slab_pool:partial or slab_pool:full */
+	struct slab_pool *pool;
+	struct slab_free_slot *free_list;
+	unsigned int n_free, n_objs;
+	char *data;
+};
+
+struct slab_pool {
+	struct wl_list link;
+	const struct wl_interface *interface;
+	size_t obj_size; /* including the header */
+	unsigned int objs_per_slab;
+	struct wl_list partial, full;
+	size_t n_slabs, n_objects;
+};
+
+static struct {
+	struct wl_list pools;
+	bool initialized;
+	size_t allocs, frees;
+	size_t large_objects;
+} s_slab = {0};
+
+static inline void
+slab_init_once(void)
+{
+	if (!s_slab.initialized) {
+		wl_list_init(&s_slab.pools);
+		s_slab.initialized = true;
+	}
+}
+
+static struct slab_pool *
+slab_find_pool(const struct wl_interface *interface)
+{
+	struct slab_pool *pool;
+
+	slab_init_once();
+	wl_list_for_each(pool, &s_slab.pools, link) {
+		if (pool->interface == interface) {
+			//move to front, a few interfaces are the hottest
+			wl_list_remove(&pool->link);
+			wl_list_insert(&s_slab.pools, &pool->link);
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+static struct slab_pool *
+slab_new_pool(const struct wl_interface *interface, size_t size)
+{
+	struct slab_pool *pool = calloc(1, sizeof(*pool));
+
+	if (!pool)
+		return NULL;
+	pool->interface = interface;
+	pool->obj_size = sizeof(struct slab_header) + ALIGN_UP(size, SLAB_ALIGN);
+	pool->objs_per_slab = SLAB_SIZE / pool->obj_size;
+	wl_list_init(&pool->partial);
+	wl_list_init(&pool->full);
+	wl_list_insert(&s_slab.pools, &pool->link);
+	return pool;
+}
+
+static struct slab *
+slab_new(struct slab_pool *pool)
+{
+	struct slab *slab = calloc(1, sizeof(*slab));
+	struct slab_free_slot *slot;
+
+	if (!slab)
+		return NULL;
+	slab->data = aligned_alloc(SLAB_ALIGN, SLAB_SIZE);
+	if (!slab->data) {
+		free(slab);
+		return NULL;
+	}
+	slab->pool = pool;
+	slab->n_objs = pool->objs_per_slab;
+	slab->n_free = slab->n_objs;
+	//build the free list backwards so we allocate from the beginning
+	for (int i = slab->n_objs - 1; i >= 0; i--) {
+		slot = (struct slab_free_slot *)(slab->data + i * pool->obj_size);
+		slot->next = slab->free_list;
+		slab->free_list = slot;
+	}
+	wl_list_insert(&pool->partial, &slab->link);
+	pool->n_slabs++;
+	return slab;
+}
+
+static void
+slab_destroy(struct slab *slab)
+{
+	wl_list_remove(&slab->link);
+	slab->pool->n_slabs--;
+	free(slab->data);
+	free(slab);
+}
+
+/* release the empty slabs, the ones with live objects stay since their
+ * objects are freed through the slab later. */
+static void
+slab_pool_trim(struct slab_pool *pool)
+{
+	struct slab *slab, *tmp;
+
+	wl_list_for_each_safe(slab, tmp, &pool->partial, link)
+		if (slab->n_free == slab->n_objs)
+			slab_destroy(slab);
+}
+
+static void *
+slab_alloc_large(size_t size)
+{
+	struct slab_header *header =
+		calloc(1, sizeof(struct slab_header) + size);
+	if (!header)
+		return NULL;
+	header->slab = NULL;
+	s_slab.large_objects++;
+	return header + 1;
+}
+
+static void *
+tw_slab_alloc(size_t size, const struct wl_interface *interface)
+{
+	struct slab *slab;
+	struct slab_header *header;
+	struct slab_pool *pool = slab_find_pool(interface);
+
+	s_slab.allocs++;
+	if (!pool && size <= SLAB_MAX_OBJ)
+		pool = slab_new_pool(interface, size);
+	//too large for slabs or the pool was created for a smaller size.
+	if (!pool || pool->obj_size < sizeof(struct slab_header) + size)
+		return slab_alloc_large(size);
+
+	if (wl_list_empty(&pool->partial) && !slab_new(pool))
+		return NULL;
+	slab = wl_container_of(pool->partial.next, slab, link);
+
+	header = (struct slab_header *)slab->free_list;
+	slab->free_list = slab->free_list->next;
+	if (--slab->n_free == 0) {
+		wl_list_remove(&slab->link);
+		wl_list_insert(&pool->full, &slab->link);
+	}
+	pool->n_objects++;
+
+	//same semantic as tw_default_allocator
+	memset(header, 0, pool->obj_size);
+	header->slab = slab;
+	return header + 1;
+}
+
+static void
+tw_slab_free(void *addr, const struct wl_interface *interface)
+{
+	struct slab_header *header;
+	struct slab_free_slot *slot;
+	struct slab_pool *pool;
+	struct slab *slab;
+
+	if (!addr)
+		return;
+	s_slab.frees++;
+	header = (struct slab_header *)addr - 1;
+	slab = header->slab;
+	if (!slab) {
+		s_slab.large_objects--;
+		free(header);
+		return;
+	}
+	pool = slab->pool;
+	assert(pool->interface == interface);
+
+	slot = (struct slab_free_slot *)header;
+	slot->next = slab->free_list;
+	slab->free_list = slot;
+	pool->n_objects--;
+	//full slab becomes available
+	if (slab->n_free++ == 0) {
+		wl_list_remove(&slab->link);
+		wl_list_insert(&pool->partial, &slab->link);
+	}
+	//release the empty slab unless it is the only one left for the pool
+	if (slab->n_free == slab->n_objs &&
+	    (pool->partial.next != &slab->link ||
+	     pool->partial.prev != &slab->link))
+		slab_destroy(slab);
+}
+
+WL_EXPORT const struct tw_allocator tw_slab_allocator = {
+	.alloc = tw_slab_alloc,
+	.free = tw_slab_free,
+};
+
+WL_EXPORT void
+tw_slab_allocator_get_stats(struct tw_slab_stats *stats)
+{
+	struct slab_pool *pool;
+
+	slab_init_once();
+	memset(stats, 0, sizeof(*stats));
+	wl_list_for_each(pool, &s_slab.pools, link) {
+		stats->pools++;
+		stats->slabs += pool->n_slabs;
+		stats->objects += pool->n_objects;
+	}
+	stats->objects += s_slab.large_objects;
+	stats->bytes = stats->slabs * SLAB_SIZE;
+	stats->allocs = s_slab.allocs;
+	stats->frees = s_slab.frees;
+}
+
+WL_EXPORT void
+tw_slab_allocator_reset(const struct wl_interface *interface)
+{
+	struct slab_pool *pool, *tmp;
+
+	slab_init_once();
+	wl_list_for_each_safe(pool, tmp, &s_slab.pools, link) {
+		if (interface && pool->interface != interface)
+			continue;
+		slab_pool_trim(pool);
+		if (pool->n_objects)
+			continue;
+		wl_list_remove(&pool->link);
+		free(pool);
+	}
+}
@@ -36,7 +36,7 @@ tw_surface_buffer_update(struct tw_surface_buffer *buffer,
                          struct wl_resource *resource,
                          pixman_region32_t *damage)
 {
-	struct tw_event_buffer_uploading event;
+	struct tw_event_buffer_uploading event = {0};
 	//compare if resource is a wl_buffer
 	struct tw_surface *surface = wl_container_of(buffer, surface, buffer);
 	void *user_data;
@@ -51,8 +51,10 @@ tw_surface_buffer_update(struct tw_surface_buffer *buffer,
 		ret = buffer->buffer_import.buffer_import(&event, user_data);
 	}
 	//if updating failed, nothing changes.
-	if (ret)
+	if (ret) {
 		buffer->resource = resource;
+		buffer->release_deferred = event.release_deferred;
+	}
 	return ret;
 }
 
@@ -72,8 +74,10 @@ tw_surface_buffer_new(struct tw_surface_buffer *buffer,
 		user_data = buffer->buffer_import.callback;
 		buffer->buffer_import.buffer_import(&event, user_data);
 	}
-	if (tw_surface_has_texture(surface))
+	if (tw_surface_has_texture(surface)) {
 		buffer->resource = resource;
+		buffer->release_deferred = event.release_deferred;
+	}
 }
 
 WL_EXPORT void
@@ -81,6 +85,8 @@ tw_surface_buffer_release(struct tw_surface_buffer *buffer)
 {
 	if (!buffer->resource)
 		return;
-	wl_buffer_send_release(buffer->resource);
+	if (!buffer->release_deferred)
+		wl_buffer_send_release(buffer->resource);
 	buffer->resource = NULL; //?
+	buffer->release_deferred = false;
 }
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wayland-server.h>
@@ -115,8 +116,11 @@ create_wl_surface(struct wl_client *client,
 
 	surface = tw_surface_create(client, SURFACE_VERSION, id,
 	                            compositor->obj_alloc);
-	if (surface)
-		wl_signal_emit(&compositor->surface_created, surface);
+	if (!surface)
+		return;
+	surface->damage.policy = &compositor->damage.policy;
+	surface->damage.stats = &compositor->damage.stats;
+	wl_signal_emit(&compositor->surface_created, surface);
 }
 
 static void
@@ -204,6 +208,7 @@ tw_compositor_init(struct tw_compositor *compositor,
 	wl_list_init(&compositor->destroy_listener.link);
 	compositor->destroy_listener.notify = destroy_tw_compositor;
 	compositor->obj_alloc = NULL;
+	memset(&compositor->damage, 0, sizeof(compositor->damage));
 
 	wl_signal_init(&compositor->surface_created);
 	wl_signal_init(&compositor->region_created);
@@ -214,6 +219,20 @@ tw_compositor_init(struct tw_compositor *compositor,
 	return true;
 }
 
+WL_EXPORT void
+tw_compositor_set_damage_policy(struct tw_compositor *compositor,
+                                const struct tw_damage_policy *policy)
+{
+	compositor->damage.policy = *policy;
+}
+
+WL_EXPORT void
+tw_compositor_get_damage_stats(struct tw_compositor *compositor,
+                               struct tw_damage_stats *stats)
+{
+	*stats = compositor->damage.stats;
+}
+
 WL_EXPORT struct tw_compositor *
 tw_compositor_create_global(struct wl_display *display)
 {
@@ -0,0 +1,227 @@
+/*
+ * damage.c - taiwins output damage tracker
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <pixman.h>
+#include <wayland-util.h>
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/damage.h>
+
+static inline pixman_region32_t *
+damage_tracker_frame(struct tw_damage_tracker *tracker, unsigned int i)
+{
+	unsigned int idx = (tracker->head + TW_DAMAGE_HISTORY - i) %
+		TW_DAMAGE_HISTORY;
+	return &tracker->history[idx];
+}
+
+static inline void
+damage_tracker_clip(struct tw_damage_tracker *tracker,
+                    pixman_region32_t *region)
+{
+	pixman_region32_intersect_rect(region, region,
+	                               tracker->geometry.x1,
+	                               tracker->geometry.y1,
+	                               tracker->geometry.x2 -
+	                               tracker->geometry.x1,
+	                               tracker->geometry.y2 -
+	                               tracker->geometry.y1);
+}
+
+/* number of previous merged boxes a rectangle tries to merge with. Pixman
+ * regions are sorted in y-x bands, neighbours are close in the array. */
+#define DAMAGE_MERGE_WINDOW 4
+
+static inline uint64_t
+box_area(const pixman_box32_t *box)
+{
+	return (uint64_t)(box->x2 - box->x1) * (uint64_t)(box->y2 - box->y1);
+}
+
+static inline bool
+damage_try_merge(pixman_box32_t *dst, const pixman_box32_t *src,
+                 unsigned int merge_waste)
+{
+	pixman_box32_t bbox = {
+		dst->x1 < src->x1 ? dst->x1 : src->x1,
+		dst->y1 < src->y1 ? dst->y1 : src->y1,
+		dst->x2 > src->x2 ? dst->x2 : src->x2,
+		dst->y2 > src->y2 ? dst->y2 : src->y2,
+	};
+	uint64_t area = box_area(&bbox);
+	uint64_t used = box_area(dst) + box_area(src);
+	uint64_t waste = used < area ? area - used : 0;
+
+	if (waste * 100 >= (uint64_t)merge_waste * area)
+		return false;
+	*dst = bbox;
+	return true;
+}
+
+static int
+damage_merge_boxes(pixman_box32_t *boxes, const pixman_box32_t *rects, int n,
+                   unsigned int merge_waste)
+{
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+		bool merged = false;
+		for (int j = m-1; j >= 0 && j >= m - DAMAGE_MERGE_WINDOW; j--) {
+			merged = damage_try_merge(&boxes[j], &rects[i],
+			                          merge_waste);
+			if (merged)
+				break;
+		}
+		if (!merged)
+			boxes[m++] = rects[i];
+	}
+	return m;
+}
+
+WL_EXPORT void
+tw_damage_simplify(pixman_region32_t *region,
+                   const struct tw_damage_policy *policy,
+                   struct tw_damage_stats *stats)
+{
+	int n, m;
+	pixman_box32_t *rects, *boxes;
+
+	rects = pixman_region32_rectangles(region, &n);
+	if (stats)
+		stats->rects_in += n;
+	if (n > 1 && policy->merge_waste) {
+		boxes = malloc(n * sizeof(pixman_box32_t));
+		if (boxes) {
+			m = damage_merge_boxes(boxes, rects, n,
+			                       policy->merge_waste);
+			if (m < n) {
+				pixman_region32_fini(region);
+				pixman_region32_init_rects(region, boxes, m);
+			}
+			free(boxes);
+		}
+	}
+	if (policy->max_rects &&
+	    pixman_region32_n_rects(region) > (int)policy->max_rects) {
+		pixman_box32_t extents = *pixman_region32_extents(region);
+		pixman_region32_reset(region, &extents);
+	}
+	if (stats)
+		stats->rects_out += pixman_region32_n_rects(region);
+}
+
+WL_EXPORT void
+tw_damage_tracker_init(struct tw_damage_tracker *tracker)
+{
+	tracker->geometry = (pixman_box32_t){0, 0, 0, 0};
+	tracker->head = 0;
+	tracker->count = 0;
+	pixman_region32_init(&tracker->current);
+	for (int i = 0; i < TW_DAMAGE_HISTORY; i++)
+		pixman_region32_init(&tracker->history[i]);
+}
+
+WL_EXPORT void
+tw_damage_tracker_fini(struct tw_damage_tracker *tracker)
+{
+	pixman_region32_fini(&tracker->current);
+	for (int i = 0; i < TW_DAMAGE_HISTORY; i++)
+		pixman_region32_fini(&tracker->history[i]);
+}
+
+WL_EXPORT void
+tw_damage_tracker_set_geometry(struct tw_damage_tracker *tracker,
+                               int32_t x, int32_t y,
+                               uint32_t width, uint32_t height)
+{
+	pixman_box32_t geometry = {x, y, x + width, y + height};
+
+	if (geometry.x1 == tracker->geometry.x1 &&
+	    geometry.y1 == tracker->geometry.y1 &&
+	    geometry.x2 == tracker->geometry.x2 &&
+	    geometry.y2 == tracker->geometry.y2)
+		return;
+	tracker->geometry = geometry;
+	//the buffers have different contents now
+	tracker->count = 0;
+	tw_damage_tracker_damage_whole(tracker);
+}
+
+WL_EXPORT void
+tw_damage_tracker_add_region(struct tw_damage_tracker *tracker,
+                             pixman_region32_t *damage)
+{
+	pixman_region32_t clipped;
+
+	pixman_region32_init(&clipped);
+	pixman_region32_copy(&clipped, damage);
+	damage_tracker_clip(tracker, &clipped);
+	pixman_region32_union(&tracker->current, &tracker->current, &clipped);
+	pixman_region32_fini(&clipped);
+}
+
+WL_EXPORT void
+tw_damage_tracker_add_surface(struct tw_damage_tracker *tracker,
+                              struct tw_surface *surface)
+{
+	pixman_region32_t damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &surface->current->surface_damage);
+	pixman_region32_translate(&damage, surface->geometry.xywh.x,
+	                          surface->geometry.xywh.y);
+	pixman_region32_union(&damage, &damage, &surface->geometry.dirty);
+	tw_damage_tracker_add_region(tracker, &damage);
+	pixman_region32_fini(&damage);
+}
+
+WL_EXPORT void
+tw_damage_tracker_damage_whole(struct tw_damage_tracker *tracker)
+{
+	pixman_region32_reset(&tracker->current, &tracker->geometry);
+}
+
+WL_EXPORT bool
+tw_damage_tracker_get_buffer_damage(struct tw_damage_tracker *tracker,
+                                    int age, pixman_region32_t *damage)
+{
+	//age 1 is the last frame, which we only need the current damage
+	if (age <= 0 || (unsigned int)age - 1 > tracker->count) {
+		pixman_region32_reset(damage, &tracker->geometry);
+		return false;
+	}
+	pixman_region32_copy(damage, &tracker->current);
+	for (int i = 0; i < age - 1; i++)
+		pixman_region32_union(damage, damage,
+		                      damage_tracker_frame(tracker, i));
+	return true;
+}
+
+WL_EXPORT void
+tw_damage_tracker_swap(struct tw_damage_tracker *tracker)
+{
+	tracker->head = (tracker->head + 1) % TW_DAMAGE_HISTORY;
+	pixman_region32_copy(&tracker->history[tracker->head],
+	                     &tracker->current);
+	pixman_region32_clear(&tracker->current);
+	if (tracker->count < TW_DAMAGE_HISTORY)
+		tracker->count++;
+}
@@ -0,0 +1,475 @@
+/*
+ * clipboard.c - taiwins server clipboard persistence
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <wayland-server-core.h>
+#include <wayland-server.h>
+#include <wayland-util.h>
+
+#include <taiwins/objects/utils.h>
+#include <taiwins/objects/logger.h>
+#include <taiwins/objects/data_device.h>
+
+#include "data_internal.h"
+#include "../os-compatibility.h"
+
+#define CLIPBOARD_CHUNK (64 * 1024)
+
+/* stored content of one mime type */
+struct clipboard_entry {
+	struct wl_list link;
+	struct tw_clipboard_manager *manager;
+	char *mime;
+	int memfd;
+	size_t size, cap;
+	/* pipe from the source client, -1 after done */
+	int pipe_fd;
+	struct wl_event_source *event;
+	bool done;
+};
+
+/* serving a send request */
+struct clipboard_writer {
+	struct wl_list link;
+	int memfd, fd;
+	off_t offset;
+	size_t size;
+	struct wl_event_source *event;
+};
+
+struct clipboard_cap {
+	char *prefix;
+	size_t cap;
+};
+
+static size_t
+clipboard_mime_cap(struct tw_clipboard_manager *manager, const char *mime)
+{
+	struct clipboard_cap *cap;
+	size_t matched = 0, ret = manager->default_cap;
+
+	wl_array_for_each(cap, &manager->caps) {
+		size_t len = strlen(cap->prefix);
+		if (len >= matched && !strncmp(cap->prefix, mime, len)) {
+			matched = len;
+			ret = cap->cap;
+		}
+	}
+	return ret;
+}
+
+static inline bool
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+/******************************************************************************
+ * serving
+ *****************************************************************************/
+
+static void
+clipboard_writer_destroy(struct clipboard_writer *writer)
+{
+	if (writer->event)
+		wl_event_source_remove(writer->event);
+	close(writer->fd);
+	close(writer->memfd);
+	wl_list_remove(&writer->link);
+	free(writer);
+}
+
+/* sendfile into a pipe closed by the reader raises SIGPIPE, we block it around
+ * the write and consume the one we caused, unless it was already pending */
+static ssize_t
+clipboard_writer_sendfile(struct clipboard_writer *writer)
+{
+	static const struct timespec zero = {0};
+	sigset_t pipe_set, old_set, pending;
+	bool was_pending;
+	ssize_t ret;
+	int err;
+
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	sigpending(&pending);
+	was_pending = sigismember(&pending, SIGPIPE);
+	if (!was_pending)
+		pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	ret = sendfile(writer->fd, writer->memfd, &writer->offset,
+	               writer->size - writer->offset);
+	err = errno;
+
+	if (!was_pending) {
+		if (ret < 0 && err == EPIPE)
+			while (sigtimedwait(&pipe_set, NULL, &zero) < 0 &&
+			       errno == EINTR);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	}
+	errno = err;
+	return ret;
+}
+
+static int
+clipboard_writer_write(int fd, uint32_t mask, void *data)
+{
+	struct clipboard_writer *writer = data;
+	ssize_t ret;
+
+	if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+		clipboard_writer_destroy(writer);
+		return 0;
+	}
+	//the kernel copies straight from the memfd into the pipe
+	while ((size_t)writer->offset < writer->size) {
+		ret = clipboard_writer_sendfile(writer);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 0;
+		if (ret <= 0)
+			break;
+	}
+	clipboard_writer_destroy(writer);
+	return 0;
+}
+
+static void
+clipboard_source_send(struct tw_data_source *source, const char *mime, int fd)
+{
+	struct tw_clipboard_manager *manager =
+		wl_container_of(source, manager, source);
+	struct clipboard_entry *entry, *found = NULL;
+	struct clipboard_writer *writer;
+
+	wl_list_for_each(entry, &manager->entries, link)
+		if (entry->done && !strcmp(entry->mime, mime)) {
+			found = entry;
+			break;
+		}
+	if (!found || !(writer = calloc(1, sizeof(*writer))))
+		return;
+	//the offer closes the fd after sending, we keep our own copies, so
+	//does the memfd, the entry may go away before we finish.
+	writer->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	writer->memfd = fcntl(found->memfd, F_DUPFD_CLOEXEC, 0);
+	writer->size = found->size;
+	writer->offset = 0;
+	wl_list_init(&writer->link);
+	if (writer->fd < 0 || writer->memfd < 0 || !set_nonblock(writer->fd))
+		goto err;
+	writer->event = wl_event_loop_add_fd(manager->loop, writer->fd,
+	                                     WL_EVENT_WRITABLE,
+	                                     clipboard_writer_write, writer);
+	if (!writer->event)
+		goto err;
+	wl_list_insert(&manager->writers, &writer->link);
+	return;
+err:
+	if (writer->fd >= 0)
+		close(writer->fd);
+	if (writer->memfd >= 0)
+		close(writer->memfd);
+	free(writer);
+}
+
+static const struct tw_data_source_impl clipboard_source_impl = {
+	.send = clipboard_source_send,
+};
+
+/******************************************************************************
+ * reading
+ *****************************************************************************/
+
+static void
+clipboard_entry_destroy(struct clipboard_entry *entry)
+{
+	if (entry->event)
+		wl_event_source_remove(entry->event);
+	if (entry->pipe_fd >= 0) {
+		close(entry->pipe_fd);
+		entry->manager->reading--;
+	}
+	if (entry->memfd >= 0)
+		close(entry->memfd);
+	wl_list_remove(&entry->link);
+	free(entry->mime);
+	free(entry);
+}
+
+static void
+clipboard_publish(struct tw_clipboard_manager *manager)
+{
+	struct clipboard_entry *entry;
+	char **mime;
+
+	manager->publish = false;
+	if (wl_list_empty(&manager->entries) || manager->device->source_set)
+		return;
+	tw_data_source_init(&manager->source, NULL, &clipboard_source_impl);
+	manager->source_set = true;
+	wl_list_for_each(entry, &manager->entries, link) {
+		mime = wl_array_add(&manager->source.mimes, sizeof(char *));
+		if (mime)
+			*mime = strdup(entry->mime);
+	}
+	tw_data_device_set_selection(manager->device, &manager->source);
+}
+
+static void
+clipboard_entry_finish(struct clipboard_entry *entry, bool ok)
+{
+	struct tw_clipboard_manager *manager = entry->manager;
+
+	wl_event_source_remove(entry->event);
+	entry->event = NULL;
+	close(entry->pipe_fd);
+	entry->pipe_fd = -1;
+	manager->reading--;
+	if (ok)
+		entry->done = true;
+	else
+		clipboard_entry_destroy(entry);
+
+	if (!manager->reading && manager->publish)
+		clipboard_publish(manager);
+}
+
+static ssize_t
+clipboard_entry_copy(struct clipboard_entry *entry, size_t len)
+{
+	char buf[4096];
+	ssize_t ret;
+	loff_t offset = entry->size;
+
+	ret = splice(entry->pipe_fd, NULL, entry->memfd, &offset, len,
+	             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret >= 0 || errno != EINVAL)
+		return ret;
+	//memfd not supporting splice, copy it ourselves
+	ret = read(entry->pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+	if (ret > 0 && pwrite(entry->memfd, buf, ret, entry->size) != ret)
+		return -1;
+	return ret;
+}
+
+static int
+clipboard_entry_read(int fd, uint32_t mask, void *data)
+{
+	struct clipboard_entry *entry = data;
+	ssize_t ret;
+
+	for (;;) {
+		ret = clipboard_entry_copy(entry, CLIPBOARD_CHUNK);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 0;
+		if (ret < 0) {
+			clipboard_entry_finish(entry, false);
+			return 0;
+		}
+		if (ret == 0) {
+			clipboard_entry_finish(entry, true);
+			return 0;
+		}
+		entry->size += ret;
+		if (entry->size > entry->cap) {
+			tw_logl("clipboard: %s exceeds %zu bytes, dropped",
+			        entry->mime, entry->cap);
+			clipboard_entry_finish(entry, false);
+			return 0;
+		}
+	}
+}
+
+static void
+clipboard_read_mime(struct tw_clipboard_manager *manager,
+                    struct tw_data_source *source, const char *mime)
+{
+	int fds[2];
+	struct clipboard_entry *entry;
+	size_t cap = clipboard_mime_cap(manager, mime);
+
+	if (!cap || !(entry = calloc(1, sizeof(*entry))))
+		return;
+	entry->manager = manager;
+	entry->cap = cap;
+	entry->pipe_fd = -1;
+	entry->mime = strdup(mime);
+	entry->memfd = os_create_anonymous_file(0);
+	wl_list_init(&entry->link);
+	if (!entry->mime || entry->memfd < 0)
+		goto err;
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto err;
+	entry->pipe_fd = fds[0];
+	manager->reading++;
+	entry->event = wl_event_loop_add_fd(manager->loop, fds[0],
+	                                    WL_EVENT_READABLE,
+	                                    clipboard_entry_read, entry);
+	if (!entry->event) {
+		close(fds[1]);
+		goto err;
+	}
+	wl_list_insert(manager->entries.prev, &entry->link);
+	tw_data_source_send_send(source, mime, fds[1]);
+	close(fds[1]);
+	return;
+err:
+	clipboard_entry_destroy(entry);
+}
+
+static void
+clipboard_discard(struct tw_clipboard_manager *manager)
+{
+	struct clipboard_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &manager->entries, link)
+		clipboard_entry_destroy(entry);
+	//ongoing writers have their own copies of the memfd
+	if (manager->source_set)
+		tw_data_source_fini(&manager->source);
+	manager->source_set = false;
+	manager->publish = false;
+	manager->watched = NULL;
+}
+
+static void
+notify_clipboard_source_added(struct wl_listener *listener, void *data)
+{
+	struct tw_clipboard_manager *manager =
+		wl_container_of(listener, manager, source_added);
+	struct tw_data_source *source = data;
+	char **mime;
+
+	if (source == &manager->source)
+		return;
+	clipboard_discard(manager);
+	manager->watched = source;
+	wl_array_for_each(mime, &source->mimes)
+		clipboard_read_mime(manager, source, *mime);
+}
+
+static void
+notify_clipboard_source_removed(struct wl_listener *listener, void *data)
+{
+	struct tw_clipboard_manager *manager =
+		wl_container_of(listener, manager, source_removed);
+
+	if (data != manager->watched)
+		return;
+	//take over once all the contents are read
+	manager->watched = NULL;
+	manager->publish = true;
+	if (!manager->reading)
+		clipboard_publish(manager);
+}
+
+static void
+notify_clipboard_device_destroy(struct wl_listener *listener, void *data)
+{
+	struct tw_clipboard_manager *manager =
+		wl_container_of(listener, manager, device_destroy);
+	tw_clipboard_manager_fini(manager);
+}
+
+WL_EXPORT bool
+tw_clipboard_manager_init(struct tw_clipboard_manager *manager,
+                          struct tw_data_device *device,
+                          struct wl_display *display)
+{
+	manager->device = device;
+	manager->loop = wl_display_get_event_loop(display);
+	manager->watched = NULL;
+	manager->source_set = false;
+	manager->publish = false;
+	manager->reading = 0;
+	manager->default_cap = TW_CLIPBOARD_DEFAULT_CAP;
+	wl_list_init(&manager->entries);
+	wl_list_init(&manager->writers);
+	wl_array_init(&manager->caps);
+
+	tw_signal_setup_listener(&device->source_added,
+	                         &manager->source_added,
+	                         notify_clipboard_source_added);
+	tw_signal_setup_listener(&device->source_removed,
+	                         &manager->source_removed,
+	                         notify_clipboard_source_removed);
+	tw_signal_setup_listener(&device->destroy_signal,
+	                         &manager->device_destroy,
+	                         notify_clipboard_device_destroy);
+	return true;
+}
+
+WL_EXPORT void
+tw_clipboard_manager_fini(struct tw_clipboard_manager *manager)
+{
+	struct clipboard_writer *writer, *tmp;
+	struct clipboard_cap *cap;
+
+	tw_reset_wl_list(&manager->source_added.link);
+	tw_reset_wl_list(&manager->source_removed.link);
+	tw_reset_wl_list(&manager->device_destroy.link);
+	clipboard_discard(manager);
+	wl_list_for_each_safe(writer, tmp, &manager->writers, link)
+		clipboard_writer_destroy(writer);
+	wl_array_for_each(cap, &manager->caps)
+		free(cap->prefix);
+	wl_array_release(&manager->caps);
+	wl_array_init(&manager->caps);
+}
+
+WL_EXPORT bool
+tw_clipboard_manager_set_cap(struct tw_clipboard_manager *manager,
+                             const char *mime_prefix, size_t cap)
+{
+	struct clipboard_cap *c;
+
+	if (!mime_prefix || !*mime_prefix) {
+		manager->default_cap = cap;
+		return true;
+	}
+	wl_array_for_each(c, &manager->caps) {
+		if (!strcmp(c->prefix, mime_prefix)) {
+			c->cap = cap;
+			return true;
+		}
+	}
+	if (!(c = wl_array_add(&manager->caps, sizeof(*c))))
+		return false;
+	if (!(c->prefix = strdup(mime_prefix))) {
+		manager->caps.size -= sizeof(*c);
+		return false;
+	}
+	c->cap = cap;
+	return true;
+}
@@ -93,14 +93,19 @@ notify_device_selection_data_offer(struct wl_listener *listener, void *data)
 	struct wl_resource *resource;
 	struct wl_resource *offer;
 	struct wl_resource *surface = data;
+	struct wl_client *client = wl_resource_get_client(surface);
 	struct tw_data_device *device =
 		wl_container_of(listener, device, create_data_offer);
 
 	if (!device->source_set || !device->source_set->selection_source)
 		return;
-	//send the data offers
+	//only the focused client holds the selection offer, focus moving
+	//within the client keeps its offer.
+	tw_data_offer_drop_resources(&device->source_set->offer, client);
+	if (tw_data_offer_has_client(&device->source_set->offer, client))
+		return;
 	wl_resource_for_each(resource, &device->clients) {
-		if (!tw_match_wl_resource_client(surface, resource))
+		if (wl_resource_get_client(resource) != client)
 			continue;
 		offer = tw_data_device_create_data_offer(resource,
 		                                         device->source_set);
@@ -125,7 +130,10 @@ data_device_start_drag(struct wl_client *client,
 		tw_surface_from_resource(surface_resource);
 
 	source->selection_source = false;
-	//TODO: match the serial against pointer or touch for the grab.
+	if (!tw_seat_verify_serial(device->seat, serial, TW_SERIAL_GRAB)) {
+		tw_logl("invalid drag serial %u", serial);
+		return;
+	}
 	if (tw_data_source_start_drag(&device->drag, resource, source,
 	                              device->seat)) {
 		//we need to trigger a enter event
@@ -158,6 +166,11 @@ data_device_set_selection(struct wl_client *client,
 	struct tw_data_device *device =
 		tw_data_device_from_source(device_resource);
 
+	if (!tw_seat_verify_serial(device->seat, serial,
+	                           TW_SERIAL_SELECTION)) {
+		tw_logl("invalid selection serial %u", serial);
+		return;
+	}
         tw_data_device_set_selection(device, source);
 }
 
@@ -193,6 +206,8 @@ static void
 tw_data_device_destroy(struct tw_data_device *device)
 {
 	struct wl_resource *resource, *tmp;
+
+	wl_signal_emit(&device->destroy_signal, device);
 	tw_reset_wl_list(&device->seat_destroy.link);
 	tw_reset_wl_list(&device->create_data_offer.link);
 	wl_list_remove(&device->link);
@@ -346,6 +361,7 @@ tw_data_device_find_create(struct tw_data_device_manager *manager,
 	wl_list_init(&device->source_destroy.link);
 	wl_signal_init(&device->source_added);
 	wl_signal_init(&device->source_removed);
+	wl_signal_init(&device->destroy_signal);
 	wl_list_insert(manager->devices.prev, &device->link);
 	tw_signal_setup_listener(&seat->focus_signal,
 	                         &device->create_data_offer,
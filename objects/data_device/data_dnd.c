@@ -64,7 +64,8 @@ dnd_pointer_enter(struct tw_seat_pointer_grab *grab,
 		//TODO: idealy create data offer for all the surface that
 		offer = tw_data_device_create_data_offer(resource,
 		                                         drag->source);
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_DND_ENTER);
 		wl_data_device_send_leave(prev_resource);
 		wl_data_device_send_enter(resource, serial, surface,
 		                          wl_fixed_from_double(sx),
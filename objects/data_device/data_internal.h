@@ -53,6 +53,15 @@ tw_data_offer_add_resource(struct tw_data_offer *offer,
 void
 tw_data_offer_set_source_actions(struct tw_data_offer *offer,
                                  uint32_t dnd_actions);
+bool
+tw_data_offer_has_client(struct tw_data_offer *offer,
+                         struct wl_client *client);
+/**
+ * @brief drop the offer resources of all the clients except the given one.
+ */
+void
+tw_data_offer_drop_resources(struct tw_data_offer *offer,
+                             struct wl_client *keep);
 struct tw_data_source *
 tw_data_source_create(struct wl_client *client, uint32_t id,
                       uint32_t version);
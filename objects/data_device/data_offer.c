@@ -84,8 +84,11 @@ data_offer_receive(struct wl_client *client,
 {
 	struct tw_data_offer *offer = tw_data_offer_from_resource(resource);
 
-        if (!offer || !offer->source)
+	//dropped offer, the fd is ours to close
+	if (!offer || !offer->source) {
+		close(fd);
 		return;
+	}
 
 	//it is either we do not check at all or we verify if offer source is
 	//linked
@@ -97,10 +100,11 @@ static void
 data_offer_finish(struct wl_client *client, struct wl_resource *resource)
 {
 	struct tw_data_offer *offer = tw_data_offer_from_resource(resource);
-	struct tw_data_source *source = offer->source;
+	struct tw_data_source *source;
 
 	if (!offer || !offer->source)
 		return;
+	source = offer->source;
 
 	if (source->selection_source) {
 		wl_resource_post_error(resource,
@@ -239,6 +243,29 @@ tw_data_offer_add_resource(struct tw_data_offer *offer,
 		                                  offer->source->actions);
 }
 
+bool
+tw_data_offer_has_client(struct tw_data_offer *offer,
+                         struct wl_client *client)
+{
+	struct wl_resource *r;
+	wl_resource_for_each(r, &offer->resources)
+		if (wl_resource_get_client(r) == client)
+			return true;
+	return false;
+}
+
+void
+tw_data_offer_drop_resources(struct tw_data_offer *offer,
+                             struct wl_client *keep)
+{
+	struct wl_resource *r, *tmp;
+
+	//the dropped resources are inert until clients destroy them
+	wl_resource_for_each_safe(r, tmp, &offer->resources)
+		if (wl_resource_get_client(r) != keep)
+			destroy_data_offer_resource(r);
+}
+
 void
 tw_data_offer_set_source_actions(struct tw_data_offer *offer,
                                  uint32_t dnd_actions)
@@ -50,8 +50,13 @@ data_source_offer(struct wl_client *client,
 {
 	struct tw_data_source *data_source =
 		tw_data_source_from_resource(resource);
-	char **new_mime_type =
-		wl_array_add(&data_source->mimes, sizeof(char *));
+	char **new_mime_type;
+
+	//the mime list is built once here and shared by every offer
+	wl_array_for_each(new_mime_type, &data_source->mimes)
+		if (!strcmp(*new_mime_type, mime_type))
+			return;
+	new_mime_type = wl_array_add(&data_source->mimes, sizeof(char *));
 	if (new_mime_type)
 		*new_mime_type = strdup(mime_type);
 }
@@ -217,7 +217,7 @@ tw_desktop_surface_move(struct tw_desktop_surface *surf,
 {
 	void *user_data = surf->desktop->user_data;
 
-	if (!tw_seat_valid_serial(seat, serial)) {
+	if (!tw_seat_verify_serial(seat, serial, TW_SERIAL_GRAB)) {
 		tw_logl("invalid serial %u", serial);
 		return;
 	}
@@ -231,7 +231,7 @@ tw_desktop_surface_resize(struct tw_desktop_surface *surf,
 {
 	void *user_data = surf->desktop->user_data;
 
-	if (!tw_seat_valid_serial(seat, serial)) {
+	if (!tw_seat_verify_serial(seat, serial, TW_SERIAL_GRAB)) {
 		tw_logl("invalid serial %u", serial);
 		return;
 	}
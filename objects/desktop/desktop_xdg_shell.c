@@ -655,6 +655,13 @@ handle_popup_grab(struct wl_client *client,
 		xdg_surface_from_popup(resource);
 
 	struct tw_seat *tw_seat = tw_seat_from_resource(seat);
+
+	//popup without a valid grab serial shall be dismissed
+	if (!tw_seat_verify_serial(tw_seat, serial, TW_SERIAL_GRAB)) {
+		tw_logl("invalid popup grab serial %u", serial);
+		xdg_popup_send_popup_done(resource);
+		return;
+	}
 	tw_popup_grab_init(&xdg_surface->popup.grab,
 	                   xdg_surface->base.tw_surface,
 	                   xdg_surface->popup.resource);
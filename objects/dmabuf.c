@@ -23,20 +23,39 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <drm_fourcc.h>
 #include <wayland-server.h>
 #include <wayland-linux-dmabuf-server-protocol.h>
 
 #include <taiwins/objects/utils.h>
+#include <taiwins/objects/logger.h>
 #include <taiwins/objects/dmabuf.h>
 
-#define DMA_BUF_VERSION 3
+#include "os-compatibility.h"
+
+#define DMA_BUF_VERSION 4
+//the feedback needs a main device, without it we stay at version 3
+#define DMA_BUF_VERSION_NO_DEVICE 3
+#define DMA_BUF_MAX_TABLE_ENTRIES (UINT16_MAX + 1)
+
+struct tw_dmabuf_surface_feedback {
+	struct wl_list link;
+	struct wl_resource *surface;
+	struct wl_listener surface_destroy;
+	/* NULL for using the default feedback */
+	const struct tw_linux_dmabuf_feedback *feedback;
+	struct wl_list resources;
+};
 
 static const struct zwp_linux_buffer_params_v1_interface buffer_params_impl;
 
 static struct tw_linux_dmabuf s_tw_linux_dmabuf = {0};
 
 static void tw_dmabuf_buffer_destroy(struct tw_dmabuf_buffer *buffer);
+static bool
+dmabuf_create_global(struct tw_linux_dmabuf *dma, uint32_t version);
 
 static const struct  wl_buffer_interface  wl_buffer_impl = {
 	.destroy = tw_resource_destroy_common,
@@ -109,6 +128,8 @@ tw_dmabuf_attributes_init(struct tw_dmabuf_attributes *attrs)
 static void
 tw_dmabuf_buffer_destroy(struct tw_dmabuf_buffer *buffer)
 {
+	if (buffer->image_cache.image && buffer->image_cache.release)
+		buffer->image_cache.release(buffer);
 	for (int i = 0; i < buffer->attributes.n_planes; i++) {
 		if (buffer->attributes.fds[i] != -1) {
 			close(buffer->attributes.fds[i]);
@@ -174,10 +195,10 @@ out:
 
 static inline bool
 test_import_buffer(struct tw_linux_dmabuf *dma,
-                   struct tw_dmabuf_attributes *attributes)
+                   struct tw_dmabuf_buffer *buffer)
 {
 	if (dma->impl && dma->impl->test_import &&
-	    dma->impl->test_import(attributes, dma->impl_userdata))
+	    dma->impl->test_import(buffer, dma->impl_userdata))
 		return true;
 	else
 		return false;
@@ -294,7 +315,7 @@ buffer_params_create_common(struct wl_client *client,
 		goto err_out;
 	}
 	//now the dma buffer need to
-	if (!test_import_buffer(dma, &buffer->attributes))
+	if (!test_import_buffer(dma, buffer))
 		goto err_failed;
 
 	//at this point we will create a wl_buffer
@@ -363,6 +384,408 @@ static const struct zwp_linux_buffer_params_v1_interface buffer_params_impl = {
 	.create_immed = buffer_params_create_immed,
 };
 
+/******************************************************************************
+ * format table
+ *****************************************************************************/
+
+static int
+cmp_table_entry(const void *a, const void *b)
+{
+	const struct tw_linux_dmabuf_table_entry *x = a, *y = b;
+
+	if (x->format != y->format)
+		return x->format < y->format ? -1 : 1;
+	if (x->modifier != y->modifier)
+		return x->modifier < y->modifier ? -1 : 1;
+	return 0;
+}
+
+static bool
+dmabuf_table_add(struct wl_array *table, uint32_t format, uint64_t modifier)
+{
+	struct tw_linux_dmabuf_table_entry *entry;
+
+	if (table->size / sizeof(*entry) >= DMA_BUF_MAX_TABLE_ENTRIES) {
+		tw_logl_level(TW_LOG_WARN, "dmabuf format table is full");
+		return false;
+	}
+	if (!(entry = wl_array_add(table, sizeof(*entry))))
+		return false;
+	entry->format = format;
+	entry->pad = 0;
+	entry->modifier = modifier;
+	return true;
+}
+
+static bool
+dmabuf_ensure_format_table(struct tw_linux_dmabuf *dma)
+{
+	struct wl_array formats, modifiers, table;
+	size_t n_formats = 0, n_modifiers;
+	bool ret = false;
+
+	if (dma->table.entries)
+		return true;
+	if (!dma->impl || !dma->impl->format_request ||
+	    !dma->impl->modifiers_request)
+		return false;
+
+	wl_array_init(&formats);
+	wl_array_init(&modifiers);
+	wl_array_init(&table);
+
+	dma->impl->format_request(dma, dma->impl_userdata, NULL, &n_formats);
+	if (!n_formats ||
+	    !wl_array_add(&formats, n_formats * sizeof(int)))
+		goto out;
+	dma->impl->format_request(dma, dma->impl_userdata,
+	                          formats.data, &n_formats);
+
+	for (size_t i = 0; i < n_formats; i++) {
+		int format = ((int *)formats.data)[i];
+		uint64_t *mods;
+
+		n_modifiers = 0;
+		dma->impl->modifiers_request(dma, dma->impl_userdata,
+		                             format, NULL, &n_modifiers);
+		//DRM_FORMAT_MOD_INVALID for formats without modifiers
+		if (!n_modifiers) {
+			if (!dmabuf_table_add(&table, format,
+			                      DRM_FORMAT_MOD_INVALID))
+				break;
+			continue;
+		}
+		modifiers.size = 0;
+		if (!wl_array_add(&modifiers, n_modifiers * sizeof(uint64_t)))
+			goto out;
+		mods = modifiers.data;
+		dma->impl->modifiers_request(dma, dma->impl_userdata,
+		                             format, mods, &n_modifiers);
+		for (size_t j = 0; j < n_modifiers; j++)
+			if (!dmabuf_table_add(&table, format, mods[j]))
+				break;
+	}
+	if (!table.size)
+		goto out;
+	//sorted so tranches can look up the indices
+	qsort(table.data, table.size / sizeof(*dma->table.entries),
+	      sizeof(*dma->table.entries), cmp_table_entry);
+	dma->table.entries = table.data;
+	dma->table.len = table.size / sizeof(*dma->table.entries);
+	dma->table.fd = os_create_sealed_file(table.data, table.size);
+	wl_array_init(&table);
+	ret = true;
+out:
+	wl_array_release(&formats);
+	wl_array_release(&modifiers);
+	wl_array_release(&table);
+	return ret;
+}
+
+static int
+dmabuf_table_find(struct tw_linux_dmabuf *dma, uint32_t format,
+                  uint64_t modifier)
+{
+	struct tw_linux_dmabuf_table_entry key = {
+		.format = format,
+		.modifier = modifier,
+	}, *entry;
+
+	entry = bsearch(&key, dma->table.entries, dma->table.len,
+	                sizeof(key), cmp_table_entry);
+	return entry ? entry - dma->table.entries : -1;
+}
+
+static int
+dmabuf_table_copy(struct tw_linux_dmabuf *dma)
+{
+	size_t size = dma->table.len * sizeof(*dma->table.entries);
+	void *ptr;
+	int fd = os_create_anonymous_file(size);
+
+	if (fd < 0)
+		return -1;
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	memcpy(ptr, dma->table.entries, size);
+	munmap(ptr, size);
+	return fd;
+}
+
+static void
+dmabuf_table_fini(struct tw_linux_dmabuf *dma)
+{
+	if (dma->table.fd >= 0)
+		close(dma->table.fd);
+	free(dma->table.entries);
+	dma->table.entries = NULL;
+	dma->table.len = 0;
+	dma->table.fd = -1;
+}
+
+/******************************************************************************
+ * tw_linux_dmabuf_feedback implementation
+ *****************************************************************************/
+
+WL_EXPORT void
+tw_linux_dmabuf_feedback_init(struct tw_linux_dmabuf_feedback *feedback,
+                              dev_t main_device)
+{
+	feedback->main_device = main_device;
+	wl_array_init(&feedback->tranches);
+}
+
+WL_EXPORT void
+tw_linux_dmabuf_feedback_fini(struct tw_linux_dmabuf_feedback *feedback)
+{
+	struct tw_linux_dmabuf_tranche *tranche;
+
+	wl_array_for_each(tranche, &feedback->tranches)
+		wl_array_release(&tranche->indices);
+	wl_array_release(&feedback->tranches);
+	wl_array_init(&feedback->tranches);
+}
+
+static bool
+tranche_add_index(struct tw_linux_dmabuf_tranche *tranche, int index)
+{
+	uint16_t *idx;
+
+	if (index < 0)
+		return true;
+	if (!(idx = wl_array_add(&tranche->indices, sizeof(uint16_t))))
+		return false;
+	*idx = index;
+	return true;
+}
+
+WL_EXPORT bool
+tw_linux_dmabuf_feedback_add_tranche(struct tw_linux_dmabuf *dma,
+                                     struct tw_linux_dmabuf_feedback *feedback,
+                                     dev_t target_device, uint32_t flags,
+                                     const struct tw_drm_formats *formats)
+{
+	const struct tw_drm_format *format;
+	const struct tw_drm_modifier *mods;
+	struct tw_linux_dmabuf_tranche *tranche;
+	bool ret = true;
+
+	if (!dmabuf_ensure_format_table(dma))
+		return false;
+	if (!(tranche = wl_array_add(&feedback->tranches, sizeof(*tranche))))
+		return false;
+	tranche->target_device = target_device;
+	tranche->flags = flags;
+	wl_array_init(&tranche->indices);
+
+	if (!formats) {
+		for (size_t i = 0; i < dma->table.len && ret; i++)
+			ret = tranche_add_index(tranche, i);
+		goto out;
+	}
+	wl_array_for_each(format, &formats->formats) {
+		mods = tw_drm_modifiers_get(formats, format);
+		if (!mods)
+			ret = tranche_add_index(tranche, dmabuf_table_find(
+				dma, format->fmt, DRM_FORMAT_MOD_INVALID));
+		for (int i = 0; i < format->len && ret; i++)
+			ret = tranche_add_index(tranche, dmabuf_table_find(
+				dma, format->fmt, mods[i].modifier));
+		if (!ret)
+			break;
+	}
+out:
+	if (!ret) {
+		wl_array_release(&tranche->indices);
+		feedback->tranches.size -= sizeof(*tranche);
+	}
+	return ret;
+}
+
+static void
+dmabuf_send_feedback(struct tw_linux_dmabuf *dma,
+                     struct wl_resource *resource,
+                     const struct tw_linux_dmabuf_feedback *feedback)
+{
+	struct tw_linux_dmabuf_tranche *tranche;
+	dev_t dev = feedback->main_device;
+	struct wl_array device = {
+		.size = sizeof(dev),
+		.alloc = 0,
+		.data = &dev,
+	};
+	int fd = dma->table.fd >= 0 ? dma->table.fd : dmabuf_table_copy(dma);
+
+	//the format table is mandatory for every feedback
+	if (fd < 0) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	//the fd is duplicated by libwayland, the sealed one can be shared
+	zwp_linux_dmabuf_feedback_v1_send_format_table(
+		resource, fd, dma->table.len * sizeof(*dma->table.entries));
+	if (fd != dma->table.fd)
+		close(fd);
+	zwp_linux_dmabuf_feedback_v1_send_main_device(resource, &device);
+
+	wl_array_for_each(tranche, &feedback->tranches) {
+		dev = tranche->target_device;
+		zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(
+			resource, &device);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_formats(
+			resource, &tranche->indices);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_flags(
+			resource, tranche->flags);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_done(resource);
+	}
+	zwp_linux_dmabuf_feedback_v1_send_done(resource);
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_interface feedback_impl = {
+	.destroy = tw_resource_destroy_common,
+};
+
+static void
+feedback_destroy_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static struct wl_resource *
+dmabuf_create_feedback(struct wl_client *client, struct wl_resource *resource,
+                       uint32_t id, struct wl_list *resources)
+{
+	struct wl_resource *feedback =
+		wl_resource_create(client,
+		                   &zwp_linux_dmabuf_feedback_v1_interface,
+		                   wl_resource_get_version(resource), id);
+	if (!feedback) {
+		wl_resource_post_no_memory(resource);
+		return NULL;
+	}
+	wl_resource_set_implementation(feedback, &feedback_impl, NULL,
+	                               feedback_destroy_resource);
+	wl_list_insert(resources, wl_resource_get_link(feedback));
+	return feedback;
+}
+
+static void
+notify_surface_feedback_surface_destroy(struct wl_listener *listener,
+                                        void *data)
+{
+	struct tw_dmabuf_surface_feedback *entry =
+		wl_container_of(listener, entry, surface_destroy);
+	struct wl_resource *resource, *tmp;
+
+	//feedback objects stay alive but receive nothing anymore
+	wl_resource_for_each_safe(resource, tmp, &entry->resources)
+		tw_reset_wl_list(wl_resource_get_link(resource));
+	wl_list_remove(&entry->surface_destroy.link);
+	wl_list_remove(&entry->link);
+	free(entry);
+}
+
+static struct tw_dmabuf_surface_feedback *
+dmabuf_ensure_surface_feedback(struct tw_linux_dmabuf *dma,
+                               struct wl_resource *surface)
+{
+	struct tw_dmabuf_surface_feedback *entry;
+
+	wl_list_for_each(entry, &dma->surface_feedbacks, link)
+		if (entry->surface == surface)
+			return entry;
+	if (!(entry = calloc(1, sizeof(*entry))))
+		return NULL;
+	entry->surface = surface;
+	wl_list_init(&entry->resources);
+	tw_set_resource_destroy_listener(surface, &entry->surface_destroy,
+	                                 notify_surface_feedback_surface_destroy);
+	wl_list_insert(&dma->surface_feedbacks, &entry->link);
+	return entry;
+}
+
+static void
+linux_dmabuf_get_default_feedback(struct wl_client *client,
+                                  struct wl_resource *resource, uint32_t id)
+{
+	struct tw_linux_dmabuf *dma = wl_resource_get_user_data(resource);
+	struct wl_resource *feedback =
+		dmabuf_create_feedback(client, resource, id,
+		                       &dma->default_resources);
+
+	//only version 4 asks, which we have with a main device
+	if (feedback)
+		dmabuf_send_feedback(dma, feedback, &dma->default_feedback);
+}
+
+static void
+linux_dmabuf_get_surface_feedback(struct wl_client *client,
+                                  struct wl_resource *resource, uint32_t id,
+                                  struct wl_resource *surface)
+{
+	struct tw_linux_dmabuf *dma = wl_resource_get_user_data(resource);
+	struct tw_dmabuf_surface_feedback *entry =
+		dmabuf_ensure_surface_feedback(dma, surface);
+	struct wl_resource *feedback;
+
+	if (!entry) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	feedback = dmabuf_create_feedback(client, resource, id,
+	                                  &entry->resources);
+	if (feedback)
+		dmabuf_send_feedback(dma, feedback, entry->feedback ?
+		                     entry->feedback : &dma->default_feedback);
+}
+
+WL_EXPORT void
+tw_linux_dmabuf_set_surface_feedback(struct tw_linux_dmabuf *dma,
+                                     struct wl_resource *surface,
+                                     const struct tw_linux_dmabuf_feedback *fb)
+{
+	struct tw_dmabuf_surface_feedback *entry =
+		dmabuf_ensure_surface_feedback(dma, surface);
+	struct wl_resource *resource;
+
+	if (!entry || entry->feedback == fb)
+		return;
+	entry->feedback = fb;
+	wl_resource_for_each(resource, &entry->resources)
+		dmabuf_send_feedback(dma, resource, fb ? fb :
+		                     &dma->default_feedback);
+}
+
+WL_EXPORT bool
+tw_linux_dmabuf_set_main_device(struct tw_linux_dmabuf *dma, dev_t device)
+{
+	struct tw_dmabuf_surface_feedback *entry;
+	struct wl_resource *resource;
+
+	tw_linux_dmabuf_feedback_fini(&dma->default_feedback);
+	tw_linux_dmabuf_feedback_init(&dma->default_feedback, device);
+	if (!tw_linux_dmabuf_feedback_add_tranche(dma, &dma->default_feedback,
+	                                          device, 0, NULL))
+		return false;
+	if (dma->version < DMA_BUF_VERSION &&
+	    !dmabuf_create_global(dma, DMA_BUF_VERSION))
+		return false;
+
+	wl_resource_for_each(resource, &dma->default_resources)
+		dmabuf_send_feedback(dma, resource, &dma->default_feedback);
+	wl_list_for_each(entry, &dma->surface_feedbacks, link) {
+		if (entry->feedback)
+			continue;
+		wl_resource_for_each(resource, &entry->resources)
+			dmabuf_send_feedback(dma, resource,
+			                     &dma->default_feedback);
+	}
+	return true;
+}
+
 /******************************************************************************
  * linux_dmabuf implementation
  *****************************************************************************/
@@ -388,6 +811,7 @@ linux_dmabuf_create_params(struct wl_client *client,
 	                               &buffer_params_impl,
 	                               buffer, buffer_params_destroy);
 	tw_dmabuf_attributes_init(&buffer->attributes);
+	wl_list_init(&buffer->image_cache.link);
 	return;
 err_resource:
 	free(buffer);
@@ -398,6 +822,8 @@ err_buffer:
 static const struct zwp_linux_dmabuf_v1_interface dmabuf_v1_impl = {
 	.destroy = tw_resource_destroy_common,
 	.create_params = linux_dmabuf_create_params,
+	.get_default_feedback = linux_dmabuf_get_default_feedback,
+	.get_surface_feedback = linux_dmabuf_get_surface_feedback,
 };
 
 static void
@@ -409,55 +835,31 @@ static bool
 dmabuf_send_formats(struct tw_linux_dmabuf *dma,
                     struct wl_resource *resource, uint32_t v)
 {
-	size_t n_formats = 0, n_modifiers = 0;
+	struct tw_linux_dmabuf_table_entry *entry;
 	uint32_t modifier_lo, modifier_hi;
+	int64_t last_format = -1;
 
-        if (!dma->impl || !dma->impl->format_request ||
-	    !dma->impl->modifiers_request)
-		return NULL;
-
-	dma->impl->format_request(dma, dma->impl_userdata,
-	                          NULL, &n_formats);
-	if (!n_formats)
+	if (!dmabuf_ensure_format_table(dma))
 		return false;
-	assert(n_formats > 0);
-	int formats[n_formats];
-	dma->impl->format_request(dma, dma->impl_userdata,
-	                          formats, &n_formats);
-	//send DRM_FORMAT_MOD_INVALID token when no modifiers are supported for
-	//this format
-        for (size_t i = 0; i < n_formats; i++) {
-	        bool no_modifiers = false;
-		dma->impl->modifiers_request(dma, dma->impl_userdata,
-		                             formats[i], NULL, &n_modifiers);
-		if (!n_modifiers) {
-			no_modifiers = true;
-			n_modifiers = 1;
-		}
-		assert(n_modifiers > 0);
-		uint64_t modifiers[n_formats];
-		dma->impl->modifiers_request(dma, dma->impl_userdata,
-		                             formats[i], modifiers,
-		                             &n_modifiers);
-		if (!n_modifiers) {
-			n_modifiers = 1;
-			modifiers[0]= DRM_FORMAT_MOD_INVALID;
-		}
-		for (unsigned j = 0; j < n_modifiers; j++) {
-			 if (v >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
-				 modifier_lo = modifiers[j] & 0xFFFFFFFF;
-				 modifier_hi = modifiers[j] >> 32;
-				 zwp_linux_dmabuf_v1_send_modifier(
-					 resource, formats[i],
-					 modifier_hi, modifier_lo);
-			 } else if (modifiers[j] == DRM_FORMAT_MOD_LINEAR ||
-			            no_modifiers) {
-				 zwp_linux_dmabuf_v1_send_format(resource,
-				                                 formats[i]);
-			 }
+	//the table is sorted, same formats are consecutive
+	for (size_t i = 0; i < dma->table.len; i++) {
+		entry = &dma->table.entries[i];
+		if (v >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+			modifier_lo = entry->modifier & 0xFFFFFFFF;
+			modifier_hi = entry->modifier >> 32;
+			zwp_linux_dmabuf_v1_send_modifier(resource,
+			                                  entry->format,
+			                                  modifier_hi,
+			                                  modifier_lo);
+		} else if ((entry->modifier == DRM_FORMAT_MOD_LINEAR ||
+		            entry->modifier == DRM_FORMAT_MOD_INVALID) &&
+		           last_format != entry->format) {
+			zwp_linux_dmabuf_v1_send_format(resource,
+			                                entry->format);
+			last_format = entry->format;
 		}
 	}
-        return true;
+	return true;
 }
 
 static void
@@ -475,8 +877,26 @@ bind_dmabuf(struct wl_client *wl_client, void *data,
 	wl_resource_set_implementation(resource,
 	                               &dmabuf_v1_impl, dmabuf,
 	                               dmabuf_destroy_resource);
-	dmabuf_send_formats(dmabuf, resource, version);
-	//TODO if failed, we shall do something though
+	//version 4 clients get the formats from the feedback instead
+	if (version < ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+		dmabuf_send_formats(dmabuf, resource, version);
+}
+
+/* replaces the global, the clients bound to the old one keep their resources */
+static bool
+dmabuf_create_global(struct tw_linux_dmabuf *dma, uint32_t version)
+{
+	struct wl_global *global =
+		wl_global_create(dma->display, &zwp_linux_dmabuf_v1_interface,
+		                 version, dma, bind_dmabuf);
+
+	if (!global)
+		return false;
+	if (dma->global)
+		wl_global_destroy(dma->global);
+	dma->global = global;
+	dma->version = version;
+	return true;
 }
 
 static void
@@ -484,7 +904,13 @@ notify_dmabuf_destroy(struct wl_listener *listener, void *data)
 {
 	struct tw_linux_dmabuf *dma =
 		wl_container_of(listener, dma, destroy_listener);
+	struct tw_dmabuf_surface_feedback *entry, *tmp;
 
+	wl_list_for_each_safe(entry, tmp, &dma->surface_feedbacks, link)
+		notify_surface_feedback_surface_destroy(
+			&entry->surface_destroy, NULL);
+	tw_linux_dmabuf_feedback_fini(&dma->default_feedback);
+	dmabuf_table_fini(dma);
 	wl_global_destroy(dma->global);
 	wl_list_remove(&dma->destroy_listener.link);
 }
@@ -493,16 +919,19 @@ WL_EXPORT bool
 tw_linux_dmabuf_init(struct tw_linux_dmabuf *dmabuf,
                      struct wl_display *display)
 {
-	dmabuf->global = wl_global_create(display,
-	                                  &zwp_linux_dmabuf_v1_interface,
-	                                  DMA_BUF_VERSION,
-	                                  dmabuf,
-	                                  bind_dmabuf);
-	if (!dmabuf->global)
-		return false;
 	dmabuf->display = display;
+	dmabuf->global = NULL;
+	dmabuf->version = 0;
+	if (!dmabuf_create_global(dmabuf, DMA_BUF_VERSION_NO_DEVICE))
+		return false;
 	dmabuf->impl = NULL;
 	dmabuf->impl_userdata = NULL;
+	dmabuf->table.entries = NULL;
+	dmabuf->table.len = 0;
+	dmabuf->table.fd = -1;
+	tw_linux_dmabuf_feedback_init(&dmabuf->default_feedback, 0);
+	wl_list_init(&dmabuf->default_resources);
+	wl_list_init(&dmabuf->surface_feedbacks);
 
 	wl_list_init(&dmabuf->destroy_listener.link);
 	dmabuf->destroy_listener.notify = notify_dmabuf_destroy;
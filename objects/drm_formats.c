@@ -19,8 +19,13 @@
  *
  */
 
+#include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <stdint.h>
 #include <wayland-util.h>
 
@@ -46,74 +51,497 @@ tw_drm_formats_count(struct tw_drm_formats *formats)
 	return formats->formats.size / sizeof(struct tw_drm_format);
 }
 
-WL_EXPORT bool
-tw_drm_formats_add_format(struct tw_drm_formats *formats, uint32_t fmt,
-                          int n_mods, uint64_t *modifiers, bool *externals)
+static int
+cmp_format(const void *a, const void *b)
+{
+	const struct tw_drm_format *x = a, *y = b;
+
+	return (x->fmt > y->fmt) - (x->fmt < y->fmt);
+}
+
+static int
+cmp_modifier(const void *a, const void *b)
+{
+	const struct tw_drm_modifier *x = a, *y = b;
+
+	return (x->modifier > y->modifier) - (x->modifier < y->modifier);
+}
+
+static inline struct tw_drm_modifier *
+formats_mods(const struct tw_drm_formats *formats,
+             const struct tw_drm_format *format)
+{
+	return (struct tw_drm_modifier *)formats->modifiers.data +
+		format->cursor;
+}
+
+/* lower bound of fmt in the sorted format array */
+static size_t
+formats_lower_bound(const struct tw_drm_formats *formats, uint32_t fmt)
 {
-	struct tw_drm_format *format = NULL;
+	const struct tw_drm_format *data = formats->formats.data;
+	size_t lo = 0, hi = formats->formats.size / sizeof(*data);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (data[mid].fmt < fmt)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
+/* reserve a range of modifiers at the end, return its cursor or -1 */
+static int
+formats_reserve_mods(struct tw_drm_formats *formats, int n_mods)
+{
 	int cursor = formats->modifiers.size / sizeof(struct tw_drm_modifier);
-	size_t size = n_mods * sizeof(struct tw_drm_modifier);
-	struct tw_drm_modifier *mods =
-		(n_mods) ? wl_array_add(&formats->modifiers, size) : NULL;
 
-	if (!mods && (n_mods != 0))
-		return false;
-	//if this allocation failed, we would left with wasted space
-	if (!(format = wl_array_add(&formats->formats,
-	                            sizeof(struct tw_drm_format))))
-		return false;
+	if (n_mods &&
+	    !wl_array_add(&formats->modifiers,
+	                  n_mods * sizeof(struct tw_drm_modifier)))
+		return -1;
+	return cursor;
+}
 
-	//finally coping the data
+/* append a format known to be larger than the others, for the set ops */
+static struct tw_drm_format *
+formats_append(struct tw_drm_formats *formats, uint32_t fmt, int n_mods)
+{
+	struct tw_drm_format *format;
+	int cursor = formats_reserve_mods(formats, n_mods);
+
+	if (cursor < 0)
+		return NULL;
+	if (!(format = wl_array_add(&formats->formats, sizeof(*format)))) {
+		formats->modifiers.size -= n_mods *
+			sizeof(struct tw_drm_modifier);
+		return NULL;
+	}
+	format->fmt = fmt;
 	format->cursor = cursor;
 	format->len = n_mods;
-	format->fmt = fmt;
+	return format;
+}
+
+/* sort the modifiers of a format in place and drop the duplicates */
+static void
+format_sort_mods(struct tw_drm_formats *formats, struct tw_drm_format *format)
+{
+	struct tw_drm_modifier *mods = formats_mods(formats, format);
+	int len = 0;
+
+	if (format->len < 2)
+		return;
+	qsort(mods, format->len, sizeof(*mods), cmp_modifier);
+	for (int i = 0; i < format->len; i++) {
+		if (len && mods[len-1].modifier == mods[i].modifier) {
+			mods[len-1].external |= mods[i].external;
+			continue;
+		}
+		mods[len++] = mods[i];
+	}
+	format->len = len;
+}
+
+WL_EXPORT bool
+tw_drm_formats_add_format(struct tw_drm_formats *formats, uint32_t fmt,
+                          int n_mods, uint64_t *modifiers, bool *externals)
+{
+	struct tw_drm_format *format, *data;
+	struct tw_drm_modifier *mods;
+	size_t pos = formats_lower_bound(formats, fmt);
+	size_t count = tw_drm_formats_count(formats);
+	int old_len = 0, cursor;
+
+	data = formats->formats.data;
+	//existing format, the merged set moves to a new range
+	if (pos < count && data[pos].fmt == fmt)
+		old_len = data[pos].len;
+	if ((cursor = formats_reserve_mods(formats, old_len + n_mods)) < 0)
+		return false;
+	mods = (struct tw_drm_modifier *)formats->modifiers.data + cursor;
+
+	if (old_len) {
+		data = formats->formats.data;
+		memcpy(mods, formats_mods(formats, &data[pos]),
+		       old_len * sizeof(*mods));
+	}
 	for (int i = 0; i < n_mods; i++) {
-		mods[i].modifier = modifiers[i];
-		mods[i].external = externals[i];
+		mods[old_len+i].modifier = modifiers[i];
+		mods[old_len+i].external = externals[i];
+	}
+
+	if (pos < count && ((struct tw_drm_format *)
+	                    formats->formats.data)[pos].fmt == fmt) {
+		format = (struct tw_drm_format *)formats->formats.data + pos;
+	} else {
+		//if this allocation failed, we would left with wasted space
+		if (!wl_array_add(&formats->formats, sizeof(*format)))
+			return false;
+		format = (struct tw_drm_format *)formats->formats.data + pos;
+		memmove(format + 1, format, (count - pos) * sizeof(*format));
+		format->fmt = fmt;
 	}
+	format->cursor = cursor;
+	format->len = old_len + n_mods;
+	format_sort_mods(formats, format);
 	return true;
 }
 
+WL_EXPORT const struct tw_drm_format *
+tw_drm_format_find(const struct tw_drm_formats *formats, uint32_t fmt)
+{
+	struct tw_drm_format key = { .fmt = fmt };
+
+	return bsearch(&key, formats->formats.data,
+	               formats->formats.size / sizeof(key), sizeof(key),
+	               cmp_format);
+}
+
+WL_EXPORT const struct tw_drm_modifier *
+tw_drm_format_find_modifier(const struct tw_drm_formats *formats,
+                            uint32_t fmt, uint64_t modifier)
+{
+	const struct tw_drm_format *format = tw_drm_format_find(formats, fmt);
+	struct tw_drm_modifier key = { .modifier = modifier };
+
+	if (!format || !format->len)
+		return NULL;
+	return bsearch(&key, formats_mods(formats, format), format->len,
+	               sizeof(key), cmp_modifier);
+}
+
 WL_EXPORT bool
 tw_drm_formats_is_modifier_external(struct tw_drm_formats *formats,
                                     uint32_t fmt, uint64_t mod)
 {
+	const struct tw_drm_modifier *modifier =
+		tw_drm_format_find_modifier(formats, fmt, mod);
+
+	return modifier ? modifier->external : false;
+}
+
+WL_EXPORT const struct tw_drm_modifier *
+tw_drm_modifiers_get(const struct tw_drm_formats *formats,
+                     const struct tw_drm_format *fmt)
+{
+	return (fmt->len == 0) ? NULL : formats_mods(formats, fmt);
+}
+
+/* merge two sorted modifier sets into dst, returns the length */
+static int
+merge_mods(struct tw_drm_modifier *dst,
+           const struct tw_drm_modifier *a, int na,
+           const struct tw_drm_modifier *b, int nb, bool intersect)
+{
+	int i = 0, j = 0, n = 0;
+
+	while (i < na && j < nb) {
+		if (a[i].modifier < b[j].modifier) {
+			if (!intersect)
+				dst[n++] = a[i];
+			i++;
+		} else if (a[i].modifier > b[j].modifier) {
+			if (!intersect)
+				dst[n++] = b[j];
+			j++;
+		} else {
+			dst[n].modifier = a[i].modifier;
+			dst[n++].external = a[i].external || b[j].external;
+			i++;
+			j++;
+		}
+	}
+	if (intersect)
+		return n;
+	for (; i < na; i++)
+		dst[n++] = a[i];
+	for (; j < nb; j++)
+		dst[n++] = b[j];
+	return n;
+}
+
+static bool
+formats_merge(struct tw_drm_formats *dst, const struct tw_drm_formats *a,
+              const struct tw_drm_formats *b, bool intersect)
+{
+	const struct tw_drm_format *fa = a->formats.data;
+	const struct tw_drm_format *fb = b->formats.data;
+	size_t na = a->formats.size / sizeof(*fa);
+	size_t nb = b->formats.size / sizeof(*fb);
+	size_t i = 0, j = 0;
 	struct tw_drm_format *format;
-	struct tw_drm_modifier *modifiers;
-	bool external_only = false;
 
-	wl_array_for_each(format, &formats->formats) {
-		if (fmt != format->fmt)
+	assert(dst != a && dst != b);
+	tw_drm_formats_fini(dst);
+	tw_drm_formats_init(dst);
+
+	while (i < na || j < nb) {
+		const struct tw_drm_formats *owner = NULL;
+		const struct tw_drm_format *src = NULL;
+
+		if (j >= nb || (i < na && fa[i].fmt < fb[j].fmt)) {
+			src = &fa[i++];
+			owner = a;
+		} else if (i >= na || fb[j].fmt < fa[i].fmt) {
+			src = &fb[j++];
+			owner = b;
+		}
+		if (src && intersect)
+			continue;
+		if (src) {
+			format = formats_append(dst, src->fmt, src->len);
+			if (!format)
+				return false;
+			memcpy(formats_mods(dst, format),
+			       formats_mods(owner, src),
+			       src->len * sizeof(struct tw_drm_modifier));
 			continue;
-		modifiers = formats->modifiers.data;
-		modifiers = modifiers + format->cursor;
-		for (int i = 0; i < format->len; i++) {
-			if (modifiers[i].modifier == mod)
-				external_only = modifiers[i].external;
 		}
+		//formats in both sets
+		format = formats_append(dst, fa[i].fmt,
+		                        fa[i].len + fb[j].len);
+		if (!format)
+			return false;
+		format->len = merge_mods(formats_mods(dst, format),
+		                         formats_mods(a, &fa[i]), fa[i].len,
+		                         formats_mods(b, &fb[j]), fb[j].len,
+		                         intersect);
+		//give back the unused space
+		dst->modifiers.size = (format->cursor + format->len) *
+			sizeof(struct tw_drm_modifier);
+		//formats without modifiers only match each other
+		if (intersect && !format->len && (fa[i].len || fb[j].len))
+			dst->formats.size -= sizeof(*format);
+		i++;
+		j++;
 	}
-	return external_only;
+	return true;
 }
 
-WL_EXPORT const struct tw_drm_format *
-tw_drm_format_find(const struct tw_drm_formats *formats, uint32_t fmt)
+WL_EXPORT bool
+tw_drm_formats_intersect(struct tw_drm_formats *dst,
+                         const struct tw_drm_formats *a,
+                         const struct tw_drm_formats *b)
+{
+	return formats_merge(dst, a, b, true);
+}
+
+WL_EXPORT bool
+tw_drm_formats_union(struct tw_drm_formats *dst,
+                     const struct tw_drm_formats *a,
+                     const struct tw_drm_formats *b)
+{
+	return formats_merge(dst, a, b, false);
+}
+
+WL_EXPORT bool
+tw_drm_formats_equal(const struct tw_drm_formats *a,
+                     const struct tw_drm_formats *b)
+{
+	const struct tw_drm_format *fa = a->formats.data;
+	const struct tw_drm_format *fb = b->formats.data;
+	size_t n = a->formats.size / sizeof(*fa);
+
+	if (a->formats.size != b->formats.size)
+		return false;
+	for (size_t i = 0; i < n; i++) {
+		const struct tw_drm_modifier *ma = formats_mods(a, &fa[i]);
+		const struct tw_drm_modifier *mb = formats_mods(b, &fb[i]);
+
+		if (fa[i].fmt != fb[i].fmt || fa[i].len != fb[i].len)
+			return false;
+		for (int j = 0; j < fa[i].len; j++)
+			if (ma[j].modifier != mb[j].modifier ||
+			    ma[j].external != mb[j].external)
+				return false;
+	}
+	return true;
+}
+
+/******************************************************************************
+ * serialization
+ *
+ * The file is a header, the key, then {fourcc, len} for every format, all the
+ * modifiers in the format order and one external byte per modifier. It is
+ * only meant as a local cache so native byte order is used.
+ *****************************************************************************/
+
+#define TW_DRM_FORMATS_MAGIC "TWFMTC01"
+#define TW_DRM_FORMATS_MAX_FILE (4 * 1024 * 1024)
+
+struct tw_drm_formats_header {
+	char magic[8];
+	uint32_t key_len;
+	uint32_t n_formats;
+	uint32_t n_modifiers;
+	uint32_t pad;
+};
+
+WL_EXPORT bool
+tw_drm_formats_write(const struct tw_drm_formats *formats, const char *path,
+                     const char *key)
 {
 	const struct tw_drm_format *format;
+	struct tw_drm_formats_header header = {
+		.magic = TW_DRM_FORMATS_MAGIC,
+		.key_len = strlen(key),
+		.n_formats = formats->formats.size / sizeof(*format),
+	};
+	char tmp[PATH_MAX];
+	FILE *file;
+	bool ok;
+	int fd;
 
+	wl_array_for_each(format, &formats->formats)
+		header.n_modifiers += format->len;
+	//written aside then renamed, readers never see a partial file
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return false;
+	if ((fd = mkstemp(tmp)) < 0)
+		return false;
+	if (!(file = fdopen(fd, "wb"))) {
+		close(fd);
+		unlink(tmp);
+		return false;
+	}
+
+	ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(key, 1, header.key_len, file) == header.key_len;
+	wl_array_for_each(format, &formats->formats) {
+		uint32_t entry[2] = { format->fmt, format->len };
+
+		ok = ok && fwrite(entry, sizeof(entry), 1, file) == 1;
+	}
+	wl_array_for_each(format, &formats->formats) {
+		const struct tw_drm_modifier *mods = formats_mods(formats,
+		                                                  format);
+		for (int i = 0; i < format->len && ok; i++)
+			ok = fwrite(&mods[i].modifier, sizeof(uint64_t), 1,
+			            file) == 1;
+	}
 	wl_array_for_each(format, &formats->formats) {
-		if (format->fmt == fmt)
-			return format;
+		const struct tw_drm_modifier *mods = formats_mods(formats,
+		                                                  format);
+		for (int i = 0; i < format->len && ok; i++) {
+			uint8_t external = mods[i].external;
+
+			ok = fwrite(&external, 1, 1, file) == 1;
+		}
 	}
-	return NULL;
+	ok = (fclose(file) == 0) && ok;
+	if (ok && rename(tmp, path) == 0)
+		return true;
+	unlink(tmp);
+	return false;
 }
 
-WL_EXPORT const struct tw_drm_modifier *
-tw_drm_modifiers_get(const struct tw_drm_formats *formats,
-                     const struct tw_drm_format *fmt)
+static void *
+read_whole_file(const char *path, size_t *size)
 {
-	const struct tw_drm_modifier *mods = formats->modifiers.data;
+	FILE *file = fopen(path, "rb");
+	long len;
+	void *data = NULL;
+
+	if (!file)
+		return NULL;
+	if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 ||
+	    len > TW_DRM_FORMATS_MAX_FILE || fseek(file, 0, SEEK_SET) != 0)
+		goto out;
+	if ((data = malloc(len)) && fread(data, 1, len, file) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+	*size = len;
+out:
+	fclose(file);
+	return data;
+}
 
-	mods += fmt->cursor;
-	return (fmt->len == 0) ? NULL : mods;
+/* the file is not trusted, it has to be a valid set */
+static bool
+formats_check_sorted(struct tw_drm_formats *formats)
+{
+	const struct tw_drm_format *format, *prev = NULL;
+
+	wl_array_for_each(format, &formats->formats) {
+		const struct tw_drm_modifier *mods = formats_mods(formats,
+		                                                  format);
+		if (prev && prev->fmt >= format->fmt)
+			return false;
+		for (int i = 1; i < format->len; i++)
+			if (mods[i-1].modifier >= mods[i].modifier)
+				return false;
+		prev = format;
+	}
+	return true;
+}
+
+WL_EXPORT bool
+tw_drm_formats_read(struct tw_drm_formats *formats, const char *path,
+                    const char *key)
+{
+	struct tw_drm_formats_header header;
+	const char *entries;
+	const uint8_t *externals;
+	const char *data;
+	uint64_t modifier;
+	size_t size = 0, expected, off;
+	bool ok = false;
+
+	if (!(data = read_whole_file(path, &size)))
+		return false;
+	if (size < sizeof(header))
+		goto out;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, TW_DRM_FORMATS_MAGIC, sizeof(header.magic)) ||
+	    header.key_len != strlen(key) ||
+	    header.n_formats > TW_DRM_FORMATS_MAX_FILE ||
+	    header.n_modifiers > TW_DRM_FORMATS_MAX_FILE)
+		goto out;
+	expected = sizeof(header) + header.key_len +
+		header.n_formats * 2 * sizeof(uint32_t) +
+		header.n_modifiers * (sizeof(uint64_t) + 1);
+	if (size != expected ||
+	    memcmp(data + sizeof(header), key, header.key_len))
+		goto out;
+
+	//the key has any length, nothing after it is aligned
+	entries = data + sizeof(header) + header.key_len;
+	off = entries + header.n_formats * 2 * sizeof(uint32_t) - data;
+	externals = (const uint8_t *)data + off +
+		header.n_modifiers * sizeof(uint64_t);
+
+	tw_drm_formats_fini(formats);
+	tw_drm_formats_init(formats);
+	for (uint32_t i = 0, n = 0; i < header.n_formats; i++) {
+		uint32_t entry[2], len;
+		struct tw_drm_format *format;
+		struct tw_drm_modifier *mods;
+
+		memcpy(entry, entries + i * sizeof(entry), sizeof(entry));
+		len = entry[1];
+		if (len > header.n_modifiers - n)
+			goto out;
+		if (!(format = formats_append(formats, entry[0], len)))
+			goto out;
+		mods = formats_mods(formats, format);
+		for (uint32_t j = 0; j < len; j++, n++) {
+			memcpy(&modifier, data + off + n * sizeof(uint64_t),
+			       sizeof(modifier));
+			mods[j].modifier = modifier;
+			mods[j].external = externals[n] != 0;
+		}
+	}
+	ok = formats_check_sorted(formats);
+out:
+	if (!ok) {
+		tw_drm_formats_fini(formats);
+		tw_drm_formats_init(formats);
+	}
+	free((void *)data);
+	return ok;
 }
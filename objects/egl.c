@@ -38,9 +38,11 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <wayland-server.h>
 #include <drm_fourcc.h>
 
+#include <taiwins/objects/utils.h>
 #include <taiwins/objects/logger.h>
 #include <taiwins/objects/dmabuf.h>
 #include <taiwins/objects/drm_formats.h>
@@ -371,11 +373,10 @@ get_dmabuf_modifiers(struct tw_egl *egl, int fmt, uint64_t *modifiers,
 }
 
 static void
-init_egl_dma_formats(struct tw_egl *egl)
+probe_egl_dma_formats(struct tw_egl *egl, struct tw_drm_formats *drm_formats)
 {
 	int n_formats = get_dmabuf_formats(egl, NULL);
 
-	tw_drm_formats_init(&egl->drm_formats);
 	if (n_formats <= 0)
 		return;
 
@@ -391,9 +392,9 @@ init_egl_dma_formats(struct tw_egl *egl)
 		if (n_modifiers < 0)
 			continue;
 		if (n_modifiers == 0) {
-			uint64_t invalid_modifier = DRM_FORMAT_INVALID;
+			uint64_t invalid_modifier = DRM_FORMAT_MOD_INVALID;
 			bool no = false;
-			tw_drm_formats_add_format(&egl->drm_formats, fmt,
+			tw_drm_formats_add_format(drm_formats, fmt,
 			                          1, &invalid_modifier, &no);
 			continue;
 		}
@@ -403,18 +404,103 @@ init_egl_dma_formats(struct tw_egl *egl)
 
 		get_dmabuf_modifiers(egl, fmt, modifiers, external_only);
 
-		if (!tw_drm_formats_add_format(&egl->drm_formats, fmt,
+		if (!tw_drm_formats_add_format(drm_formats, fmt,
 		                               n_modifiers, modifiers,
 		                               external_only))
 			continue;
 	}
+}
+
+static char *
+egl_format_cache_key(struct tw_egl *egl)
+{
+	const char *vendor = eglQueryString(egl->display, EGL_VENDOR);
+	const char *version = eglQueryString(egl->display, EGL_VERSION);
+	const char *renderer = (const char *)glGetString(GL_RENDERER);
+	const char *gl_version = (const char *)glGetString(GL_VERSION);
+	char *key = NULL;
+
+	//the GL strings carry the device and the driver version
+	if (asprintf(&key, "%s\n%s\n%s\n%s\n%d", vendor ? vendor : "",
+	             version ? version : "", renderer ? renderer : "",
+	             gl_version ? gl_version : "",
+	             egl->import_dmabuf_modifiers) < 0)
+		return NULL;
+	return key;
+}
+
+static void *
+egl_format_cache_check(void *data)
+{
+	struct tw_egl *egl = data;
+	struct tw_drm_formats probed;
+
+	tw_drm_formats_init(&probed);
+	probe_egl_dma_formats(egl, &probed);
+	if (!tw_drm_formats_equal(&probed, &egl->drm_formats))
+		tw_drm_formats_write(&probed, egl->format_cache.path,
+		                     egl->format_cache.key);
+	tw_drm_formats_fini(&probed);
+	return NULL;
+}
 
+static bool
+load_egl_dma_formats(struct tw_egl *egl, const char *path)
+{
+	egl->format_cache.key = egl_format_cache_key(egl);
+	egl->format_cache.path = egl->format_cache.key ? strdup(path) : NULL;
+	if (!egl->format_cache.path)
+		return false;
+	if (!tw_drm_formats_read(&egl->drm_formats, egl->format_cache.path,
+	                         egl->format_cache.key))
+		return false;
+	egl->format_cache.checking =
+		pthread_create(&egl->format_cache.thread, NULL,
+		               egl_format_cache_check, egl) == 0;
+	return true;
+}
+
+static void
+init_egl_dma_formats(struct tw_egl *egl, const struct tw_egl_options *opts)
+{
+	const struct tw_drm_format *format;
+	size_t n_formats, i = 0;
+
+	tw_drm_formats_init(&egl->drm_formats);
+	if (opts->format_cache &&
+	    load_egl_dma_formats(egl, opts->format_cache)) {
+		tw_logl("EGL: dmabuf formats loaded from %s",
+		        opts->format_cache);
+	} else {
+		probe_egl_dma_formats(egl, &egl->drm_formats);
+		if (egl->format_cache.path)
+			tw_drm_formats_write(&egl->drm_formats,
+			                     egl->format_cache.path,
+			                     egl->format_cache.key);
+	}
+
+	n_formats = tw_drm_formats_count(&egl->drm_formats);
 	char str_formats[n_formats * 5 + 1];
-	for (int i = 0; i < n_formats; i++)
-		snprintf(&str_formats[i*5], 6, "%.4s ", (char *)&formats[i]);
+	str_formats[0] = '\0';
+	wl_array_for_each(format, &egl->drm_formats.formats)
+		snprintf(&str_formats[5*i++], 6, "%.4s ",
+		         (const char *)&format->fmt);
 	tw_logl("EGL Supported dmabuf formats: %s", str_formats);
 }
 
+static void
+fini_egl_dma_formats(struct tw_egl *egl)
+{
+	if (egl->format_cache.checking)
+		pthread_join(egl->format_cache.thread, NULL);
+	free(egl->format_cache.path);
+	free(egl->format_cache.key);
+	egl->format_cache.path = NULL;
+	egl->format_cache.key = NULL;
+	egl->format_cache.checking = false;
+	tw_drm_formats_fini(&egl->drm_formats);
+}
+
 static void
 print_egl_info(struct tw_egl *egl)
 {
@@ -441,6 +527,10 @@ print_egl_info(struct tw_egl *egl)
 WL_EXPORT bool
 tw_egl_init(struct tw_egl *egl, const struct tw_egl_options *opts)
 {
+	wl_list_init(&egl->dmabuf_images);
+	egl->format_cache.path = NULL;
+	egl->format_cache.key = NULL;
+	egl->format_cache.checking = false;
 	if (!setup_egl_basic_exts(egl))
 		return false;
 	if (!setup_egl_display(egl, opts))
@@ -454,7 +544,7 @@ tw_egl_init(struct tw_egl *egl, const struct tw_egl_options *opts)
 	//TODO setup dmabuf formats
 	if (!setup_egl_context(egl))
 		goto error;
-	init_egl_dma_formats(egl);
+	init_egl_dma_formats(egl, opts);
 	print_egl_info(egl);
 	return true;
 error:
@@ -471,10 +561,15 @@ error:
 WL_EXPORT void
 tw_egl_fini(struct tw_egl *egl)
 {
+	struct tw_dmabuf_buffer *buffer, *tmp;
+
 	if (!egl)
 		return;
 
-	tw_drm_formats_fini(&egl->drm_formats);
+	wl_list_for_each_safe(buffer, tmp, &egl->dmabuf_images,
+	                      image_cache.link)
+		buffer->image_cache.release(buffer);
+	fini_egl_dma_formats(egl);
 	eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
 	               EGL_NO_CONTEXT);
 	if (egl->wl_display) {
@@ -723,6 +818,46 @@ tw_egl_import_dmabuf_image(struct tw_egl *egl,
         return image;
 }
 
+static void
+egl_dma_release_image(struct tw_dmabuf_buffer *buffer)
+{
+	struct tw_egl *egl = buffer->image_cache.importer;
+
+	_destroy_egl_image(egl->display, buffer->image_cache.image);
+	tw_reset_wl_list(&buffer->image_cache.link);
+	buffer->image_cache.image = NULL;
+	buffer->image_cache.importer = NULL;
+	buffer->image_cache.release = NULL;
+}
+
+WL_EXPORT EGLImageKHR
+tw_egl_import_dmabuf_buffer(struct tw_egl *egl,
+                            struct tw_dmabuf_buffer *buffer, bool *external)
+{
+	EGLImageKHR image;
+
+	if (buffer->image_cache.image &&
+	    buffer->image_cache.importer != egl &&
+	    buffer->image_cache.release)
+		buffer->image_cache.release(buffer);
+	if (buffer->image_cache.image) {
+		if (external)
+			*external = buffer->image_cache.external;
+		return buffer->image_cache.image;
+	}
+
+	image = tw_egl_import_dmabuf_image(egl, &buffer->attributes,
+	                                   &buffer->image_cache.external);
+	if (image == EGL_NO_IMAGE || !_destroy_egl_image)
+		return image;
+	buffer->image_cache.image = image;
+	buffer->image_cache.importer = egl;
+	buffer->image_cache.release = egl_dma_release_image;
+	wl_list_insert(&egl->dmabuf_images, &buffer->image_cache.link);
+	if (external)
+		*external = buffer->image_cache.external;
+	return image;
+}
 
 WL_EXPORT bool
 tw_egl_image_export_dmabuf(struct tw_egl *egl, EGLImage image,
@@ -777,50 +912,27 @@ egl_dma_modifiers_request(struct tw_linux_dmabuf *dmabuf,
                           size_t *n_modifiers)
 {
 	struct tw_egl *egl = callback;
-	struct tw_drm_format *format, *target = NULL;
+	const struct tw_drm_format *format =
+		tw_drm_format_find(&egl->drm_formats, fmt);
+	const struct tw_drm_modifier *mods;
 
-	wl_array_for_each(format, &egl->drm_formats.formats) {
-		if ((int)format->fmt == fmt) {
-			target = format;
-			break;
-		}
-	}
-	if (!target)
-		goto no_modifiers;
-	*n_modifiers = format->len;
-
-	if (modifiers && *n_modifiers) {
-		struct tw_drm_modifier *modifier =
-			egl->drm_formats.modifiers.data;
-		modifier += format->cursor;
-
-		for (int i = 0; i < format->len; i++)
-			modifiers[i] = (modifier + i)->modifier;
-	}
-	return;
-no_modifiers:
-	*n_modifiers = 0;
-	return;
+	*n_modifiers = format ? format->len : 0;
+	if (!format || !modifiers || !*n_modifiers)
+		return;
+	mods = tw_drm_modifiers_get(&egl->drm_formats, format);
+	for (int i = 0; i < format->len; i++)
+		modifiers[i] = mods[i].modifier;
 }
 
 static bool
-egl_dma_test_import_buffer(struct tw_dmabuf_attributes *attrs, void *callback)
+egl_dma_test_import_buffer(struct tw_dmabuf_buffer *buffer, void *callback)
 {
 	struct tw_egl *egl = callback;
-	bool external;
-	EGLImage image = EGL_NO_IMAGE;
 
 	if (!egl->image_base_khr || !egl->import_dmabuf || !_destroy_egl_image)
 		return false;
-
-	image = tw_egl_import_dmabuf_image(egl, attrs, &external);
-
-	if (image != EGL_NO_IMAGE) {
-		_destroy_egl_image(egl->display, image);
-		return true;
-	} else {
-		return false;
-	}
+	//the test image is kept for the renderer
+	return tw_egl_import_dmabuf_buffer(egl, buffer, NULL) != EGL_NO_IMAGE;
 }
 
 static const struct tw_linux_dmabuf_impl dmabuf_impl = {
@@ -829,11 +941,46 @@ static const struct tw_linux_dmabuf_impl dmabuf_impl = {
 	.test_import = egl_dma_test_import_buffer,
 };
 
+static bool
+egl_query_drm_device(struct tw_egl *egl, dev_t *dev)
+{
+	EGLAttrib attrib;
+	EGLDeviceEXT device;
+	const char *exts, *path;
+	struct stat st;
+	PFNEGLQUERYDISPLAYATTRIBEXTPROC query_display_attrib;
+	PFNEGLQUERYDEVICESTRINGEXTPROC query_device_string;
+
+	exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (!exts || !check_egl_ext(exts, "EGL_EXT_device_query", false))
+		return false;
+	if (!get_egl_proc(&query_display_attrib, "eglQueryDisplayAttribEXT") ||
+	    !get_egl_proc(&query_device_string, "eglQueryDeviceStringEXT"))
+		return false;
+	if (query_display_attrib(egl->display, EGL_DEVICE_EXT,
+	                         &attrib) != EGL_TRUE)
+		return false;
+	device = (EGLDeviceEXT)attrib;
+	exts = query_device_string(device, EGL_EXTENSIONS);
+	if (!exts || !check_egl_ext(exts, "EGL_EXT_device_drm", false))
+		return false;
+	path = query_device_string(device, EGL_DRM_DEVICE_FILE_EXT);
+	if (!path || stat(path, &st) != 0)
+		return false;
+	*dev = st.st_rdev;
+	return true;
+}
+
 WL_EXPORT void
 tw_egl_impl_linux_dmabuf(struct tw_egl *egl, struct tw_linux_dmabuf *dma)
 {
+	dev_t dev;
+
 	dma->impl = &dmabuf_impl;
 	dma->impl_userdata = egl;
+	//backends knowing the device better can override it later
+	if (egl_query_drm_device(egl, &dev))
+		tw_linux_dmabuf_set_main_device(dma, dev);
 }
 
 
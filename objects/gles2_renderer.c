@@ -0,0 +1,1122 @@
+/*
+ * gles2_renderer.c - taiwins reference GLES2 renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include <taiwins/objects/logger.h>
+#include <taiwins/objects/utils.h>
+#include <taiwins/objects/matrix.h>
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/layers.h>
+#include <taiwins/objects/desktop.h>
+#include <taiwins/objects/dmabuf.h>
+#include <taiwins/objects/egl.h>
+#include <taiwins/objects/gles2_renderer.h>
+
+#define MAX(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a > _b ? _a : _b; })
+
+#define MIN(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a < _b ? _a : _b; })
+
+static const GLchar vs_source[] =
+	"uniform mat3 proj;\n"
+	"uniform mat3 texproj;\n"
+	"attribute vec2 pos;\n"
+	"varying vec2 v_texcoord;\n"
+	"void main() {\n"
+	"	gl_Position = vec4((proj * vec3(pos, 1.0)).xy, 0.0, 1.0);\n"
+	"	v_texcoord = (texproj * vec3(pos, 1.0)).xy;\n"
+	"}\n";
+
+static const GLchar fs_rgba_source[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture2D(tex, v_texcoord);\n"
+	"}\n";
+
+static const GLchar fs_rgbx_source[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"void main() {\n"
+	"	gl_FragColor = vec4(texture2D(tex, v_texcoord).rgb, 1.0);\n"
+	"}\n";
+
+static const GLchar fs_ext_source[] =
+	"#extension GL_OES_EGL_image_external : require\n"
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform samplerExternalOES tex;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture2D(tex, v_texcoord);\n"
+	"}\n";
+
+/* the unit square every surface is mapped from by its geometry transform */
+static const GLfloat unit_square[] = {
+	-1.0f, -1.0f,
+	 1.0f, -1.0f,
+	-1.0f,  1.0f,
+	 1.0f,  1.0f,
+};
+
+static const EGLint config_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_RED_SIZE, 8,
+	EGL_GREEN_SIZE, 8,
+	EGL_BLUE_SIZE, 8,
+	EGL_ALPHA_SIZE, 8,
+	EGL_NONE,
+};
+
+/******************************************************************************
+ * shaders
+ *****************************************************************************/
+
+static GLuint
+compile_shader(GLenum type, const GLchar *source)
+{
+	GLint ok;
+	GLuint shader = glCreateShader(type);
+
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (ok == GL_FALSE) {
+		GLchar log[512];
+
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		tw_logl_level(TW_LOG_ERRO, "failed to compile shader: %s",
+		              log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+static bool
+shader_init(struct tw_gles2_shader *shader, const GLchar *fs_source)
+{
+	GLint ok;
+	GLuint vs, fs;
+
+	if (!(vs = compile_shader(GL_VERTEX_SHADER, vs_source)))
+		return false;
+	if (!(fs = compile_shader(GL_FRAGMENT_SHADER, fs_source))) {
+		glDeleteShader(vs);
+		return false;
+	}
+	shader->prog = glCreateProgram();
+	glAttachShader(shader->prog, vs);
+	glAttachShader(shader->prog, fs);
+	glLinkProgram(shader->prog);
+	glDetachShader(shader->prog, vs);
+	glDetachShader(shader->prog, fs);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	glGetProgramiv(shader->prog, GL_LINK_STATUS, &ok);
+	if (ok == GL_FALSE) {
+		tw_logl_level(TW_LOG_ERRO, "failed to link shader program");
+		glDeleteProgram(shader->prog);
+		shader->prog = 0;
+		return false;
+	}
+	shader->proj = glGetUniformLocation(shader->prog, "proj");
+	shader->texproj = glGetUniformLocation(shader->prog, "texproj");
+	shader->tex = glGetUniformLocation(shader->prog, "tex");
+	shader->pos = glGetAttribLocation(shader->prog, "pos");
+	return true;
+}
+
+static void
+shader_fini(struct tw_gles2_shader *shader)
+{
+	if (shader->prog)
+		glDeleteProgram(shader->prog);
+	shader->prog = 0;
+}
+
+/******************************************************************************
+ * textures
+ *
+ * Every surface caches the textures of the last few wl_buffers it attached,
+ * so a client cycling through its swapchain hits the cache: dmabuf and
+ * wl_drm buffers need no import, shm buffers only upload what changed since
+ * their texture was last updated.
+ *****************************************************************************/
+
+static void
+texture_entry_reset(struct tw_gles2_texture_entry *entry)
+{
+	if (entry->buffer)
+		tw_reset_wl_list(&entry->buffer_destroy.link);
+	if (entry->id) {
+		glDeleteTextures(1, &entry->id);
+		pixman_region32_fini(&entry->stale);
+	}
+	entry->buffer = NULL;
+	entry->id = 0;
+}
+
+/* shm uploads are the only textures allocated by us, the storage of images
+ * belongs to the client */
+static inline bool
+texture_entry_owned(struct tw_gles2_texture_entry *entry)
+{
+	return entry->id && entry->format;
+}
+
+/* keeps the memory used by the renderer in sync */
+static void
+texture_update_size(struct tw_gles2_texture *texture)
+{
+	struct tw_gles2_texture_entry *entry;
+	size_t size = 0;
+
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++) {
+		entry = &texture->entries[i];
+		if (texture_entry_owned(entry))
+			size += (size_t)entry->width * entry->height * 4;
+	}
+	texture->renderer->textures.used -= texture->size;
+	texture->renderer->textures.used += size;
+	texture->size = size;
+}
+
+static void
+texture_touch(struct tw_gles2_texture *texture)
+{
+	wl_list_remove(&texture->lru_link);
+	wl_list_insert(&texture->renderer->textures.lru, &texture->lru_link);
+}
+
+static void
+texture_drop_snapshot(struct tw_gles2_texture *texture)
+{
+	if (texture->snapshot.id)
+		glDeleteTextures(1, &texture->snapshot.id);
+	texture->snapshot.id = 0;
+}
+
+static void
+texture_destroy(struct tw_gles2_texture *texture)
+{
+	struct tw_egl *egl = &texture->renderer->egl;
+
+	tw_egl_make_current(egl, EGL_NO_SURFACE);
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++)
+		texture_entry_reset(&texture->entries[i]);
+	texture_drop_snapshot(texture);
+	texture_update_size(texture);
+	tw_reset_wl_list(&texture->lru_link);
+	tw_reset_wl_list(&texture->surface_destroy.link);
+	texture->surface->buffer.handle.ptr = NULL;
+	free(texture);
+}
+
+static void
+notify_texture_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct tw_gles2_texture *texture =
+		wl_container_of(listener, texture, surface_destroy);
+	texture_destroy(texture);
+}
+
+static void
+notify_texture_entry_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct tw_gles2_texture_entry *entry =
+		wl_container_of(listener, entry, buffer_destroy);
+	struct tw_gles2_texture *texture = entry->texture;
+
+	//still on screen, keep the texture until the next attach
+	if (entry == texture->current) {
+		tw_reset_wl_list(&entry->buffer_destroy.link);
+		entry->buffer = NULL;
+		return;
+	}
+	tw_egl_make_current(&texture->renderer->egl, EGL_NO_SURFACE);
+	texture_entry_reset(entry);
+	texture_update_size(texture);
+}
+
+static struct tw_gles2_texture *
+texture_ensure(struct tw_gles2_renderer *renderer, struct tw_surface *surface)
+{
+	struct tw_gles2_texture *texture = surface->buffer.handle.ptr;
+
+	if (texture)
+		return texture;
+	if (!(texture = calloc(1, sizeof(*texture))))
+		return NULL;
+	texture->renderer = renderer;
+	texture->surface = surface;
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++)
+		texture->entries[i].texture = texture;
+	wl_list_insert(&renderer->textures.lru, &texture->lru_link);
+	tw_signal_setup_listener(&surface->signals.destroy,
+	                         &texture->surface_destroy,
+	                         notify_texture_surface_destroy);
+	surface->buffer.handle.ptr = texture;
+	return texture;
+}
+
+/* the entry of wl_buffer, an empty or the least recently used one is taken
+ * if it is not cached */
+static struct tw_gles2_texture_entry *
+texture_get_entry(struct tw_gles2_texture *texture,
+                  struct wl_resource *wl_buffer, bool *hit)
+{
+	struct tw_gles2_texture_entry *entry, *victim = NULL;
+
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++) {
+		entry = &texture->entries[i];
+		if (entry->id && entry->buffer == wl_buffer) {
+			*hit = true;
+			return entry;
+		}
+		if (entry == texture->current)
+			continue;
+		if (!victim || !entry->id ||
+		    (victim->id && entry->last_use < victim->last_use))
+			victim = entry;
+	}
+	*hit = false;
+	texture_entry_reset(victim);
+	victim->buffer = wl_buffer;
+	tw_set_resource_destroy_listener(wl_buffer, &victim->buffer_destroy,
+	                                 notify_texture_entry_buffer_destroy);
+	return victim;
+}
+
+/* (re)create the GL texture object when the target changes */
+static void
+texture_entry_init(struct tw_gles2_texture_entry *entry, GLenum target)
+{
+	if (entry->id && entry->target == target)
+		return;
+	if (entry->id)
+		glDeleteTextures(1, &entry->id);
+	else
+		pixman_region32_init(&entry->stale);
+	glGenTextures(1, &entry->id);
+	entry->target = target;
+	entry->format = 0;
+	entry->width = 0;
+	entry->height = 0;
+	glBindTexture(target, entry->id);
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+/* make entry the one on screen, the other textures miss the damage and the
+ * ones of a different size are stale after a resize */
+static void
+texture_use_entry(struct tw_gles2_texture *texture,
+                  struct tw_gles2_texture_entry *entry,
+                  pixman_region32_t *damage)
+{
+	struct tw_gles2_texture_entry *other;
+
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++) {
+		other = &texture->entries[i];
+		if (other == entry || !other->id)
+			continue;
+		if (!other->buffer || other->width != entry->width ||
+		    other->height != entry->height)
+			texture_entry_reset(other);
+		else if (damage)
+			pixman_region32_union(&other->stale, &other->stale,
+			                      damage);
+		else
+			pixman_region32_union_rect(&other->stale,
+			                           &other->stale, 0, 0,
+			                           other->width,
+			                           other->height);
+	}
+	entry->last_use = ++texture->uses;
+	texture->current = entry;
+}
+
+static bool
+shm_format_to_gl(struct tw_gles2_renderer *renderer, uint32_t format,
+                 GLint *gl_format, bool *has_alpha)
+{
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+		*has_alpha = true;
+		*gl_format = GL_BGRA_EXT;
+		return renderer->has_bgra;
+	case WL_SHM_FORMAT_XRGB8888:
+		*has_alpha = false;
+		*gl_format = GL_BGRA_EXT;
+		return renderer->has_bgra;
+	case WL_SHM_FORMAT_ABGR8888:
+		*has_alpha = true;
+		*gl_format = GL_RGBA;
+		return true;
+	case WL_SHM_FORMAT_XBGR8888:
+		*has_alpha = false;
+		*gl_format = GL_RGBA;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+upload_shm_rect(struct tw_gles2_renderer *renderer,
+                struct tw_gles2_texture_entry *entry, const uint8_t *data,
+                int stride, const pixman_box32_t *box)
+{
+	int x = MAX(box->x1, 0), y = MAX(box->y1, 0);
+	int w = MIN(box->x2, entry->width) - x;
+	int h = MIN(box->y2, entry->height) - y;
+
+	if (w <= 0 || h <= 0)
+		return;
+	if (renderer->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, stride / 4);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, entry->format,
+		                GL_UNSIGNED_BYTE, data);
+		return;
+	}
+	//without unpack subimage, going row by row
+	for (int i = y; i < y + h; i++)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, i, w, 1, entry->format,
+		                GL_UNSIGNED_BYTE, data + i * stride + x * 4);
+}
+
+static bool
+import_shm(struct tw_gles2_renderer *renderer,
+           struct tw_event_buffer_uploading *event,
+           struct wl_shm_buffer *shm)
+{
+	struct tw_surface_buffer *buffer = event->buffer;
+	struct tw_surface *surface = wl_container_of(buffer, surface, buffer);
+	struct tw_gles2_texture *texture;
+	struct tw_gles2_texture_entry *entry;
+	int width = wl_shm_buffer_get_width(shm);
+	int height = wl_shm_buffer_get_height(shm);
+	int stride = wl_shm_buffer_get_stride(shm);
+	uint32_t format = wl_shm_buffer_get_format(shm);
+	GLint gl_format;
+	bool has_alpha, full, hit;
+	const uint8_t *data;
+
+	if (!shm_format_to_gl(renderer, format, &gl_format, &has_alpha))
+		return false;
+	if (!(texture = texture_ensure(renderer, surface)))
+		return false;
+	entry = texture_get_entry(texture, event->wl_buffer, &hit);
+	texture_entry_init(entry, GL_TEXTURE_2D);
+	//a different layout needs a new storage
+	full = !hit || event->new_upload || !event->damages ||
+		entry->format != gl_format || entry->width != width ||
+		entry->height != height;
+
+	entry->format = gl_format;
+	entry->has_alpha = has_alpha;
+	entry->y_flip = false;
+	entry->width = width;
+	entry->height = height;
+	glBindTexture(GL_TEXTURE_2D, entry->id);
+
+	wl_shm_buffer_begin_access(shm);
+	data = wl_shm_buffer_get_data(shm);
+	if (full) {
+		pixman_box32_t box = {0, 0, width, height};
+
+		glTexImage2D(GL_TEXTURE_2D, 0, gl_format, width, height, 0,
+		             gl_format, GL_UNSIGNED_BYTE, NULL);
+		upload_shm_rect(renderer, entry, data, stride, &box);
+	} else {
+		int n;
+		pixman_box32_t *boxes;
+
+		//the buffer also needs what was drawn through the others
+		pixman_region32_union(&entry->stale, &entry->stale,
+		                      event->damages);
+		boxes = pixman_region32_rectangles(&entry->stale, &n);
+		for (int i = 0; i < n; i++)
+			upload_shm_rect(renderer, entry, data, stride,
+			                &boxes[i]);
+	}
+	pixman_region32_clear(&entry->stale);
+	wl_shm_buffer_end_access(shm);
+	if (renderer->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	texture_use_entry(texture, entry, event->new_upload ?
+	                  NULL : event->damages);
+	texture_update_size(texture);
+	texture_drop_snapshot(texture);
+	texture_touch(texture);
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->stride = stride;
+	buffer->format = format;
+	return true;
+}
+
+static bool
+import_image(struct tw_gles2_renderer *renderer,
+             struct tw_event_buffer_uploading *event,
+             struct tw_gles2_texture_entry *entry, EGLImageKHR image,
+             bool external, bool has_alpha, bool y_flip,
+             int width, int height)
+{
+	GLenum target = external ? GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+
+	if (!renderer->image_target_texture ||
+	    (external && !renderer->has_external))
+		return false;
+	texture_entry_init(entry, target);
+	entry->format = 0;
+	entry->has_alpha = has_alpha;
+	entry->y_flip = y_flip;
+	entry->width = width;
+	entry->height = height;
+
+	glBindTexture(target, entry->id);
+	renderer->image_target_texture(target, image);
+	glBindTexture(target, 0);
+	return true;
+}
+
+static bool
+import_dmabuf(struct tw_gles2_renderer *renderer,
+              struct tw_event_buffer_uploading *event,
+              struct tw_gles2_texture_entry *entry)
+{
+	struct tw_dmabuf_buffer *dmabuf =
+		tw_dmabuf_buffer_from_resource(event->wl_buffer);
+	struct tw_dmabuf_attributes *attrs = &dmabuf->attributes;
+	bool external = false;
+	//the image is owned by the dmabuf buffer
+	EGLImageKHR image = tw_egl_import_dmabuf_buffer(&renderer->egl,
+	                                                dmabuf, &external);
+
+	if (image == EGL_NO_IMAGE_KHR)
+		return false;
+	return import_image(renderer, event, entry, image, external, true,
+	                    attrs->flags & TW_DMABUF_ATTRIBUTES_FLAGS_Y_INVERT,
+	                    attrs->width, attrs->height);
+}
+
+static bool
+import_wl_drm(struct tw_gles2_renderer *renderer,
+              struct tw_event_buffer_uploading *event,
+              struct tw_gles2_texture_entry *entry)
+{
+	EGLint fmt;
+	int width, height;
+	bool y_inverted, ret;
+	EGLImageKHR image =
+		tw_egl_import_wl_drm_image(&renderer->egl, event->wl_buffer,
+		                           &fmt, &width, &height, &y_inverted);
+
+	if (image == EGL_NO_IMAGE_KHR)
+		return false;
+	ret = import_image(renderer, event, entry, image,
+	                   fmt == EGL_TEXTURE_EXTERNAL_WL,
+	                   fmt != EGL_TEXTURE_RGB, !y_inverted,
+	                   width, height);
+	//texture keeps the content alive
+	tw_egl_destroy_image(&renderer->egl, image);
+	return ret;
+}
+
+/* the texture follows the content of the image, a cached entry needs no
+ * import at all */
+static bool
+import_gpu_buffer(struct tw_gles2_renderer *renderer,
+                  struct tw_event_buffer_uploading *event)
+{
+	struct tw_surface_buffer *buffer = event->buffer;
+	struct tw_surface *surface = wl_container_of(buffer, surface, buffer);
+	struct tw_gles2_texture *texture;
+	struct tw_gles2_texture_entry *entry;
+	bool hit, ret;
+
+	if (!(texture = texture_ensure(renderer, surface)))
+		return false;
+	entry = texture_get_entry(texture, event->wl_buffer, &hit);
+	if (hit)
+		ret = true;
+	else if (tw_is_wl_buffer_dmabuf(event->wl_buffer))
+		ret = import_dmabuf(renderer, event, entry);
+	else
+		ret = import_wl_drm(renderer, event, entry);
+	if (!ret) {
+		texture_entry_reset(entry);
+		texture_update_size(texture);
+		return false;
+	}
+	texture_use_entry(texture, entry, NULL);
+	texture_update_size(texture);
+	texture_drop_snapshot(texture);
+	texture_touch(texture);
+
+	buffer->width = entry->width;
+	buffer->height = entry->height;
+	buffer->stride = 0;
+	return true;
+}
+
+static bool
+gles2_buffer_import(struct tw_event_buffer_uploading *event, void *callback)
+{
+	struct tw_gles2_renderer *renderer = callback;
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+
+	if (!tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE))
+		return false;
+	if (shm)
+		return import_shm(renderer, event, shm);
+	else
+		return import_gpu_buffer(renderer, event);
+}
+
+/* a surface with our import hook, which is cleared if we go first */
+struct gles2_surface {
+	struct tw_gles2_renderer *renderer;
+	struct tw_surface *surface;
+	struct wl_list link;
+	struct wl_listener surface_destroy;
+};
+
+static void
+gles2_surface_destroy(struct gles2_surface *gles2_surface)
+{
+	struct tw_surface *surface = gles2_surface->surface;
+
+	if (surface->buffer.buffer_import.callback == gles2_surface->renderer) {
+		surface->buffer.buffer_import.buffer_import = NULL;
+		surface->buffer.buffer_import.callback = NULL;
+	}
+	wl_list_remove(&gles2_surface->link);
+	tw_reset_wl_list(&gles2_surface->surface_destroy.link);
+	free(gles2_surface);
+}
+
+static void
+notify_gles2_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct gles2_surface *gles2_surface =
+		wl_container_of(listener, gles2_surface, surface_destroy);
+	gles2_surface_destroy(gles2_surface);
+}
+
+WL_EXPORT void
+tw_gles2_renderer_init_surface(struct tw_gles2_renderer *renderer,
+                               struct tw_surface *surface)
+{
+	struct gles2_surface *gles2_surface = calloc(1, sizeof(*gles2_surface));
+
+	//without tracking we could not clear the hook at fini
+	if (!gles2_surface) {
+		tw_logl_level(TW_LOG_ERRO, "failed to track the surface");
+		return;
+	}
+	gles2_surface->renderer = renderer;
+	gles2_surface->surface = surface;
+	wl_list_insert(&renderer->surfaces, &gles2_surface->link);
+	tw_signal_setup_listener(&surface->signals.destroy,
+	                         &gles2_surface->surface_destroy,
+	                         notify_gles2_surface_destroy);
+	surface->buffer.buffer_import.buffer_import = gles2_buffer_import;
+	surface->buffer.buffer_import.callback = renderer;
+}
+
+/******************************************************************************
+ * drawing
+ *****************************************************************************/
+
+static struct tw_gles2_shader *
+texture_shader(struct tw_gles2_renderer *renderer,
+               struct tw_gles2_texture_entry *texture)
+{
+	if (texture->target == GL_TEXTURE_EXTERNAL_OES)
+		return &renderer->shaders.ext;
+	return texture->has_alpha ?
+		&renderer->shaders.rgba : &renderer->shaders.rgbx;
+}
+
+/* scissor in target coordinates, the projection keeps the image rows in GL
+ * order so no flipping is needed */
+static void
+scissor_box(struct tw_gles2_render_target *target, const pixman_box32_t *box)
+{
+	glScissor(box->x1 - target->x, box->y1 - target->y,
+	          box->x2 - box->x1, box->y2 - box->y1);
+}
+
+static void
+draw_surface(struct tw_gles2_renderer *renderer,
+             struct tw_gles2_render_target *target,
+             struct tw_surface *surface, pixman_region32_t *damage,
+             const struct tw_mat3 *proj)
+{
+	struct tw_gles2_texture *cache = surface->buffer.handle.ptr;
+	struct tw_gles2_texture_entry *texture = NULL;
+	struct tw_gles2_shader *shader;
+	struct tw_mat3 mvp, texproj, tmp;
+	pixman_region32_t clip;
+	pixman_box32_t *boxes;
+	int n;
+
+	//evicted textures draw the snapshot until the next commit
+	if (cache)
+		texture = cache->current ? cache->current : &cache->snapshot;
+	if (!texture || !texture->id || !surface->buffer.width ||
+	    !surface->buffer.height)
+		return;
+	texture_touch(cache);
+	pixman_region32_init_rect(&clip, surface->geometry.xywh.x,
+	                          surface->geometry.xywh.y,
+	                          surface->geometry.xywh.width,
+	                          surface->geometry.xywh.height);
+	pixman_region32_intersect(&clip, &clip, damage);
+	if (!pixman_region32_not_empty(&clip))
+		goto out;
+
+	//unit square -> global -> target clip space
+	tw_mat3_multiply(&mvp, proj, &surface->geometry.transform);
+	//unit square -> surface local -> buffer -> normalized texcoords
+	tw_mat3_translate(&tmp, -surface->geometry.x, -surface->geometry.y);
+	tw_mat3_multiply(&texproj, &tmp, &surface->geometry.transform);
+	tw_mat3_multiply(&texproj, &surface->current->surface_to_buffer,
+	                 &texproj);
+	tw_mat3_scale(&tmp, 1.0f / surface->buffer.width,
+	              1.0f / surface->buffer.height);
+	tw_mat3_multiply(&texproj, &tmp, &texproj);
+	if (texture->y_flip) {
+		tw_mat3_scale(&tmp, 1.0f, -1.0f);
+		tmp.d[7] = 1.0f;
+		tw_mat3_multiply(&texproj, &tmp, &texproj);
+	}
+
+	shader = texture_shader(renderer, texture);
+	glUseProgram(shader->prog);
+	glUniformMatrix3fv(shader->proj, 1, GL_FALSE, mvp.d);
+	glUniformMatrix3fv(shader->texproj, 1, GL_FALSE, texproj.d);
+	glUniform1i(shader->tex, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(texture->target, texture->id);
+	glVertexAttribPointer(shader->pos, 2, GL_FLOAT, GL_FALSE, 0,
+	                      unit_square);
+	glEnableVertexAttribArray(shader->pos);
+
+	boxes = pixman_region32_rectangles(&clip, &n);
+	for (int i = 0; i < n; i++) {
+		scissor_box(target, &boxes[i]);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	glDisableVertexAttribArray(shader->pos);
+	glBindTexture(texture->target, 0);
+out:
+	pixman_region32_fini(&clip);
+}
+
+/* painting from bottom to top, subsurfaces are above their parent */
+static void
+draw_surface_tree(struct tw_gles2_renderer *renderer,
+                  struct tw_gles2_render_target *target,
+                  struct tw_surface *surface, pixman_region32_t *damage,
+                  const struct tw_mat3 *proj)
+{
+	struct tw_subsurface *sub;
+
+	draw_surface(renderer, target, surface, damage, proj);
+	wl_list_for_each(sub, &surface->subsurfaces, parent_link)
+		draw_surface_tree(renderer, target, sub->surface, damage,
+		                  proj);
+}
+
+/******************************************************************************
+ * eviction
+ *****************************************************************************/
+
+/* draw the texture on screen into a small one, in the same row order */
+static void
+texture_snapshot(struct tw_gles2_renderer *renderer,
+                 struct tw_gles2_texture *texture)
+{
+	struct tw_gles2_texture_entry *src = texture->current;
+	struct tw_gles2_texture_entry *dst = &texture->snapshot;
+	struct tw_gles2_shader *shader = texture_shader(renderer, src);
+	struct tw_mat3 mvp, texproj, tmp;
+	float scale = MIN(1.0f, (float)TW_GLES2_SNAPSHOT_SIZE /
+	                  MAX(src->width, src->height));
+	GLuint fbo;
+
+	texture_drop_snapshot(texture);
+	dst->target = GL_TEXTURE_2D;
+	dst->width = MAX(1, (int)(src->width * scale));
+	dst->height = MAX(1, (int)(src->height * scale));
+	dst->has_alpha = src->has_alpha;
+	dst->y_flip = false;
+	glGenTextures(1, &dst->id);
+	glBindTexture(GL_TEXTURE_2D, dst->id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dst->width, dst->height, 0,
+	             GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	                       GL_TEXTURE_2D, dst->id, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		texture_drop_snapshot(texture);
+		goto out;
+	}
+	glViewport(0, 0, dst->width, dst->height);
+	//unit square is the clip space, and maps to the whole texture
+	tw_mat3_init(&mvp);
+	tw_mat3_scale(&texproj, 0.5f, 0.5f);
+	texproj.d[6] = 0.5f;
+	texproj.d[7] = 0.5f;
+	if (src->y_flip) {
+		tw_mat3_scale(&tmp, 1.0f, -1.0f);
+		tmp.d[7] = 1.0f;
+		tw_mat3_multiply(&texproj, &tmp, &texproj);
+	}
+	glUseProgram(shader->prog);
+	glUniformMatrix3fv(shader->proj, 1, GL_FALSE, mvp.d);
+	glUniformMatrix3fv(shader->texproj, 1, GL_FALSE, texproj.d);
+	glUniform1i(shader->tex, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(src->target, src->id);
+	glVertexAttribPointer(shader->pos, 2, GL_FLOAT, GL_FALSE, 0,
+	                      unit_square);
+	glEnableVertexAttribArray(shader->pos);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDisableVertexAttribArray(shader->pos);
+	glBindTexture(src->target, 0);
+out:
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+}
+
+/* only drops the shm uploads, evicting an image frees nothing */
+static void
+texture_evict(struct tw_gles2_renderer *renderer,
+              struct tw_gles2_texture *texture)
+{
+	struct tw_gles2_texture_entry *entry;
+
+	if (texture->current && texture_entry_owned(texture->current)) {
+		texture_snapshot(renderer, texture);
+		texture->current = NULL;
+	}
+	for (int i = 0; i < TW_GLES2_TEXTURE_CACHE_SIZE; i++) {
+		entry = &texture->entries[i];
+		if (texture_entry_owned(entry))
+			texture_entry_reset(entry);
+	}
+	texture_update_size(texture);
+}
+
+static void
+mark_visible_tree(struct tw_surface *surface, uint32_t pass)
+{
+	struct tw_gles2_texture *texture = surface->buffer.handle.ptr;
+	struct tw_subsurface *sub;
+
+	if (!surface->is_mapped)
+		return;
+	if (texture)
+		texture->visible_pass = pass;
+	wl_list_for_each(sub, &surface->subsurfaces, parent_link)
+		mark_visible_tree(sub->surface, pass);
+}
+
+static void
+evict_textures(struct tw_gles2_renderer *renderer,
+               struct tw_layers_manager *manager)
+{
+	struct tw_gles2_texture *texture;
+	struct tw_desktop_surface *dsurf;
+	struct tw_surface *surface;
+	struct tw_layer *layer;
+	uint32_t pass;
+
+	if (renderer->textures.used <= renderer->textures.budget)
+		return;
+	pass = ++renderer->textures.pass;
+	wl_list_for_each(layer, &manager->layers, link) {
+		if (layer->position == TW_LAYER_POS_HIDDEN)
+			continue;
+		wl_list_for_each(surface, &layer->views, layer_link) {
+			dsurf = tw_desktop_surface_from_tw_surface(surface);
+			if (dsurf && (dsurf->states &
+			              TW_DESKTOP_SURFACE_MINIMIZED))
+				continue;
+			mark_visible_tree(surface, pass);
+		}
+	}
+	//from the least recently drawn
+	wl_list_for_each_reverse(texture, &renderer->textures.lru, lru_link) {
+		if (renderer->textures.used <= renderer->textures.budget)
+			break;
+		if (texture->size && texture->visible_pass != pass)
+			texture_evict(renderer, texture);
+	}
+}
+
+WL_EXPORT void
+tw_gles2_renderer_evict_textures(struct tw_gles2_renderer *renderer,
+                                 struct tw_layers_manager *manager)
+{
+	if (tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE))
+		evict_textures(renderer, manager);
+}
+
+WL_EXPORT void
+tw_gles2_renderer_set_texture_budget(struct tw_gles2_renderer *renderer,
+                                     size_t budget)
+{
+	renderer->textures.budget = budget;
+}
+
+WL_EXPORT void
+tw_gles2_renderer_draw(struct tw_gles2_renderer *renderer,
+                       struct tw_gles2_render_target *target,
+                       struct tw_layers_manager *manager,
+                       pixman_region32_t *damage)
+{
+	struct tw_layer *layer;
+	struct tw_surface *surface;
+	struct tw_mat3 proj, tmp;
+	pixman_region32_t clip;
+	pixman_box32_t *boxes;
+	int n;
+
+	if (!tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE))
+		return;
+	evict_textures(renderer, manager);
+	pixman_region32_init_rect(&clip, target->x, target->y,
+	                          target->width, target->height);
+	if (damage)
+		pixman_region32_intersect(&clip, &clip, damage);
+	if (!pixman_region32_not_empty(&clip))
+		goto out;
+
+	tw_mat3_ortho_proj(&proj, target->width, target->height);
+	tw_mat3_translate(&tmp, -target->x, -target->y);
+	tw_mat3_multiply(&proj, &proj, &tmp);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+	glViewport(0, 0, target->width, target->height);
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	boxes = pixman_region32_rectangles(&clip, &n);
+	for (int i = 0; i < n; i++) {
+		scissor_box(target, &boxes[i]);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	//clients give us premultiplied alpha
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	wl_list_for_each_reverse(layer, &manager->layers, link) {
+		if (layer->position == TW_LAYER_POS_HIDDEN)
+			continue;
+		wl_list_for_each_reverse(surface, &layer->views, layer_link)
+			draw_surface_tree(renderer, target, surface, &clip,
+			                  &proj);
+	}
+	glDisable(GL_BLEND);
+	glDisable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+out:
+	pixman_region32_fini(&clip);
+}
+
+/******************************************************************************
+ * render targets
+ *****************************************************************************/
+
+WL_EXPORT bool
+tw_gles2_render_target_init(struct tw_gles2_renderer *renderer,
+                            struct tw_gles2_render_target *target,
+                            int x, int y, int width, int height)
+{
+	GLenum status;
+
+	if (!tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE))
+		return false;
+	target->x = x;
+	target->y = y;
+	target->width = width;
+	target->height = height;
+
+	glGenRenderbuffers(1, &target->rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, target->rbo);
+	glRenderbufferStorage(GL_RENDERBUFFER, renderer->egl.internal_format,
+	                      width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &target->fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	                          GL_RENDERBUFFER, target->rbo);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		tw_logl_level(TW_LOG_ERRO, "render target incomplete: 0x%x",
+		              status);
+		tw_gles2_render_target_fini(renderer, target);
+		return false;
+	}
+	return true;
+}
+
+WL_EXPORT void
+tw_gles2_render_target_fini(struct tw_gles2_renderer *renderer,
+                            struct tw_gles2_render_target *target)
+{
+	tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE);
+	if (target->fbo)
+		glDeleteFramebuffers(1, &target->fbo);
+	if (target->rbo)
+		glDeleteRenderbuffers(1, &target->rbo);
+	target->fbo = 0;
+	target->rbo = 0;
+}
+
+WL_EXPORT bool
+tw_gles2_render_target_read_pixels(struct tw_gles2_renderer *renderer,
+                                   struct tw_gles2_render_target *target,
+                                   void *data)
+{
+	if (!tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE))
+		return false;
+	glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, target->width, target->height, GL_RGBA,
+	             GL_UNSIGNED_BYTE, data);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return glGetError() == GL_NO_ERROR;
+}
+
+/******************************************************************************
+ * renderer
+ *****************************************************************************/
+
+WL_EXPORT bool
+tw_gles2_renderer_init(struct tw_gles2_renderer *renderer,
+                       struct wl_display *display)
+{
+	struct tw_egl_options opts = {
+		.platform = EGL_PLATFORM_SURFACELESS_MESA,
+		.native_display = EGL_DEFAULT_DISPLAY,
+		.visual_id = 0,
+		.context_attribs = config_attribs,
+		.platform_attribs = NULL,
+	};
+
+	memset(renderer, 0, sizeof(*renderer));
+	wl_list_init(&renderer->surfaces);
+	wl_list_init(&renderer->textures.lru);
+	renderer->textures.budget = SIZE_MAX;
+	if (!tw_egl_init(&renderer->egl, &opts))
+		return false;
+	renderer->display = display;
+	//only needed for wl_drm buffers
+	if (display)
+		tw_egl_bind_wl_display(&renderer->egl, display);
+
+	renderer->has_bgra =
+		tw_egl_check_gl_ext(&renderer->egl,
+		                    "GL_EXT_texture_format_BGRA8888");
+	renderer->has_unpack_subimage =
+		tw_egl_check_gl_ext(&renderer->egl, "GL_EXT_unpack_subimage");
+	renderer->has_external =
+		tw_egl_check_gl_ext(&renderer->egl,
+		                    "GL_OES_EGL_image_external");
+	if (tw_egl_check_gl_ext(&renderer->egl, "GL_OES_EGL_image"))
+		renderer->image_target_texture =
+			(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+			eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+	if (!shader_init(&renderer->shaders.rgba, fs_rgba_source) ||
+	    !shader_init(&renderer->shaders.rgbx, fs_rgbx_source))
+		goto err;
+	if (renderer->has_external &&
+	    !shader_init(&renderer->shaders.ext, fs_ext_source))
+		renderer->has_external = false;
+	return true;
+err:
+	tw_gles2_renderer_fini(renderer);
+	return false;
+}
+
+WL_EXPORT void
+tw_gles2_renderer_fini(struct tw_gles2_renderer *renderer)
+{
+	struct tw_gles2_texture *texture, *tmp;
+	struct gles2_surface *surface, *tmp_surface;
+
+	//surfaces may outlive us, release their textures while we still have
+	//the context
+	wl_list_for_each_safe(texture, tmp, &renderer->textures.lru, lru_link)
+		texture_destroy(texture);
+	wl_list_for_each_safe(surface, tmp_surface, &renderer->surfaces, link)
+		gles2_surface_destroy(surface);
+	tw_egl_make_current(&renderer->egl, EGL_NO_SURFACE);
+	shader_fini(&renderer->shaders.rgba);
+	shader_fini(&renderer->shaders.rgbx);
+	shader_fini(&renderer->shaders.ext);
+	tw_egl_fini(&renderer->egl);
+}
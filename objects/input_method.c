@@ -23,7 +23,6 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <wayland-server.h>
 
 #include <taiwins/objects/input_method.h>
@@ -32,7 +31,6 @@
 #include <taiwins/objects/seat.h>
 #include <taiwins/objects/utils.h>
 #include <wayland-input-method-server-protocol.h>
-#include "os-compatibility.h"
 
 static const struct zwp_input_method_v2_interface im_v2_impl;
 static const struct zwp_input_method_keyboard_grab_v2_interface grab_impl;
@@ -259,27 +257,15 @@ input_method_send_keymap(struct tw_input_method *im,
                          struct tw_keyboard *keyboard,
                          struct wl_resource *grab_resource)
 {
-	int keymap_fd;
-	void *ptr;
-
 	//this would later be a problem for virtual keyboards to involving
 	//looping keymap sending.
-	if (keyboard->keymap_string) {
-		keymap_fd = os_create_anonymous_file(keyboard->keymap_size);
-		if (!keymap_fd)
-			return;
-		ptr = mmap(NULL, keyboard->keymap_size, PROT_READ | PROT_WRITE,
-		           MAP_SHARED, keymap_fd, 0);
-		if (ptr == MAP_FAILED)
-			goto close_fd;
-		strcpy(ptr, keyboard->keymap_string);
-		zwp_input_method_keyboard_grab_v2_send_keymap(
-			grab_resource, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-			keymap_fd, keyboard->keymap_size);
-		munmap(ptr, keyboard->keymap_size);
-	close_fd:
-		close(keymap_fd);
-	}
+	int keymap_fd = tw_keyboard_acquire_keymap_fd(keyboard);
+	if (keymap_fd < 0)
+		return;
+	zwp_input_method_keyboard_grab_v2_send_keymap(
+		grab_resource, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+		keymap_fd, keyboard->keymap_size);
+	tw_keyboard_release_keymap_fd(keyboard, keymap_fd);
 }
 
 static void
@@ -19,16 +19,509 @@
  *
  */
 
+#include <math.h>
+#include <stdlib.h>
 #include <wayland-server-core.h>
 #include <wayland-util.h>
 #include <taiwins/objects/layers.h>
+#include <taiwins/objects/surface.h>
 
 static struct tw_layers_manager s_layers_manager = {0};
 
+/******************************************************************************
+ * spatial index
+ *
+ * Surfaces are hashed into a uniform grid by their geometry.xywh. A surface
+ * has one node in every cell it covers, the nodes in a bucket are sorted from
+ * top to bottom, so picking only tests the surfaces of one cell and stops at
+ * the first hit.
+ *
+ * The stacking orders are spaced by LAYERS_GRID_ORDER_GAP, a surface tree
+ * added to the layers takes the orders between the surfaces right above and
+ * below it, only when there is no room left all the surfaces are renumbered.
+ *****************************************************************************/
+
+#define LAYERS_GRID_ORDER_GAP ((uint64_t)1 << 32)
+
+struct layers_grid_node {
+	struct wl_list link;
+	struct layers_grid_entry *entry;
+	int32_t cx, cy;
+};
+
+struct layers_grid_entry {
+	struct tw_layers_manager *manager;
+	struct tw_surface *surface;
+	/* the layer of a root surface, NULL for subsurfaces */
+	struct tw_layer *layer;
+	/* tw_layers_manager:grid.entries in stacking order, empty if the
+	 * surface is not indexed */
+	struct wl_list link;
+	/* stacking order, the smaller the higher, 0 is never used */
+	uint64_t order;
+	uint32_t generation;
+	/* cells covered, inclusive */
+	pixman_box32_t cells;
+	struct layers_grid_node *nodes;
+	int n_nodes;
+
+	struct wl_listener surface_dirty;
+	struct wl_listener surface_commit;
+	struct wl_listener surface_destroy;
+	struct wl_listener subsurface_destroy;
+};
+
+static void
+layers_visit_surface(struct tw_surface *surface,
+                     void (*visit)(struct tw_surface *, void *), void *data);
+
+static inline int32_t
+layers_grid_cell(float v)
+{
+	return (int32_t)floorf(v / TW_LAYERS_GRID_CELL);
+}
+
+static inline struct wl_list *
+layers_grid_bucket(struct tw_layers_manager *manager, int32_t cx, int32_t cy)
+{
+	uint32_t hash = ((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u);
+	return &manager->grid.buckets[hash % TW_LAYERS_GRID_BUCKETS];
+}
+
+static inline pixman_box32_t
+layers_grid_cells_of(struct tw_surface *surface)
+{
+	pixman_rectangle32_t *xywh = &surface->geometry.xywh;
+
+	return (pixman_box32_t){
+		layers_grid_cell(xywh->x),
+		layers_grid_cell(xywh->y),
+		layers_grid_cell((float)xywh->x + xywh->width),
+		layers_grid_cell((float)xywh->y + xywh->height),
+	};
+}
+
+static void
+layers_grid_entry_unlink(struct layers_grid_entry *entry)
+{
+	for (int i = 0; i < entry->n_nodes; i++)
+		wl_list_remove(&entry->nodes[i].link);
+	free(entry->nodes);
+	entry->nodes = NULL;
+	entry->n_nodes = 0;
+}
+
+static void
+layers_grid_entry_link(struct layers_grid_entry *entry)
+{
+	struct layers_grid_node *node, *pos;
+	struct wl_list *bucket;
+	pixman_box32_t cells = layers_grid_cells_of(entry->surface);
+	int n = (cells.x2 - cells.x1 + 1) * (cells.y2 - cells.y1 + 1);
+
+	entry->cells = cells;
+	entry->nodes = calloc(n, sizeof(*entry->nodes));
+	if (!entry->nodes)
+		return;
+	entry->n_nodes = n;
+
+	node = entry->nodes;
+	for (int32_t cy = cells.y1; cy <= cells.y2; cy++) {
+		for (int32_t cx = cells.x1; cx <= cells.x2; cx++, node++) {
+			node->entry = entry;
+			node->cx = cx;
+			node->cy = cy;
+			bucket = layers_grid_bucket(entry->manager, cx, cy);
+			//insert before the first node below us.
+			wl_list_for_each(pos, bucket, link)
+				if (pos->entry->order > entry->order)
+					break;
+			wl_list_insert(pos->link.prev, &node->link);
+		}
+	}
+}
+
+static inline bool
+layers_grid_entry_indexed(struct layers_grid_entry *entry)
+{
+	return !wl_list_empty(&entry->link);
+}
+
+static void
+layers_grid_entry_unindex(struct layers_grid_entry *entry)
+{
+	layers_grid_entry_unlink(entry);
+	tw_reset_wl_list(&entry->link);
+}
+
+static void
+layers_grid_entry_destroy(struct layers_grid_entry *entry)
+{
+	layers_grid_entry_unlink(entry);
+	wl_list_remove(&entry->link);
+	wl_list_remove(&entry->surface_dirty.link);
+	wl_list_remove(&entry->surface_commit.link);
+	wl_list_remove(&entry->surface_destroy.link);
+	wl_list_remove(&entry->subsurface_destroy.link);
+	free(entry);
+}
+
+static struct layers_grid_entry *
+layers_grid_entry_find(struct tw_surface *surface);
+
+static void
+layers_grid_unindex_surface(struct tw_surface *surface, void *data)
+{
+	struct layers_grid_entry *entry = layers_grid_entry_find(surface);
+
+	if (entry)
+		layers_grid_entry_unindex(entry);
+}
+
+static void
+layers_grid_insert_tree(struct tw_layers_manager *manager,
+                        struct tw_surface *surface, struct tw_layer *layer);
+
+/* index the subsurfaces the surface tree gained since the last commit */
+static void
+layers_grid_index_children(struct tw_layers_manager *manager,
+                           struct tw_surface *surface)
+{
+	struct tw_subsurface *sub;
+	struct layers_grid_entry *entry;
+
+	//top most first, the sibling above is always indexed before.
+	wl_list_for_each_reverse(sub, &surface->subsurfaces, parent_link) {
+		entry = layers_grid_entry_find(sub->surface);
+		if (!entry || !layers_grid_entry_indexed(entry))
+			layers_grid_insert_tree(manager, sub->surface, NULL);
+		else
+			layers_grid_index_children(manager, sub->surface);
+	}
+}
+
+static void
+notify_grid_surface_dirty(struct wl_listener *listener, void *data)
+{
+	struct layers_grid_entry *entry =
+		wl_container_of(listener, entry, surface_dirty);
+	pixman_box32_t cells = layers_grid_cells_of(entry->surface);
+
+	if (!layers_grid_entry_indexed(entry))
+		return;
+	if (cells.x1 == entry->cells.x1 && cells.y1 == entry->cells.y1 &&
+	    cells.x2 == entry->cells.x2 && cells.y2 == entry->cells.y2 &&
+	    entry->nodes)
+		return;
+	layers_grid_entry_unlink(entry);
+	layers_grid_entry_link(entry);
+}
+
+static void
+notify_grid_surface_commit(struct wl_listener *listener, void *data)
+{
+	struct layers_grid_entry *entry =
+		wl_container_of(listener, entry, surface_commit);
+
+	//new subsurfaces join the stacking order on the parent commit
+	if (layers_grid_entry_indexed(entry))
+		layers_grid_index_children(entry->manager, entry->surface);
+}
+
+static void
+notify_grid_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct layers_grid_entry *entry =
+		wl_container_of(listener, entry, surface_destroy);
+	struct tw_subsurface *sub;
+
+	//the subsurfaces are no longer in the layers
+	wl_list_for_each(sub, &entry->surface->subsurfaces, parent_link)
+		layers_visit_surface(sub->surface,
+		                     layers_grid_unindex_surface, NULL);
+	layers_grid_entry_destroy(entry);
+}
+
+/* the subsurface role can go away in the destroy signal of the surface, the
+ * entry stays until the surface is destroyed. */
+static void
+notify_grid_subsurface_destroy(struct wl_listener *listener, void *data)
+{
+	struct layers_grid_entry *entry =
+		wl_container_of(listener, entry, subsurface_destroy);
+
+	tw_reset_wl_list(&listener->link);
+	layers_visit_surface(entry->surface, layers_grid_unindex_surface,
+	                     NULL);
+}
+
+static struct layers_grid_entry *
+layers_grid_entry_find(struct tw_surface *surface)
+{
+	struct layers_grid_entry *entry;
+	struct wl_listener *listener =
+		wl_signal_get(&surface->signals.destroy,
+		              notify_grid_surface_destroy);
+
+	return listener ?
+		wl_container_of(listener, entry, surface_destroy) : NULL;
+}
+
+static struct layers_grid_entry *
+layers_grid_entry_get(struct tw_layers_manager *manager,
+                      struct tw_surface *surface)
+{
+	struct layers_grid_entry *entry = layers_grid_entry_find(surface);
+
+	if (entry) {
+		if (!layers_grid_entry_indexed(entry))
+			entry->manager = manager;
+		return entry;
+	}
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->manager = manager;
+	entry->surface = surface;
+	wl_list_init(&entry->link);
+	wl_list_init(&entry->subsurface_destroy.link);
+	entry->subsurface_destroy.notify = notify_grid_subsurface_destroy;
+	tw_signal_setup_listener(&surface->signals.dirty,
+	                         &entry->surface_dirty,
+	                         notify_grid_surface_dirty);
+	tw_signal_setup_listener(&surface->signals.commit,
+	                         &entry->surface_commit,
+	                         notify_grid_surface_commit);
+	tw_signal_setup_listener(&surface->signals.destroy,
+	                         &entry->surface_destroy,
+	                         notify_grid_surface_destroy);
+	return entry;
+}
+
+/* put the entry after the given link of the entries list, with the order */
+static void
+layers_grid_entry_index(struct layers_grid_entry *entry, uint64_t order,
+                        struct wl_list *prev)
+{
+	struct tw_subsurface *sub = tw_surface_get_subsurface(entry->surface);
+
+	entry->order = order;
+	entry->generation = entry->manager->grid.generation;
+	wl_list_insert(prev, &entry->link);
+	tw_reset_wl_list(&entry->subsurface_destroy.link);
+	if (sub)
+		wl_signal_add(&sub->destroy, &entry->subsurface_destroy);
+	layers_grid_entry_link(entry);
+}
+
+static void
+layers_grid_index_surface(struct tw_surface *surface, void *data)
+{
+	struct tw_layers_manager *manager = data;
+	struct layers_grid_entry *entry;
+
+	entry = layers_grid_entry_get(manager, surface);
+	if (!entry)
+		return;
+	//a surface can only be indexed once
+	if (entry->generation == manager->grid.generation &&
+	    layers_grid_entry_indexed(entry))
+		return;
+	wl_list_remove(&entry->link);
+	entry->layer = NULL;
+	manager->grid.order += LAYERS_GRID_ORDER_GAP;
+	layers_grid_entry_index(entry, manager->grid.order,
+	                        manager->grid.entries.prev);
+}
+
+static inline bool
+layers_grid_layer_indexed(struct tw_layers_manager *manager,
+                          struct tw_layer *layer)
+{
+	return layer != &manager->cursor_layer &&
+		layer->position != TW_LAYER_POS_HIDDEN;
+}
+
+/* find the surface right above the tree of the surface, which is NULL if the
+ * tree is the top most. Returns false if the surface is not in the layers or
+ * not where the index expects it to be. */
+static bool
+layers_grid_tree_above(struct tw_layers_manager *manager,
+                       struct tw_surface *surface, struct tw_surface **above)
+{
+	struct tw_subsurface *sub = tw_surface_get_subsurface(surface);
+	struct tw_subsurface *sibling;
+	struct layers_grid_entry *entry;
+	struct tw_layer *layer;
+
+	*above = NULL;
+	if (sub) {
+		if (!sub->parent || wl_list_empty(&sub->parent_link))
+			return false;
+		//the tree of the sibling above ends with the sibling
+		if (sub->parent_link.next != &sub->parent->subsurfaces) {
+			sibling = wl_container_of(sub->parent_link.next,
+			                          sibling, parent_link);
+			*above = sibling->surface;
+			return true;
+		}
+		return layers_grid_tree_above(manager, sub->parent, above);
+	}
+	entry = layers_grid_entry_find(surface);
+	if (!entry || !entry->layer)
+		return false;
+	layer = entry->layer;
+	if (surface->layer_link.prev != &layer->views) {
+		*above = wl_container_of(surface->layer_link.prev, *above,
+		                         layer_link);
+		return true;
+	}
+	//the bottom surface of the first indexed layer above
+	for (layer = wl_container_of(layer->link.prev, layer, link);
+	     &layer->link != &manager->layers;
+	     layer = wl_container_of(layer->link.prev, layer, link)) {
+		if (!layers_grid_layer_indexed(manager, layer) ||
+		    wl_list_empty(&layer->views))
+			continue;
+		*above = wl_container_of(layer->views.prev, *above,
+		                         layer_link);
+		return true;
+	}
+	return true;
+}
+
+struct layers_grid_insert {
+	struct tw_layers_manager *manager;
+	struct wl_list *prev;
+	uint64_t order, step;
+	int count;
+};
+
+static void
+layers_grid_count_surface(struct tw_surface *surface, void *data)
+{
+	struct layers_grid_insert *insert = data;
+
+	insert->count++;
+}
+
+static void
+layers_grid_insert_surface(struct tw_surface *surface, void *data)
+{
+	struct layers_grid_insert *insert = data;
+	struct layers_grid_entry *entry =
+		layers_grid_entry_get(insert->manager, surface);
+
+	if (!entry)
+		return;
+	insert->order += insert->step;
+	layers_grid_entry_index(entry, insert->order, insert->prev);
+	insert->prev = &entry->link;
+}
+
+/* index the tree of the surface between the surfaces above and below it, the
+ * layer is given for a root surface. Everything is indexed again if there is
+ * no room or the surface above is not indexed. */
+static void
+layers_grid_insert_tree(struct tw_layers_manager *manager,
+                        struct tw_surface *surface, struct tw_layer *layer)
+{
+	struct layers_grid_insert insert = {
+		.manager = manager,
+		.prev = &manager->grid.entries,
+	};
+	struct layers_grid_entry *entry, *below = NULL;
+	struct tw_surface *above;
+	uint64_t end, room;
+
+	layers_visit_surface(surface, layers_grid_unindex_surface, NULL);
+	if (layer) {
+		if (!(entry = layers_grid_entry_get(manager, surface)))
+			return;
+		entry->layer = layer;
+	}
+	if (!layers_grid_tree_above(manager, surface, &above))
+		goto reorder;
+	if (above) {
+		entry = layers_grid_entry_find(above);
+		if (!entry || !layers_grid_entry_indexed(entry))
+			goto reorder;
+		insert.prev = &entry->link;
+		insert.order = entry->order;
+	}
+	if (insert.prev->next != &manager->grid.entries)
+		below = wl_container_of(insert.prev->next, below, link);
+
+	layers_visit_surface(surface, layers_grid_count_surface, &insert);
+	room = (insert.count + 1) * LAYERS_GRID_ORDER_GAP;
+	if (below)
+		end = below->order;
+	else
+		end = UINT64_MAX - insert.order > room ?
+			insert.order + room : UINT64_MAX;
+	if (end <= insert.order)
+		goto reorder;
+	insert.step = (end - insert.order) / (insert.count + 1);
+	if (!insert.step)
+		goto reorder;
+	layers_visit_surface(surface, layers_grid_insert_surface, &insert);
+	return;
+reorder:
+	tw_layers_manager_reorder(manager);
+}
+
+/* visit the surfaces from top to bottom, subsurfaces are above the parent,
+ * the last one is the top most. */
+static void
+layers_visit_surface(struct tw_surface *surface,
+                     void (*visit)(struct tw_surface *, void *), void *data)
+{
+	struct tw_subsurface *sub;
+
+	wl_list_for_each_reverse(sub, &surface->subsurfaces, parent_link)
+		layers_visit_surface(sub->surface, visit, data);
+	visit(surface, data);
+}
+
+static void
+layers_manager_for_each_surface(struct tw_layers_manager *manager,
+                                bool with_cursor,
+                                void (*visit)(struct tw_surface *, void *),
+                                void *data)
+{
+	struct tw_layer *layer;
+	struct tw_surface *surface;
+
+	wl_list_for_each(layer, &manager->layers, link) {
+		if ((!with_cursor && layer == &manager->cursor_layer) ||
+		    layer->position == TW_LAYER_POS_HIDDEN)
+			continue;
+		wl_list_for_each(surface, &layer->views, layer_link)
+			layers_visit_surface(surface, visit, data);
+	}
+}
+
+static void
+layers_grid_unindex_layer(struct tw_layer *layer)
+{
+	struct tw_surface *surface;
+
+	wl_list_for_each(surface, &layer->views, layer_link)
+		layers_visit_surface(surface, layers_grid_unindex_surface,
+		                     NULL);
+}
+
 static void
 notify_display_destroy(struct wl_listener *listener, void *data)
 {
-	//there is nothing to do right now.
+	struct layers_grid_entry *entry, *tmp;
+	struct tw_layers_manager *manager =
+		wl_container_of(listener, manager, destroy_listener);
+
+	wl_list_for_each_safe(entry, tmp, &manager->grid.entries, link)
+		layers_grid_entry_destroy(entry);
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
 }
 
 WL_EXPORT void
@@ -38,6 +531,10 @@ tw_layers_manager_init(struct tw_layers_manager *manager,
 	wl_list_init(&manager->layers);
 	wl_list_init(&manager->views);
 	wl_list_init(&manager->destroy_listener.link);
+	wl_list_init(&manager->grid.entries);
+	for (int i = 0; i < TW_LAYERS_GRID_BUCKETS; i++)
+		wl_list_init(&manager->grid.buckets[i]);
+	manager->grid.generation = 0;
 	tw_layer_init(&manager->cursor_layer);
 
 	manager->display = display;
@@ -60,6 +557,7 @@ tw_layer_init(struct tw_layer *layer)
 {
 	wl_list_init(&layer->link);
 	wl_list_init(&layer->views);
+	layer->manager = NULL;
 }
 
 
@@ -68,24 +566,138 @@ tw_layer_set_position(struct tw_layer *layer, enum tw_layer_pos pos,
                       struct tw_layers_manager *manager)
 {
 	struct tw_layer *l, *tmp;
+	struct tw_surface *surface;
 	struct wl_list *layers = &manager->layers;
+	struct wl_list *prev = layers;
+
+	layers_grid_unindex_layer(layer);
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 	layer->position = pos;
+	layer->manager = manager;
 
 	//from bottom to top
 	wl_list_for_each_reverse_safe(l, tmp, layers, link) {
 		if (l->position >= pos) {
-			wl_list_insert(&l->link, &layer->link);
-			return;
+			prev = &l->link;
+			break;
 		}
 	}
-	wl_list_insert(layers, &layer->link);
+	wl_list_insert(prev, &layer->link);
+
+	if (!layers_grid_layer_indexed(manager, layer))
+		return;
+	wl_list_for_each(surface, &layer->views, layer_link)
+		layers_grid_insert_tree(manager, surface, layer);
 }
 
 WL_EXPORT void
 tw_layer_unset_position(struct tw_layer *layer)
 {
+	layers_grid_unindex_layer(layer);
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	layer->manager = NULL;
+}
+
+WL_EXPORT void
+tw_layer_add_surface(struct tw_layer *layer, struct tw_surface *surface)
+{
+	tw_layer_remove_surface(surface);
+	wl_list_insert(&layer->views, &surface->layer_link);
+	if (layer->manager && layers_grid_layer_indexed(layer->manager, layer))
+		layers_grid_insert_tree(layer->manager, surface, layer);
+}
+
+WL_EXPORT void
+tw_layer_remove_surface(struct tw_surface *surface)
+{
+	layers_visit_surface(surface, layers_grid_unindex_surface, NULL);
+	tw_reset_wl_list(&surface->layer_link);
+}
+
+WL_EXPORT void
+tw_layers_manager_reorder(struct tw_layers_manager *manager)
+{
+	struct layers_grid_entry *entry, *tmp;
+	struct tw_surface *surface;
+	struct tw_layer *layer;
+
+	//relink everything in the new order, so the buckets stay sorted.
+	manager->grid.generation++;
+	wl_list_for_each(entry, &manager->grid.entries, link)
+		layers_grid_entry_unlink(entry);
+
+	manager->grid.order = 0;
+	wl_list_for_each(layer, &manager->layers, link) {
+		if (!layers_grid_layer_indexed(manager, layer))
+			continue;
+		wl_list_for_each(surface, &layer->views, layer_link) {
+			layers_visit_surface(surface,
+			                     layers_grid_index_surface,
+			                     manager);
+			if ((entry = layers_grid_entry_find(surface)))
+				entry->layer = layer;
+		}
+	}
+	//remove the surfaces no longer in the layers
+	wl_list_for_each_safe(entry, tmp, &manager->grid.entries, link)
+		if (entry->generation != manager->grid.generation)
+			layers_grid_entry_destroy(entry);
+}
+
+WL_EXPORT struct tw_surface *
+tw_layers_manager_pick_surface(struct tw_layers_manager *manager,
+                               float x, float y)
+{
+	struct layers_grid_node *node;
+	int32_t cx = layers_grid_cell(x);
+	int32_t cy = layers_grid_cell(y);
+	struct wl_list *bucket = layers_grid_bucket(manager, cx, cy);
+
+	wl_list_for_each(node, bucket, link) {
+		if (node->cx != cx || node->cy != cy)
+			continue;
+		if (tw_surface_has_input_point(node->entry->surface, x, y))
+			return node->entry->surface;
+	}
+	return NULL;
+}
+
+static void
+layers_cull_surface(struct tw_surface *surface, void *data)
+{
+	pixman_region32_t *covered = data;
+	pixman_region32_t opaque;
+	pixman_rectangle32_t *xywh = &surface->geometry.xywh;
+
+	pixman_region32_fini(&surface->culling.visible);
+	pixman_region32_init_rect(&surface->culling.visible,
+	                          xywh->x, xywh->y,
+	                          xywh->width, xywh->height);
+	pixman_region32_subtract(&surface->culling.visible,
+	                         &surface->culling.visible, covered);
+	surface->culling.occluded =
+		!pixman_region32_not_empty(&surface->culling.visible);
+
+	if (!pixman_region32_not_empty(&surface->current->opaque_region))
+		return;
+	pixman_region32_init(&opaque);
+	pixman_region32_copy(&opaque, &surface->current->opaque_region);
+	pixman_region32_translate(&opaque, xywh->x, xywh->y);
+	pixman_region32_intersect_rect(&opaque, &opaque, xywh->x, xywh->y,
+	                               xywh->width, xywh->height);
+	pixman_region32_union(covered, covered, &opaque);
+	pixman_region32_fini(&opaque);
+}
+
+WL_EXPORT void
+tw_layers_manager_cull(struct tw_layers_manager *manager)
+{
+	pixman_region32_t covered;
+
+	pixman_region32_init(&covered);
+	layers_manager_for_each_surface(manager, true, layers_cull_surface,
+	                                &covered);
+	pixman_region32_fini(&covered);
 }
@@ -111,6 +111,49 @@ static const enum wl_output_transform transform_yup_to_ydown[8] = {
 	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = WL_OUTPUT_TRANSFORM_FLIPPED_90
 };
 
+/* integer form of transform_2ds in the y-down coordinates, the origin is moved
+ * back to top-left cornor after the rotation:
+ * x' = xx * x + xy * y + xw * width + xh * height
+ * y' = yx * x + yy * y + yw * width + yh * height
+ */
+static const struct {
+	int8_t xx, xy, xw, xh;
+	int8_t yx, yy, yw, yh;
+} transform_boxes[8] = {
+	[WL_OUTPUT_TRANSFORM_NORMAL] = {
+		1, 0, 0, 0,
+		0, 1, 0, 0,
+	},
+	[WL_OUTPUT_TRANSFORM_90] = {
+		0, 1, 0, 0,
+		-1, 0, 1, 0,
+	},
+	[WL_OUTPUT_TRANSFORM_180] = {
+		-1, 0, 1, 0,
+		0, -1, 0, 1,
+	},
+	[WL_OUTPUT_TRANSFORM_270] = {
+		0, -1, 0, 1,
+		1, 0, 0, 0,
+	},
+	[WL_OUTPUT_TRANSFORM_FLIPPED] = {
+		-1, 0, 1, 0,
+		0, 1, 0, 0,
+	},
+	[WL_OUTPUT_TRANSFORM_FLIPPED_90] = {
+		0, -1, 0, 1,
+		-1, 0, 1, 0,
+	},
+	[WL_OUTPUT_TRANSFORM_FLIPPED_180] = {
+		1, 0, 0, 0,
+		0, -1, 0, 1,
+	},
+	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = {
+		0, 1, 0, 0,
+		1, 0, 0, 0,
+	},
+};
+
 static inline enum wl_output_transform
 transform_ydown_from_yup(enum wl_output_transform t)
 {
@@ -255,7 +298,6 @@ tw_mat3_transform_rect(struct tw_mat3 *dst, bool yup,
 	tw_mat3_init(dst);
 	tw_mat3_wl_transform(&tmp, transform, true);
 	tw_mat3_multiply(dst, &tmp, dst);
-	tw_mat3_scale(&tmp, scale, scale);
 
 	switch (transform) {
 	case WL_OUTPUT_TRANSFORM_NORMAL:
@@ -287,6 +329,36 @@ tw_mat3_transform_rect(struct tw_mat3 *dst, bool yup,
 		tw_mat3_multiply(dst, &tmp, dst);
 		break;
 	}
+	tw_mat3_scale(&tmp, scale, scale);
+	tw_mat3_multiply(dst, &tmp, dst);
+}
+
+WL_EXPORT void
+tw_mat3_wl_transform_boxes(pixman_box32_t *dst, const pixman_box32_t *src,
+                           int n, enum wl_output_transform transform,
+                           int32_t width, int32_t height)
+{
+	int32_t x1, y1, x2, y2;
+	int32_t cx = transform_boxes[transform].xw * width +
+		transform_boxes[transform].xh * height;
+	int32_t cy = transform_boxes[transform].yw * width +
+		transform_boxes[transform].yh * height;
+	int32_t xx = transform_boxes[transform].xx;
+	int32_t xy = transform_boxes[transform].xy;
+	int32_t yx = transform_boxes[transform].yx;
+	int32_t yy = transform_boxes[transform].yy;
+
+	for (int i = 0; i < n; i++) {
+		x1 = xx * src[i].x1 + xy * src[i].y1 + cx;
+		y1 = yx * src[i].x1 + yy * src[i].y1 + cy;
+		x2 = xx * src[i].x2 + xy * src[i].y2 + cx;
+		y2 = yx * src[i].x2 + yy * src[i].y2 + cy;
+
+		dst[i].x1 = MIN(x1, x2);
+		dst[i].y1 = MIN(y1, y2);
+		dst[i].x2 = MAX(x1, x2);
+		dst[i].y2 = MAX(y1, y2);
+	}
 }
 
 WL_EXPORT void
@@ -182,6 +182,44 @@ os_resize_anonymous_file(int fd, off_t size)
 	return 0;
 }
 
+/*
+ * Create an in-memory file holding a copy of the data, sealed against any
+ * modification, so that a single fd can be handed to every client. Returns -1
+ * if sealing is not supported, caller then needs a private copy per client.
+ */
+int
+os_create_sealed_file(const void *data, size_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+	const char *ptr = data;
+	size_t written = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = memfd_create("taiwins-sealed", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+	while (written < size) {
+		ret = write(fd, ptr + written, size - written);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			goto err;
+		written += ret;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	          F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto err;
+	return fd;
+err:
+	close(fd);
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 int
 os_socketpair_cloexec(int domain, int type, int protocol, int *sv)
 {
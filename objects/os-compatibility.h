@@ -34,6 +34,9 @@ os_create_anonymous_file(off_t size);
 int
 os_resize_anonymous_file(int fd, off_t size);
 
+int
+os_create_sealed_file(const void *data, size_t size);
+
 int
 os_epoll_create_cloexec(void);
 
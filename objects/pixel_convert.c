@@ -0,0 +1,812 @@
+/*
+ * pixel_convert.c - taiwins pixel format conversion
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/pixel_convert.h>
+
+#if defined(__SSE2__)
+#define TW_CONVERT_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define TW_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#define MAX(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a > _b ? _a : _b; })
+
+#define MIN(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a < _b ? _a : _b; })
+
+/* converting width pixels of one row, chroma is the NV12 chroma row */
+typedef void (*convert_row_t)(uint32_t *dst, const uint8_t *src,
+                              const uint8_t *chroma, int width);
+
+struct convert_row_funcs {
+	convert_row_t xrgb, abgr, xbgr, rgb565, nv12, yuyv;
+};
+
+/******************************************************************************
+ * scalar kernels
+ *
+ * YUV is BT.601 limited range in 6 bit fixed point, small enough that the
+ * SIMD kernels compute exactly the same in 16 bit lanes. The luma gain is
+ * taken from the high half of y * 0x0101 * YG to keep its precision.
+ *****************************************************************************/
+
+static inline uint32_t
+clamp_u8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+#define YG 18997 /* 1.164 * 64 * 65536 / 257 */
+#define YB (1192 - 32) /* 1.164 * 64 * 16, minus rounding */
+
+static inline uint32_t
+yuv_to_argb(int y, int u, int v)
+{
+	int c = ((y * 0x0101 * YG) >> 16) - YB, d = u - 128, e = v - 128;
+	int r = (c + 102 * e) >> 6;
+	int g = (c - 25 * d - 52 * e) >> 6;
+	int b = (c + 129 * d) >> 6;
+
+	return 0xff000000 | clamp_u8(r) << 16 | clamp_u8(g) << 8 | clamp_u8(b);
+}
+
+static inline uint32_t
+swap_rb(uint32_t p)
+{
+	return (p & 0xff00ff00) | (p & 0xff) << 16 | ((p >> 16) & 0xff);
+}
+
+static void
+copy_row(uint32_t *dst, const uint8_t *src, const uint8_t *chroma, int width)
+{
+	memcpy(dst, src, width * 4);
+}
+
+static void
+xrgb_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+           int width)
+{
+	const uint32_t *p = (const uint32_t *)src;
+
+	for (int i = 0; i < width; i++)
+		dst[i] = p[i] | 0xff000000;
+}
+
+static void
+abgr_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+           int width)
+{
+	const uint32_t *p = (const uint32_t *)src;
+
+	for (int i = 0; i < width; i++)
+		dst[i] = swap_rb(p[i]);
+}
+
+static void
+xbgr_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+           int width)
+{
+	const uint32_t *p = (const uint32_t *)src;
+
+	for (int i = 0; i < width; i++)
+		dst[i] = swap_rb(p[i]) | 0xff000000;
+}
+
+static void
+rgb565_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+             int width)
+{
+	for (int i = 0; i < width; i++) {
+		uint32_t p = src[2*i] | src[2*i+1] << 8;
+		uint32_t r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+
+		dst[i] = 0xff000000 | (r << 3 | r >> 2) << 16 |
+			(g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+	}
+}
+
+static void
+nv12_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+           int width)
+{
+	for (int i = 0; i < width; i++) {
+		const uint8_t *uv = chroma + (i & ~1);
+
+		dst[i] = yuv_to_argb(src[i], uv[0], uv[1]);
+	}
+}
+
+static void
+yuyv_row_c(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+           int width)
+{
+	for (int i = 0; i < width; i++) {
+		const uint8_t *pair = src + (i & ~1) * 2;
+
+		dst[i] = yuv_to_argb(src[i*2], pair[1], pair[3]);
+	}
+}
+
+static const struct convert_row_funcs c_funcs = {
+	.xrgb = xrgb_row_c,
+	.abgr = abgr_row_c,
+	.xbgr = xbgr_row_c,
+	.rgb565 = rgb565_row_c,
+	.nv12 = nv12_row_c,
+	.yuyv = yuyv_row_c,
+};
+
+/******************************************************************************
+ * SSE2 kernels, 4 or 8 pixels a time
+ *****************************************************************************/
+
+#if defined(TW_CONVERT_X86)
+
+static inline __m128i
+swap_rb_sse2(__m128i p)
+{
+	__m128i ag = _mm_and_si128(p, _mm_set1_epi32(0xff00ff00));
+	__m128i rb = _mm_and_si128(p, _mm_set1_epi32(0x00ff00ff));
+
+	rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+	return _mm_or_si128(ag, rb);
+}
+
+/* r, g, b are 8 16-bit lanes in the range of 0..255 */
+static inline void
+store_rgb_sse2(uint32_t *dst, __m128i r, __m128i g, __m128i b)
+{
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	__m128i ra = _mm_or_si128(r, _mm_set1_epi16((short)0xff00));
+
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+static inline __m128i
+clamp_u8_sse2(__m128i v)
+{
+	v = _mm_srai_epi16(v, 6);
+	return _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()),
+	                     _mm_set1_epi16(255));
+}
+
+/* uv holds 4 interleaved U, V pairs as 16-bit lanes */
+static inline void
+yuv_to_argb_sse2(uint32_t *dst, __m128i y, __m128i uv)
+{
+	__m128i u = _mm_and_si128(uv, _mm_set1_epi32(0xffff));
+	__m128i v = _mm_srli_epi32(uv, 16);
+	__m128i c, d, e, r, g, b;
+
+	//every chroma sample covers two pixels
+	u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+	v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+
+	c = _mm_mulhi_epu16(_mm_mullo_epi16(y, _mm_set1_epi16(0x0101)),
+	                    _mm_set1_epi16(YG));
+	c = _mm_sub_epi16(c, _mm_set1_epi16(YB));
+	d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+	e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+	r = _mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(102)));
+	g = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(-25)));
+	g = _mm_adds_epi16(g, _mm_mullo_epi16(e, _mm_set1_epi16(-52)));
+	b = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(129)));
+
+	store_rgb_sse2(dst, clamp_u8_sse2(r), clamp_u8_sse2(g),
+	               clamp_u8_sse2(b));
+}
+
+static void
+xrgb_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	int i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*4));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(p, alpha));
+	}
+	xrgb_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static void
+abgr_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*4));
+		_mm_storeu_si128((__m128i *)(dst + i), swap_rb_sse2(p));
+	}
+	abgr_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static void
+xbgr_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	int i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*4));
+		_mm_storeu_si128((__m128i *)(dst + i),
+		                 _mm_or_si128(swap_rb_sse2(p), alpha));
+	}
+	xbgr_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static void
+rgb565_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+                int width)
+{
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*2));
+		__m128i r = _mm_srli_epi16(p, 11);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(p, 5),
+		                          _mm_set1_epi16(0x3f));
+		__m128i b = _mm_and_si128(p, _mm_set1_epi16(0x1f));
+
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+		store_rgb_sse2(dst + i, r, g, b);
+	}
+	rgb565_row_c(dst + i, src + i*2, NULL, width - i);
+}
+
+static void
+nv12_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i y = _mm_loadl_epi64((const __m128i *)(src + i));
+		__m128i uv = _mm_loadl_epi64((const __m128i *)(chroma + i));
+
+		yuv_to_argb_sse2(dst + i, _mm_unpacklo_epi8(y, zero),
+		                 _mm_unpacklo_epi8(uv, zero));
+	}
+	nv12_row_c(dst + i, src + i, chroma + i, width - i);
+}
+
+static void
+yuyv_row_sse2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*2));
+
+		yuv_to_argb_sse2(dst + i,
+		                 _mm_and_si128(p, _mm_set1_epi16(0xff)),
+		                 _mm_srli_epi16(p, 8));
+	}
+	yuyv_row_c(dst + i, src + i*2, NULL, width - i);
+}
+
+static const struct convert_row_funcs sse2_funcs = {
+	.xrgb = xrgb_row_sse2,
+	.abgr = abgr_row_sse2,
+	.xbgr = xbgr_row_sse2,
+	.rgb565 = rgb565_row_sse2,
+	.nv12 = nv12_row_sse2,
+	.yuyv = yuyv_row_sse2,
+};
+
+/******************************************************************************
+ * AVX2 kernels, 8 or 16 pixels a time, picked at runtime
+ *****************************************************************************/
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i
+swap_rb_avx2(__m256i p)
+{
+	__m256i ag = _mm256_and_si256(p, _mm256_set1_epi32(0xff00ff00));
+	__m256i rb = _mm256_and_si256(p, _mm256_set1_epi32(0x00ff00ff));
+
+	rb = _mm256_or_si256(_mm256_slli_epi32(rb, 16),
+	                     _mm256_srli_epi32(rb, 16));
+	return _mm256_or_si256(ag, rb);
+}
+
+/* r, g, b are 16 16-bit lanes in order, unpack works within 128-bit lanes
+ * so the halves are swapped back before storing */
+static inline AVX2 void
+store_rgb_avx2(uint32_t *dst, __m256i r, __m256i g, __m256i b)
+{
+	__m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	__m256i ra = _mm256_or_si256(r, _mm256_set1_epi16((short)0xff00));
+	__m256i lo = _mm256_unpacklo_epi16(bg, ra);
+	__m256i hi = _mm256_unpackhi_epi16(bg, ra);
+
+	_mm256_storeu_si256((__m256i *)dst,
+	                    _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(dst + 8),
+	                    _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+static inline AVX2 __m256i
+clamp_u8_avx2(__m256i v)
+{
+	v = _mm256_srai_epi16(v, 6);
+	return _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()),
+	                        _mm256_set1_epi16(255));
+}
+
+static inline AVX2 void
+yuv_to_argb_avx2(uint32_t *dst, __m256i y, __m256i uv)
+{
+	__m256i u = _mm256_and_si256(uv, _mm256_set1_epi32(0xffff));
+	__m256i v = _mm256_srli_epi32(uv, 16);
+	__m256i c, d, e, r, g, b;
+
+	u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+
+	c = _mm256_mulhi_epu16(_mm256_mullo_epi16(y,
+	                                          _mm256_set1_epi16(0x0101)),
+	                       _mm256_set1_epi16(YG));
+	c = _mm256_sub_epi16(c, _mm256_set1_epi16(YB));
+	d = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+	e = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+
+	r = _mm256_adds_epi16(c, _mm256_mullo_epi16(e, _mm256_set1_epi16(102)));
+	g = _mm256_adds_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(-25)));
+	g = _mm256_adds_epi16(g, _mm256_mullo_epi16(e, _mm256_set1_epi16(-52)));
+	b = _mm256_adds_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(129)));
+
+	store_rgb_avx2(dst, clamp_u8_avx2(r), clamp_u8_avx2(g),
+	               clamp_u8_avx2(b));
+}
+
+static AVX2 void
+xrgb_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*4));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		                    _mm256_or_si256(p, alpha));
+	}
+	xrgb_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static AVX2 void
+abgr_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*4));
+		_mm256_storeu_si256((__m256i *)(dst + i), swap_rb_avx2(p));
+	}
+	abgr_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static AVX2 void
+xbgr_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*4));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		                    _mm256_or_si256(swap_rb_avx2(p), alpha));
+	}
+	xbgr_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static AVX2 void
+rgb565_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+                int width)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*2));
+		__m256i r = _mm256_srli_epi16(p, 11);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5),
+		                             _mm256_set1_epi16(0x3f));
+		__m256i b = _mm256_and_si256(p, _mm256_set1_epi16(0x1f));
+
+		r = _mm256_or_si256(_mm256_slli_epi16(r, 3),
+		                    _mm256_srli_epi16(r, 2));
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 2),
+		                    _mm256_srli_epi16(g, 4));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 3),
+		                    _mm256_srli_epi16(b, 2));
+		store_rgb_avx2(dst + i, r, g, b);
+	}
+	rgb565_row_sse2(dst + i, src + i*2, NULL, width - i);
+}
+
+static AVX2 void
+nv12_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m128i y = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i uv = _mm_loadu_si128((const __m128i *)(chroma + i));
+
+		yuv_to_argb_avx2(dst + i, _mm256_cvtepu8_epi16(y),
+		                 _mm256_cvtepu8_epi16(uv));
+	}
+	nv12_row_sse2(dst + i, src + i, chroma + i, width - i);
+}
+
+static AVX2 void
+yuyv_row_avx2(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*2));
+
+		yuv_to_argb_avx2(dst + i,
+		                 _mm256_and_si256(p, _mm256_set1_epi16(0xff)),
+		                 _mm256_srli_epi16(p, 8));
+	}
+	yuyv_row_sse2(dst + i, src + i*2, NULL, width - i);
+}
+
+static const struct convert_row_funcs avx2_funcs = {
+	.xrgb = xrgb_row_avx2,
+	.abgr = abgr_row_avx2,
+	.xbgr = xbgr_row_avx2,
+	.rgb565 = rgb565_row_avx2,
+	.nv12 = nv12_row_avx2,
+	.yuyv = yuyv_row_avx2,
+};
+
+#endif /* TW_CONVERT_X86 */
+
+/******************************************************************************
+ * NEON kernels, 8 or 16 pixels a time
+ *****************************************************************************/
+
+#if defined(TW_CONVERT_NEON)
+
+static inline uint8x8x4_t
+yuv_to_argb_neon(uint8x8_t y, uint8x8_t u, uint8x8_t v)
+{
+	uint16x8_t y16 = vmulq_n_u16(vmovl_u8(y), 0x0101);
+	uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(y16), YG), 16);
+	uint16x4_t hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(y16), YG), 16);
+	int16x8_t c = vreinterpretq_s16_u16(vcombine_u16(lo, hi));
+	int16x8_t d = vreinterpretq_s16_u16(vmovl_u8(u));
+	int16x8_t e = vreinterpretq_s16_u16(vmovl_u8(v));
+	int16x8_t r, g, b;
+	uint8x8x4_t px;
+
+	c = vsubq_s16(c, vdupq_n_s16(YB));
+	d = vsubq_s16(d, vdupq_n_s16(128));
+	e = vsubq_s16(e, vdupq_n_s16(128));
+
+	r = vqaddq_s16(c, vmulq_n_s16(e, 102));
+	g = vqaddq_s16(c, vmulq_n_s16(d, -25));
+	g = vqaddq_s16(g, vmulq_n_s16(e, -52));
+	b = vqaddq_s16(c, vmulq_n_s16(d, 129));
+
+	px.val[0] = vqshrun_n_s16(b, 6);
+	px.val[1] = vqshrun_n_s16(g, 6);
+	px.val[2] = vqshrun_n_s16(r, 6);
+	px.val[3] = vdup_n_u8(0xff);
+	return px;
+}
+
+static void
+xrgb_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+	int i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		uint32x4_t p = vreinterpretq_u32_u8(vld1q_u8(src + i*4));
+		vst1q_u32(dst + i, vorrq_u32(p, alpha));
+	}
+	xrgb_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static inline void
+swap_rb_row_neon(uint32_t *dst, const uint8_t *src, int width, bool opaque)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		uint8x16x4_t p = vld4q_u8(src + i*4);
+		uint8x16_t r = p.val[0];
+
+		p.val[0] = p.val[2];
+		p.val[2] = r;
+		if (opaque)
+			p.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8((uint8_t *)(dst + i), p);
+	}
+	if (opaque)
+		xbgr_row_c(dst + i, src + i*4, NULL, width - i);
+	else
+		abgr_row_c(dst + i, src + i*4, NULL, width - i);
+}
+
+static void
+abgr_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	swap_rb_row_neon(dst, src, width, false);
+}
+
+static void
+xbgr_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	swap_rb_row_neon(dst, src, width, true);
+}
+
+static void
+rgb565_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+                int width)
+{
+	int i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		uint16x8_t p = vreinterpretq_u16_u8(vld1q_u8(src + i*2));
+		uint16x8_t r = vshrq_n_u16(p, 11);
+		uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3f));
+		uint16x8_t b = vandq_u16(p, vdupq_n_u16(0x1f));
+		uint8x8x4_t px;
+
+		px.val[0] = vmovn_u16(vorrq_u16(vshlq_n_u16(b, 3),
+		                                vshrq_n_u16(b, 2)));
+		px.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g, 2),
+		                                vshrq_n_u16(g, 4)));
+		px.val[2] = vmovn_u16(vorrq_u16(vshlq_n_u16(r, 3),
+		                                vshrq_n_u16(r, 2)));
+		px.val[3] = vdup_n_u8(0xff);
+		vst4_u8((uint8_t *)(dst + i), px);
+	}
+	rgb565_row_c(dst + i, src + i*2, NULL, width - i);
+}
+
+static void
+nv12_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		uint8x16_t y = vld1q_u8(src + i);
+		uint8x8x2_t uv = vld2_u8(chroma + i);
+		uint8x8x2_t u = vzip_u8(uv.val[0], uv.val[0]);
+		uint8x8x2_t v = vzip_u8(uv.val[1], uv.val[1]);
+
+		vst4_u8((uint8_t *)(dst + i),
+		        yuv_to_argb_neon(vget_low_u8(y), u.val[0], v.val[0]));
+		vst4_u8((uint8_t *)(dst + i + 8),
+		        yuv_to_argb_neon(vget_high_u8(y), u.val[1], v.val[1]));
+	}
+	nv12_row_c(dst + i, src + i, chroma + i, width - i);
+}
+
+static void
+yuyv_row_neon(uint32_t *dst, const uint8_t *src, const uint8_t *chroma,
+              int width)
+{
+	int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		//even Y, U, odd Y, V
+		uint8x8x4_t p = vld4_u8(src + i*2);
+		uint8x8x4_t even = yuv_to_argb_neon(p.val[0], p.val[1],
+		                                    p.val[3]);
+		uint8x8x4_t odd = yuv_to_argb_neon(p.val[2], p.val[1],
+		                                   p.val[3]);
+		uint8x8x4_t lo, hi;
+
+		for (int k = 0; k < 4; k++) {
+			uint8x8x2_t z = vzip_u8(even.val[k], odd.val[k]);
+			lo.val[k] = z.val[0];
+			hi.val[k] = z.val[1];
+		}
+		vst4_u8((uint8_t *)(dst + i), lo);
+		vst4_u8((uint8_t *)(dst + i + 8), hi);
+	}
+	yuyv_row_c(dst + i, src + i*2, NULL, width - i);
+}
+
+static const struct convert_row_funcs neon_funcs = {
+	.xrgb = xrgb_row_neon,
+	.abgr = abgr_row_neon,
+	.xbgr = xbgr_row_neon,
+	.rgb565 = rgb565_row_neon,
+	.nv12 = nv12_row_neon,
+	.yuyv = yuyv_row_neon,
+};
+
+#endif /* TW_CONVERT_NEON */
+
+/******************************************************************************
+ * API
+ *****************************************************************************/
+
+static const struct convert_row_funcs *row_funcs = &c_funcs;
+static pthread_once_t row_funcs_once = PTHREAD_ONCE_INIT;
+
+static void
+select_row_funcs(void)
+{
+#if defined(TW_CONVERT_X86)
+	__builtin_cpu_init();
+	row_funcs = __builtin_cpu_supports("avx2") ? &avx2_funcs : &sse2_funcs;
+#elif defined(TW_CONVERT_NEON)
+	row_funcs = &neon_funcs;
+#endif
+}
+
+WL_EXPORT bool
+tw_pixel_convert_supported(uint32_t shm_format)
+{
+	switch (shm_format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_RGB565:
+	case WL_SHM_FORMAT_YUYV:
+		return true;
+	//libwayland only validates the luma plane against the pool, the chroma
+	//plane of a NV12 buffer may lie past the mapping
+	case WL_SHM_FORMAT_NV12:
+	default:
+		return false;
+	}
+}
+
+WL_EXPORT bool
+tw_pixel_convert_to_argb8888(uint32_t shm_format, const void *src,
+                             int src_stride, int width, int height,
+                             uint32_t *dst, int dst_stride,
+                             pixman_region32_t *damage)
+{
+	const uint8_t *pixels = src, *chroma = NULL;
+	pixman_box32_t full = {0, 0, width, height}, *boxes = &full;
+	convert_row_t convert;
+	int n = 1, bpp = 4;
+	bool subsampled = false;
+
+	pthread_once(&row_funcs_once, select_row_funcs);
+	switch (shm_format) {
+	case WL_SHM_FORMAT_ARGB8888:
+		convert = copy_row;
+		break;
+	case WL_SHM_FORMAT_XRGB8888:
+		convert = row_funcs->xrgb;
+		break;
+	case WL_SHM_FORMAT_ABGR8888:
+		convert = row_funcs->abgr;
+		break;
+	case WL_SHM_FORMAT_XBGR8888:
+		convert = row_funcs->xbgr;
+		break;
+	case WL_SHM_FORMAT_RGB565:
+		convert = row_funcs->rgb565;
+		bpp = 2;
+		break;
+	case WL_SHM_FORMAT_NV12:
+		//odd widths read one more chroma byte for the last pixel
+		if (src_stride < ((width + 1) & ~1))
+			return false;
+		convert = row_funcs->nv12;
+		chroma = pixels + (size_t)src_stride * height;
+		bpp = 1;
+		subsampled = true;
+		break;
+	case WL_SHM_FORMAT_YUYV:
+		if (width & 1)
+			return false;
+		convert = row_funcs->yuyv;
+		bpp = 2;
+		subsampled = true;
+		break;
+	default:
+		return false;
+	}
+
+	//libwayland only checks the stride against the width in bytes
+	if (src_stride < width * bpp)
+		return false;
+	if (damage)
+		boxes = pixman_region32_rectangles(damage, &n);
+	for (int i = 0; i < n; i++) {
+		int x1 = MAX(boxes[i].x1, 0), x2 = MIN(boxes[i].x2, width);
+		int y1 = MAX(boxes[i].y1, 0), y2 = MIN(boxes[i].y2, height);
+
+		//start at the first pixel sharing the chroma sample
+		if (subsampled)
+			x1 &= ~1;
+		if (x1 >= x2)
+			continue;
+		for (int y = y1; y < y2; y++)
+			convert((uint32_t *)((uint8_t *)dst +
+			                     (size_t)y * dst_stride) + x1,
+			        pixels + (size_t)y * src_stride + x1 * bpp,
+			        chroma ? chroma + (size_t)(y/2) * src_stride +
+			        x1 : NULL,
+			        x2 - x1);
+	}
+	return true;
+}
+
+WL_EXPORT bool
+tw_pixel_convert_shm_upload(struct tw_event_buffer_uploading *event,
+                            uint32_t *dst, int dst_stride)
+{
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+	bool ret;
+
+	if (!shm || !tw_pixel_convert_supported(wl_shm_buffer_get_format(shm)))
+		return false;
+	wl_shm_buffer_begin_access(shm);
+	ret = tw_pixel_convert_to_argb8888(wl_shm_buffer_get_format(shm),
+	                                   wl_shm_buffer_get_data(shm),
+	                                   wl_shm_buffer_get_stride(shm),
+	                                   wl_shm_buffer_get_width(shm),
+	                                   wl_shm_buffer_get_height(shm),
+	                                   dst, dst_stride,
+	                                   event->new_upload ?
+	                                   NULL : event->damages);
+	wl_shm_buffer_end_access(shm);
+	return ret;
+}
@@ -0,0 +1,648 @@
+/*
+ * pixman_renderer.c - taiwins tiled pixman renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include <taiwins/objects/logger.h>
+#include <taiwins/objects/utils.h>
+#include <taiwins/objects/matrix.h>
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/layers.h>
+#include <taiwins/objects/pixel_convert.h>
+#include <taiwins/objects/pixman_renderer.h>
+
+#define MAX(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a > _b ? _a : _b; })
+
+#define MIN(a, b) \
+	({ __typeof__ (a) _a = (a); \
+		__typeof__ (b) _b = (b); \
+		_a < _b ? _a : _b; })
+
+/* everything a worker needs to composite a surface, the workers create their
+ * own pixman images from it since pixman images are not thread safe */
+struct pixman_draw_item {
+	pixman_format_code_t format;
+	uint32_t *bits;
+	int width, height, stride;
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+	pixman_op_t op;
+	/* bounding box in target coordinates */
+	pixman_box32_t box;
+};
+
+static const pixman_color_t background = {
+	.red = 0, .green = 0, .blue = 0, .alpha = 0xffff,
+};
+
+/******************************************************************************
+ * textures
+ *****************************************************************************/
+
+static void
+texture_destroy(struct tw_pixman_texture *texture)
+{
+	if (texture->async) {
+		tw_reset_wl_list(&texture->staging_ready.link);
+		tw_shm_staging_fini(&texture->staging);
+	}
+	if (texture->image)
+		pixman_image_unref(texture->image);
+	tw_reset_wl_list(&texture->surface_destroy.link);
+	texture->surface->buffer.handle.ptr = NULL;
+	free(texture);
+}
+
+static void
+notify_texture_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct tw_pixman_texture *texture =
+		wl_container_of(listener, texture, surface_destroy);
+	texture_destroy(texture);
+}
+
+static struct tw_pixman_texture *
+texture_ensure(struct tw_surface *surface)
+{
+	struct tw_pixman_texture *texture = surface->buffer.handle.ptr;
+
+	if (texture)
+		return texture;
+	if (!(texture = calloc(1, sizeof(*texture))))
+		return NULL;
+	texture->surface = surface;
+	tw_signal_setup_listener(&surface->signals.destroy,
+	                         &texture->surface_destroy,
+	                         notify_texture_surface_destroy);
+	surface->buffer.handle.ptr = texture;
+	return texture;
+}
+
+static bool
+shm_format_to_pixman(uint32_t format, pixman_format_code_t *code,
+                     bool *has_alpha)
+{
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+		*code = PIXMAN_a8r8g8b8;
+		*has_alpha = true;
+		return true;
+	case WL_SHM_FORMAT_XRGB8888:
+		*code = PIXMAN_x8r8g8b8;
+		*has_alpha = false;
+		return true;
+	case WL_SHM_FORMAT_ABGR8888:
+		*code = PIXMAN_a8b8g8r8;
+		*has_alpha = true;
+		return true;
+	case WL_SHM_FORMAT_XBGR8888:
+		*code = PIXMAN_x8b8g8r8;
+		*has_alpha = false;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+notify_texture_staging_ready(struct wl_listener *listener, void *data)
+{
+	struct tw_pixman_texture *texture =
+		wl_container_of(listener, texture, staging_ready);
+	struct tw_shm_staging_buffer *front = &texture->staging.front;
+
+	//the front is not written until the next swap, we can sample it
+	if (texture->image)
+		pixman_image_unref(texture->image);
+	texture->image = pixman_image_create_bits_no_clear(
+		front->has_alpha ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+		front->width, front->height, front->data, front->stride);
+	texture->has_alpha = front->has_alpha;
+	tw_surface_dirty_geometry(texture->surface);
+}
+
+static bool
+pixman_buffer_queue(struct tw_pixman_renderer *renderer,
+                    struct tw_event_buffer_uploading *event,
+                    struct wl_shm_buffer *shm)
+{
+	struct tw_surface_buffer *buffer = event->buffer;
+	struct tw_surface *surface = wl_container_of(buffer, surface, buffer);
+	struct tw_pixman_texture *texture = texture_ensure(surface);
+
+	if (!texture)
+		return false;
+	if (!texture->async) {
+		tw_shm_staging_init(&texture->staging, renderer->uploader);
+		tw_signal_setup_listener(&texture->staging.signals.ready,
+		                         &texture->staging_ready,
+		                         notify_texture_staging_ready);
+		texture->async = true;
+	}
+	if (!tw_shm_staging_queue(&texture->staging, event))
+		return false;
+	buffer->width = wl_shm_buffer_get_width(shm);
+	buffer->height = wl_shm_buffer_get_height(shm);
+	buffer->stride = wl_shm_buffer_get_stride(shm);
+	buffer->format = wl_shm_buffer_get_format(shm);
+	return true;
+}
+
+static bool
+pixman_buffer_import(struct tw_event_buffer_uploading *event, void *callback)
+{
+	struct tw_pixman_renderer *renderer = callback;
+	struct tw_surface_buffer *buffer = event->buffer;
+	struct tw_surface *surface = wl_container_of(buffer, surface, buffer);
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+	struct tw_pixman_texture *texture;
+	pixman_image_t *src;
+	pixman_format_code_t code;
+	pixman_box32_t *boxes, full;
+	int n, width, height, stride;
+	uint32_t format;
+	bool has_alpha, native, full_upload, ret = true;
+
+	if (!shm)
+		return false;
+	if (renderer->uploader)
+		return pixman_buffer_queue(renderer, event, shm);
+	width = wl_shm_buffer_get_width(shm);
+	height = wl_shm_buffer_get_height(shm);
+	stride = wl_shm_buffer_get_stride(shm);
+	format = wl_shm_buffer_get_format(shm);
+	//other formats are converted to XRGB8888, they are all opaque
+	native = shm_format_to_pixman(format, &code, &has_alpha);
+	if (!native && !tw_pixel_convert_supported(format))
+		return false;
+	if (!native) {
+		code = PIXMAN_x8r8g8b8;
+		has_alpha = false;
+	}
+	if (!(texture = texture_ensure(surface)))
+		return false;
+
+	//the buffer is released after commit, so we keep a copy
+	full_upload = event->new_upload || !event->damages || !texture->image ||
+		pixman_image_get_format(texture->image) != code ||
+		pixman_image_get_width(texture->image) != width ||
+		pixman_image_get_height(texture->image) != height;
+	if (full_upload) {
+		if (texture->image)
+			pixman_image_unref(texture->image);
+		texture->image = pixman_image_create_bits_no_clear(
+			code, width, height, NULL, 0);
+		if (!texture->image)
+			return false;
+		full = (pixman_box32_t){0, 0, width, height};
+		boxes = &full;
+		n = 1;
+	} else {
+		boxes = pixman_region32_rectangles(event->damages, &n);
+	}
+	texture->has_alpha = has_alpha;
+
+	wl_shm_buffer_begin_access(shm);
+	if (native) {
+		src = pixman_image_create_bits_no_clear(
+			code, width, height, wl_shm_buffer_get_data(shm),
+			stride);
+		for (int i = 0; src && i < n; i++)
+			pixman_image_composite32(PIXMAN_OP_SRC, src, NULL,
+			                         texture->image,
+			                         boxes[i].x1, boxes[i].y1,
+			                         0, 0,
+			                         boxes[i].x1, boxes[i].y1,
+			                         boxes[i].x2 - boxes[i].x1,
+			                         boxes[i].y2 - boxes[i].y1);
+		if (src)
+			pixman_image_unref(src);
+		ret = src != NULL;
+	} else {
+		ret = tw_pixel_convert_to_argb8888(
+			format, wl_shm_buffer_get_data(shm), stride,
+			width, height, pixman_image_get_data(texture->image),
+			pixman_image_get_stride(texture->image),
+			full_upload ? NULL : event->damages);
+	}
+	wl_shm_buffer_end_access(shm);
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->stride = stride;
+	buffer->format = format;
+	return ret;
+}
+
+/* a surface with our import hook, which is reset if we go first */
+struct pixman_surface {
+	struct tw_pixman_renderer *renderer;
+	struct tw_surface *surface;
+	struct wl_list link;
+	struct wl_listener surface_destroy;
+};
+
+static void
+pixman_surface_destroy(struct pixman_surface *pixman_surface)
+{
+	wl_list_remove(&pixman_surface->link);
+	tw_reset_wl_list(&pixman_surface->surface_destroy.link);
+	free(pixman_surface);
+}
+
+static void
+notify_pixman_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct pixman_surface *pixman_surface =
+		wl_container_of(listener, pixman_surface, surface_destroy);
+	pixman_surface_destroy(pixman_surface);
+}
+
+/* the texture goes as well, its staging may refer to the uploader */
+static void
+pixman_surface_reset(struct pixman_surface *pixman_surface)
+{
+	struct tw_surface_buffer *buffer = &pixman_surface->surface->buffer;
+
+	if (buffer->buffer_import.callback == pixman_surface->renderer) {
+		if (buffer->handle.ptr)
+			texture_destroy(buffer->handle.ptr);
+		buffer->buffer_import.buffer_import = NULL;
+		buffer->buffer_import.callback = NULL;
+	}
+	pixman_surface_destroy(pixman_surface);
+}
+
+WL_EXPORT void
+tw_pixman_renderer_init_surface(struct tw_pixman_renderer *renderer,
+                                struct tw_surface *surface)
+{
+	struct pixman_surface *pixman_surface =
+		calloc(1, sizeof(*pixman_surface));
+
+	//without tracking we could not reset the hook at fini
+	if (!pixman_surface) {
+		tw_logl_level(TW_LOG_ERRO, "failed to track the surface");
+		return;
+	}
+	pixman_surface->renderer = renderer;
+	pixman_surface->surface = surface;
+	wl_list_insert(&renderer->surfaces, &pixman_surface->link);
+	tw_signal_setup_listener(&surface->signals.destroy,
+	                         &pixman_surface->surface_destroy,
+	                         notify_pixman_surface_destroy);
+	surface->buffer.buffer_import.buffer_import = pixman_buffer_import;
+	surface->buffer.buffer_import.callback = renderer;
+}
+
+/******************************************************************************
+ * frame preparation
+ *****************************************************************************/
+
+static void
+mat3_to_pixman(pixman_transform_t *dst, const struct tw_mat3 *src)
+{
+	//tw_mat3 is column major
+	for (int r = 0; r < 3; r++)
+		for (int c = 0; c < 3; c++)
+			dst->matrix[r][c] =
+				pixman_double_to_fixed(src->d[c*3+r]);
+}
+
+static bool
+mat3_is_integer_translation(const struct tw_mat3 *mat)
+{
+	return mat->d[0] == 1.0f && mat->d[4] == 1.0f &&
+		mat->d[1] == 0.0f && mat->d[3] == 0.0f &&
+		mat->d[6] == floorf(mat->d[6]) &&
+		mat->d[7] == floorf(mat->d[7]);
+}
+
+static void
+prepare_surface(struct tw_pixman_renderer *renderer, struct tw_surface *surface)
+{
+	struct tw_pixman_texture *texture = surface->buffer.handle.ptr;
+	struct pixman_draw_item *item;
+	struct tw_mat3 transform, tmp;
+	pixman_box32_t box = {
+		surface->geometry.xywh.x - renderer->frame.x,
+		surface->geometry.xywh.y - renderer->frame.y,
+		surface->geometry.xywh.x + surface->geometry.xywh.width -
+		renderer->frame.x,
+		surface->geometry.xywh.y + surface->geometry.xywh.height -
+		renderer->frame.y,
+	};
+
+	if (!texture || !texture->image)
+		return;
+	if (pixman_region32_contains_rectangle(&renderer->frame.damage,
+	                                       &box) == PIXMAN_REGION_OUT)
+		return;
+	if (!(item = wl_array_add(&renderer->frame.items, sizeof(*item))))
+		return;
+
+	//target pixel -> global -> surface local -> buffer
+	tw_mat3_translate(&tmp, renderer->frame.x - surface->geometry.x,
+	                  renderer->frame.y - surface->geometry.y);
+	tw_mat3_multiply(&transform, &surface->current->surface_to_buffer,
+	                 &tmp);
+	mat3_to_pixman(&item->transform, &transform);
+	item->filter = mat3_is_integer_translation(&transform) ?
+		PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_BILINEAR;
+	item->op = texture->has_alpha ? PIXMAN_OP_OVER : PIXMAN_OP_SRC;
+	item->format = pixman_image_get_format(texture->image);
+	item->bits = pixman_image_get_data(texture->image);
+	item->width = pixman_image_get_width(texture->image);
+	item->height = pixman_image_get_height(texture->image);
+	item->stride = pixman_image_get_stride(texture->image);
+	item->box = box;
+}
+
+/* from bottom to top, subsurfaces are above their parent */
+static void
+prepare_surface_tree(struct tw_pixman_renderer *renderer,
+                     struct tw_surface *surface)
+{
+	struct tw_subsurface *sub;
+
+	prepare_surface(renderer, surface);
+	wl_list_for_each(sub, &surface->subsurfaces, parent_link)
+		prepare_surface_tree(renderer, sub->surface);
+}
+
+static void
+prepare_tiles(struct tw_pixman_renderer *renderer)
+{
+	pixman_box32_t *extents = pixman_region32_extents(
+		&renderer->frame.damage);
+	pixman_box32_t tile, *t;
+	int size = TW_PIXMAN_TILE_SIZE;
+
+	for (int y = extents->y1; y < extents->y2; y += size) {
+		for (int x = extents->x1; x < extents->x2; x += size) {
+			tile.x1 = x;
+			tile.y1 = y;
+			tile.x2 = MIN(x + size, extents->x2);
+			tile.y2 = MIN(y + size, extents->y2);
+			if (pixman_region32_contains_rectangle(
+				    &renderer->frame.damage, &tile) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+			if (!(t = wl_array_add(&renderer->frame.tiles,
+			                       sizeof(*t))))
+				return;
+			*t = tile;
+		}
+	}
+}
+
+/******************************************************************************
+ * workers
+ *****************************************************************************/
+
+static inline bool
+box_overlaps(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+		a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static void
+draw_tile(struct tw_pixman_renderer *renderer, unsigned int index)
+{
+	pixman_image_t *target = renderer->frame.target;
+	const pixman_box32_t *tile =
+		(pixman_box32_t *)renderer->frame.tiles.data + index;
+	struct pixman_draw_item *item;
+	pixman_region32_t clip, item_clip;
+	pixman_image_t *dst, *src;
+	pixman_box32_t *boxes, *ext;
+	int n;
+
+	//a private image over the same bits, tiles never overlap
+	dst = pixman_image_create_bits_no_clear(
+		pixman_image_get_format(target),
+		pixman_image_get_width(target),
+		pixman_image_get_height(target),
+		pixman_image_get_data(target),
+		pixman_image_get_stride(target));
+	if (!dst)
+		return;
+	pixman_region32_init(&clip);
+	pixman_region32_init(&item_clip);
+	pixman_region32_intersect_rect(&clip, &renderer->frame.damage,
+	                               tile->x1, tile->y1,
+	                               tile->x2 - tile->x1,
+	                               tile->y2 - tile->y1);
+	boxes = pixman_region32_rectangles(&clip, &n);
+	pixman_image_fill_boxes(PIXMAN_OP_SRC, dst, &background, n, boxes);
+
+	wl_array_for_each(item, &renderer->frame.items) {
+		if (!box_overlaps(&item->box, tile))
+			continue;
+		pixman_region32_intersect_rect(&item_clip, &clip,
+		                               item->box.x1, item->box.y1,
+		                               item->box.x2 - item->box.x1,
+		                               item->box.y2 - item->box.y1);
+		if (!pixman_region32_not_empty(&item_clip))
+			continue;
+		src = pixman_image_create_bits_no_clear(item->format,
+		                                        item->width,
+		                                        item->height,
+		                                        item->bits,
+		                                        item->stride);
+		if (!src)
+			continue;
+		pixman_image_set_transform(src, &item->transform);
+		pixman_image_set_filter(src, item->filter, NULL, 0);
+		pixman_image_set_clip_region32(dst, &item_clip);
+		ext = pixman_region32_extents(&item_clip);
+		pixman_image_composite32(item->op, src, NULL, dst,
+		                         ext->x1, ext->y1, 0, 0,
+		                         ext->x1, ext->y1,
+		                         ext->x2 - ext->x1, ext->y2 - ext->y1);
+		pixman_image_unref(src);
+	}
+	pixman_image_set_clip_region32(dst, NULL);
+	pixman_image_unref(dst);
+	pixman_region32_fini(&item_clip);
+	pixman_region32_fini(&clip);
+}
+
+/* take tiles of the given frame until there is none left, called with the
+ * lock held */
+static void
+run_tiles(struct tw_pixman_renderer *renderer, uint32_t generation)
+{
+	while (renderer->frame.generation == generation &&
+	       renderer->frame.next < renderer->frame.n_tiles) {
+		unsigned int index = renderer->frame.next++;
+
+		pthread_mutex_unlock(&renderer->lock);
+		draw_tile(renderer, index);
+		pthread_mutex_lock(&renderer->lock);
+		if (++renderer->frame.done == renderer->frame.n_tiles)
+			pthread_cond_signal(&renderer->done_cond);
+	}
+}
+
+static void *
+worker_main(void *data)
+{
+	struct tw_pixman_renderer *renderer = data;
+	uint32_t seen;
+
+	pthread_mutex_lock(&renderer->lock);
+	seen = renderer->frame.generation;
+	while (!renderer->quit) {
+		if (renderer->frame.generation == seen) {
+			pthread_cond_wait(&renderer->work_cond,
+			                  &renderer->lock);
+			continue;
+		}
+		seen = renderer->frame.generation;
+		run_tiles(renderer, seen);
+	}
+	pthread_mutex_unlock(&renderer->lock);
+	return NULL;
+}
+
+WL_EXPORT void
+tw_pixman_renderer_draw(struct tw_pixman_renderer *renderer,
+                        pixman_image_t *target, int x, int y,
+                        struct tw_layers_manager *manager,
+                        pixman_region32_t *damage)
+{
+	struct tw_layer *layer;
+	struct tw_surface *surface;
+	uint32_t generation;
+	int width = pixman_image_get_width(target);
+	int height = pixman_image_get_height(target);
+
+	pthread_mutex_lock(&renderer->lock);
+	renderer->frame.target = target;
+	renderer->frame.x = x;
+	renderer->frame.y = y;
+	renderer->frame.tiles.size = 0;
+	renderer->frame.items.size = 0;
+	if (damage) {
+		pixman_region32_intersect_rect(&renderer->frame.damage, damage,
+		                               x, y, width, height);
+		pixman_region32_translate(&renderer->frame.damage, -x, -y);
+	} else {
+		pixman_region32_fini(&renderer->frame.damage);
+		pixman_region32_init_rect(&renderer->frame.damage,
+		                          0, 0, width, height);
+	}
+	if (!pixman_region32_not_empty(&renderer->frame.damage))
+		goto out;
+
+	wl_list_for_each_reverse(layer, &manager->layers, link) {
+		if (layer->position == TW_LAYER_POS_HIDDEN)
+			continue;
+		wl_list_for_each_reverse(surface, &layer->views, layer_link)
+			prepare_surface_tree(renderer, surface);
+	}
+	prepare_tiles(renderer);
+
+	renderer->frame.n_tiles = renderer->frame.tiles.size /
+		sizeof(pixman_box32_t);
+	renderer->frame.next = 0;
+	renderer->frame.done = 0;
+	generation = ++renderer->frame.generation;
+	pthread_cond_broadcast(&renderer->work_cond);
+	//working as one of the workers
+	run_tiles(renderer, generation);
+	while (renderer->frame.done < renderer->frame.n_tiles)
+		pthread_cond_wait(&renderer->done_cond, &renderer->lock);
+out:
+	renderer->frame.target = NULL;
+	pthread_mutex_unlock(&renderer->lock);
+}
+
+WL_EXPORT bool
+tw_pixman_renderer_init(struct tw_pixman_renderer *renderer, int n_threads)
+{
+	memset(renderer, 0, sizeof(*renderer));
+	wl_list_init(&renderer->surfaces);
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = MAX(1, MIN(n_threads, TW_PIXMAN_MAX_THREADS));
+
+	pthread_mutex_init(&renderer->lock, NULL);
+	pthread_cond_init(&renderer->work_cond, NULL);
+	pthread_cond_init(&renderer->done_cond, NULL);
+	pixman_region32_init(&renderer->frame.damage);
+	wl_array_init(&renderer->frame.tiles);
+	wl_array_init(&renderer->frame.items);
+
+	//the drawing thread is the first worker
+	renderer->n_threads = 1;
+	for (int i = 1; i < n_threads; i++) {
+		if (pthread_create(&renderer->threads[i], NULL, worker_main,
+		                   renderer) != 0) {
+			tw_logl_level(TW_LOG_WARN, "only %d pixman workers "
+			              "created", renderer->n_threads);
+			break;
+		}
+		renderer->n_threads++;
+	}
+	return true;
+}
+
+WL_EXPORT void
+tw_pixman_renderer_set_uploader(struct tw_pixman_renderer *renderer,
+                                struct tw_shm_uploader *uploader)
+{
+	renderer->uploader = uploader;
+}
+
+WL_EXPORT void
+tw_pixman_renderer_fini(struct tw_pixman_renderer *renderer)
+{
+	struct pixman_surface *surface, *tmp;
+
+	wl_list_for_each_safe(surface, tmp, &renderer->surfaces, link)
+		pixman_surface_reset(surface);
+	pthread_mutex_lock(&renderer->lock);
+	renderer->quit = true;
+	pthread_cond_broadcast(&renderer->work_cond);
+	pthread_mutex_unlock(&renderer->lock);
+	for (int i = 1; i < renderer->n_threads; i++)
+		pthread_join(renderer->threads[i], NULL);
+
+	pthread_cond_destroy(&renderer->done_cond);
+	pthread_cond_destroy(&renderer->work_cond);
+	pthread_mutex_destroy(&renderer->lock);
+	pixman_region32_fini(&renderer->frame.damage);
+	wl_array_release(&renderer->frame.tiles);
+	wl_array_release(&renderer->frame.items);
+}
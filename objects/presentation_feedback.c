@@ -28,6 +28,7 @@
 #include <wayland-server.h>
 #include <wayland-presentation-time-server-protocol.h>
 #include <taiwins/objects/utils.h>
+#include <taiwins/objects/profiler.h>
 #include <taiwins/objects/surface.h>
 #include <taiwins/objects/presentation_feedback.h>
 #include <wayland-util.h>
@@ -81,6 +82,7 @@ notify_feedback_surface_commit(struct wl_listener *listener, void *user_data)
 	struct tw_presentation_feedback *feedback =
 		wl_container_of(listener, feedback, surface_commit);
 	feedback->committed = true;
+	feedback->trace_flow = tw_surface_trace_flow(feedback->surface);
 }
 
 static struct tw_presentation_feedback *
@@ -233,6 +235,8 @@ tw_presentation_feeback_sync(struct tw_presentation_feedback *feedback,
 
 	if (!feedback->committed)
 		return;
+	tw_profiler_start_timer("presentation_sync");
+	tw_profiler_flow_end("surface_frame", feedback->trace_flow);
 	wl_resource_for_each_safe(resource, tmp, &feedback->resources) {
 		wp_presentation_feedback_send_sync_output(resource, output);
 		wp_presentation_feedback_send_presented(resource,
@@ -244,6 +248,7 @@ tw_presentation_feeback_sync(struct tw_presentation_feedback *feedback,
 	}
 	feedback->presented = true;
 	tw_presentation_feedback_destroy(feedback);
+	tw_profiler_stop_timer("presentation_sync");
 }
 
 WL_EXPORT void
@@ -24,27 +24,93 @@
 #endif
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <stdio.h>
-#include <math.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 #include <wayland-server-core.h>
 
 #include <taiwins/objects/profiler.h>
 
-#define THREAD_ID() (unsigned int)pthread_self()
+/*
+ * Every thread records events into its own ring buffer without locking, a
+ * background writer thread drains the rings into a compact binary trace. The
+ * names are recorded as pointers, the writer assigns them ids and writes the
+ * strings once. tw_profiler_convert converts the trace into chrome tracing
+ * json.
+ *
+ * A ring is marked dead when its thread exits, the writer frees it after
+ * draining it one last time.
+ */
 
-#define MAX_SCOPES 10
+#define PROFILER_RING_SIZE 4096 /* power of 2 */
+#define PROFILER_RING_MASK (PROFILER_RING_SIZE - 1)
+#define PROFILER_DRAIN_MS 10
 
-struct tw_profiler_scope
-{
+#define PROFILER_MAGIC "TWPROF02"
+#define PROFILER_DROPPED_NAME "profiler_dropped"
+
+enum profiler_record_kind {
+	PROFILER_RECORD_STRING = 1,
+	PROFILER_RECORD_EVENT = 2,
+};
+
+/* phases are the chrome tracing event types */
+enum profiler_phase {
+	PROFILER_PHASE_BEGIN = 'B',
+	PROFILER_PHASE_END = 'E',
+	PROFILER_PHASE_COUNTER = 'C',
+	PROFILER_PHASE_INSTANT = 'i',
+	PROFILER_PHASE_FLOW_BEGIN = 's',
+	PROFILER_PHASE_FLOW_STEP = 't',
+	PROFILER_PHASE_FLOW_END = 'f',
+};
+
+struct profiler_event {
 	const char *name;
-	long long start_time;
-	long long end_time;
-	unsigned int tid;
+	uint64_t ts; /* nanoseconds */
+	uint64_t id; /* flow or object id */
+	int64_t value; /* counter value */
+	uint8_t phase;
+};
+
+struct profiler_ring {
+	struct wl_list link;
+	uint32_t tid;
+	_Atomic uint32_t head; /* written by recording thread */
+	_Atomic uint32_t tail; /* written by writer thread */
+	_Atomic uint32_t dropped;
+	atomic_bool dead; /* set when the thread exits */
+	struct profiler_event events[PROFILER_RING_SIZE];
+};
+
+/* on-disk records, in host byte order */
+struct profiler_file_string {
+	uint8_t kind;
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed));
+
+struct profiler_file_event {
+	uint8_t kind;
+	uint8_t phase;
+	uint32_t name;
+	uint32_t tid;
+	uint64_t ts;
+	uint64_t id;
+	int64_t value;
+} __attribute__((packed));
+
+struct profiler_name {
+	const char *ptr;
+	uint32_t id;
 };
 
 static struct tw_profiler {
@@ -52,63 +118,306 @@ static struct tw_profiler {
 	struct wl_listener display_destroy;
 	FILE *file;
 
-	bool empty;
-	int32_t depth;
-	struct tw_profiler_scope scopes[MAX_SCOPES];
+	atomic_bool running;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* a thread keeps its ring for reopening, until it exits */
+	struct wl_list rings;
+	bool rings_initialized;
+	pthread_key_t ring_key;
 
-} s_profiler = {0};
+	/* names table, only accessed by writer thread */
+	struct profiler_name *names;
+	uint32_t names_cap, names_count;
+	/* rings being drained and the dropped events, writer thread only */
+	struct wl_array snapshot;
+	uint64_t dropped;
+} s_profiler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
 
-static inline void
-write_header(FILE *file)
+static __thread struct profiler_ring *t_ring = NULL;
+static pthread_once_t s_ring_key_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t
+profiler_now(void)
 {
-	fprintf(file, "{\"otherData\": {},\"traceEvents\":[\n");
-	fflush(file);
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+/* runs on the exiting thread, the writer owns the ring from now on */
+static void
+profiler_ring_exit(void *data)
+{
+	struct profiler_ring *ring = data;
+
+	t_ring = NULL;
+	atomic_store_explicit(&ring->dead, true, memory_order_release);
+}
+
+static void
+profiler_create_ring_key(void)
+{
+	pthread_key_create(&s_profiler.ring_key, profiler_ring_exit);
+}
+
+static struct profiler_ring *
+profiler_get_ring(void)
+{
+	struct profiler_ring *ring = t_ring;
+
+	if (ring)
+		return ring;
+	pthread_once(&s_ring_key_once, profiler_create_ring_key);
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->tid = (uint32_t)syscall(SYS_gettid);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->dead, false);
+	if (pthread_setspecific(s_profiler.ring_key, ring)) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s_profiler.lock);
+	if (!s_profiler.rings_initialized) {
+		wl_list_init(&s_profiler.rings);
+		s_profiler.rings_initialized = true;
+	}
+	wl_list_insert(s_profiler.rings.prev, &ring->link);
+	pthread_mutex_unlock(&s_profiler.lock);
+
+	t_ring = ring;
+	return ring;
 }
 
 static inline void
-write_footer(FILE *file)
+profiler_record(const char *name, enum profiler_phase phase,
+                uint64_t id, int64_t value)
 {
-	fprintf(file, "]}\n");
-	fflush(file);
+	uint32_t head, tail;
+	struct profiler_event *event;
+	struct profiler_ring *ring;
+
+	if (!atomic_load_explicit(&s_profiler.running, memory_order_relaxed))
+		return;
+	if (!(ring = profiler_get_ring()))
+		return;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	//never blocks the recording thread, drop the event instead.
+	if (head - tail >= PROFILER_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+		                          memory_order_relaxed);
+		return;
+	}
+	event = &ring->events[head & PROFILER_RING_MASK];
+	event->name = name;
+	event->phase = phase;
+	event->id = id;
+	event->value = value;
+	event->ts = profiler_now();
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/******************************************************************************
+ * writer thread
+ *****************************************************************************/
+
+static inline uint32_t
+profiler_hash_ptr(const char *ptr)
+{
+	uintptr_t v = (uintptr_t)ptr;
+
+	v ^= v >> 17;
+	v *= 0xed5ad4bbU;
+	v ^= v >> 11;
+	return (uint32_t)v;
+}
+
+static bool
+profiler_grow_names(void)
+{
+	uint32_t cap = s_profiler.names_cap ? s_profiler.names_cap * 2 : 256;
+	struct profiler_name *names = calloc(cap, sizeof(*names));
+	struct profiler_name *old = s_profiler.names;
+
+	if (!names)
+		return false;
+	for (uint32_t i = 0; i < s_profiler.names_cap; i++) {
+		uint32_t h;
+
+		if (!old[i].ptr)
+			continue;
+		h = profiler_hash_ptr(old[i].ptr) & (cap - 1);
+		while (names[h].ptr)
+			h = (h + 1) & (cap - 1);
+		names[h] = old[i];
+	}
+	free(old);
+	s_profiler.names = names;
+	s_profiler.names_cap = cap;
+	return true;
+}
+
+static uint32_t
+profiler_name_id(const char *name, FILE *file)
+{
+	uint32_t h, len;
+	struct profiler_file_string record;
+
+	if ((s_profiler.names_count + 1) * 4 > s_profiler.names_cap * 3 &&
+	    !profiler_grow_names())
+		return UINT32_MAX;
+
+	h = profiler_hash_ptr(name) & (s_profiler.names_cap - 1);
+	while (s_profiler.names[h].ptr) {
+		if (s_profiler.names[h].ptr == name)
+			return s_profiler.names[h].id;
+		h = (h + 1) & (s_profiler.names_cap - 1);
+	}
+	//new string, write it before the events referring it
+	s_profiler.names[h].ptr = name;
+	s_profiler.names[h].id = s_profiler.names_count++;
+
+	len = strlen(name);
+	record.kind = PROFILER_RECORD_STRING;
+	record.id = s_profiler.names[h].id;
+	record.len = len;
+	fwrite(&record, sizeof(record), 1, file);
+	fwrite(name, 1, len, file);
+	return record.id;
 }
 
 static void
-write_start(const struct tw_profiler_scope *scope, FILE *file, bool comma)
-{
-	if (comma)
-		fprintf(file, ",");
-	fprintf(file, "{");
-	fprintf(file, "\"cat\":\"function\",");
-	fprintf(file, "\"name\":\"%s\",", scope->name);
-	fprintf(file, "\"ph\":\"B\",");
-	fprintf(file, "\"pid\":0,");
-	fprintf(file, "\"tid\":%2u,", scope->tid);
-	fprintf(file, "\"ts\":%lld", scope->start_time);
-	fprintf(file, "}\n");
+profiler_drain_ring(struct profiler_ring *ring, FILE *file)
+{
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t dropped = atomic_exchange_explicit(&ring->dropped, 0,
+	                                            memory_order_relaxed);
+	struct profiler_file_event record = {
+		.kind = PROFILER_RECORD_EVENT,
+		.tid = ring->tid,
+	};
+
+	//a counter of all the events dropped so far
+	if (dropped) {
+		s_profiler.dropped += dropped;
+		record.phase = PROFILER_PHASE_COUNTER;
+		record.ts = profiler_now();
+		record.id = 0;
+		record.value = s_profiler.dropped;
+		record.name = profiler_name_id(PROFILER_DROPPED_NAME, file);
+		fwrite(&record, sizeof(record), 1, file);
+	}
+
+	for (; tail != head; tail++) {
+		struct profiler_event *event =
+			&ring->events[tail & PROFILER_RING_MASK];
+		record.phase = event->phase;
+		record.ts = event->ts;
+		record.id = event->id;
+		record.value = event->value;
+		record.name = profiler_name_id(event->name, file);
+		fwrite(&record, sizeof(record), 1, file);
+	}
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
 }
 
 static void
-write_end(const struct tw_profiler_scope *scope, FILE *file, bool comma)
-{
-	if (comma)
-		fprintf(file, ",");
-	fprintf(file, "{");
-	fprintf(file, "\"cat\":\"function\",");
-	fprintf(file, "\"name\":\"%s\",", scope->name);
-	fprintf(file, "\"ph\":\"E\",");
-	fprintf(file, "\"pid\":0,");
-	fprintf(file, "\"tid\":%2u,", scope->tid);
-	fprintf(file, "\"ts\":%lld", scope->end_time);
-	fprintf(file, "}\n");
+profiler_free_ring(struct profiler_ring *ring)
+{
+	pthread_mutex_lock(&s_profiler.lock);
+	wl_list_remove(&ring->link);
+	pthread_mutex_unlock(&s_profiler.lock);
+	free(ring);
+}
+
+static void
+profiler_drain(void)
+{
+	struct profiler_ring *ring, **slot;
+	bool dead;
+
+	//only the writer removes rings, a snapshot taken under the lock stays
+	//valid, new threads do not wait for the file IO.
+	s_profiler.snapshot.size = 0;
+	pthread_mutex_lock(&s_profiler.lock);
+	wl_list_for_each(ring, &s_profiler.rings, link) {
+		if (!(slot = wl_array_add(&s_profiler.snapshot, sizeof(ring))))
+			break;
+		*slot = ring;
+	}
+	pthread_mutex_unlock(&s_profiler.lock);
+
+	wl_array_for_each(slot, &s_profiler.snapshot) {
+		ring = *slot;
+		//read before draining, so the last events are drained
+		dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+		profiler_drain_ring(ring, s_profiler.file);
+		if (dead)
+			profiler_free_ring(ring);
+	}
+	fflush(s_profiler.file);
 }
 
+static void *
+profiler_writer_thread(void *data)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&s_profiler.lock);
+	while (atomic_load(&s_profiler.running)) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += PROFILER_DRAIN_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&s_profiler.cond, &s_profiler.lock,
+		                       &deadline);
+		pthread_mutex_unlock(&s_profiler.lock);
+		profiler_drain();
+		pthread_mutex_lock(&s_profiler.lock);
+	}
+	pthread_mutex_unlock(&s_profiler.lock);
+	//drain what is left
+	profiler_drain();
+	return NULL;
+}
+
+/******************************************************************************
+ * API
+ *****************************************************************************/
+
 WL_EXPORT void
 tw_profiler_close()
 {
-	write_footer(s_profiler.file);
-	if (s_profiler.file != stdout && s_profiler.file != stderr)
-		fclose(s_profiler.file);
+	if (!s_profiler.file)
+		return;
+	pthread_mutex_lock(&s_profiler.lock);
+	atomic_store(&s_profiler.running, false);
+	pthread_cond_signal(&s_profiler.cond);
+	pthread_mutex_unlock(&s_profiler.lock);
+	pthread_join(s_profiler.writer, NULL);
+
+	fclose(s_profiler.file);
 	s_profiler.file = NULL;
+	wl_array_release(&s_profiler.snapshot);
+	wl_array_init(&s_profiler.snapshot);
+	free(s_profiler.names);
+	s_profiler.names = NULL;
+	s_profiler.names_cap = 0;
+	s_profiler.names_count = 0;
 }
 
 static void
@@ -122,16 +431,44 @@ notify_profile_display_destroy(struct wl_listener *listener, void *data)
 WL_EXPORT bool
 tw_profiler_open(struct wl_display *display, const char *fname)
 {
-	FILE *file = fopen(fname, "w");
+	struct profiler_ring *ring, *tmp;
+	FILE *file;
+
+	tw_profiler_close();
+	file = fopen(fname, "wb");
 	if (!file)
 		return false;
-	if (s_profiler.file && s_profiler.file != stdout &&
-	    s_profiler.file != stderr)
-		fclose(s_profiler.file);
-
+	fwrite(PROFILER_MAGIC, 1, strlen(PROFILER_MAGIC), file);
 	s_profiler.file = file;
-	s_profiler.empty = true;
-	s_profiler.display = display;
+
+	//events recorded before opening are stale, so are the threads exited
+	//while closed
+	pthread_mutex_lock(&s_profiler.lock);
+	if (!s_profiler.rings_initialized) {
+		wl_list_init(&s_profiler.rings);
+		s_profiler.rings_initialized = true;
+	}
+	wl_list_for_each_safe(ring, tmp, &s_profiler.rings, link) {
+		if (atomic_load(&ring->dead)) {
+			wl_list_remove(&ring->link);
+			free(ring);
+			continue;
+		}
+		atomic_store(&ring->tail, atomic_load(&ring->head));
+		atomic_store(&ring->dropped, 0);
+	}
+	pthread_mutex_unlock(&s_profiler.lock);
+	wl_array_init(&s_profiler.snapshot);
+	s_profiler.dropped = 0;
+
+	atomic_store(&s_profiler.running, true);
+	if (pthread_create(&s_profiler.writer, NULL, profiler_writer_thread,
+	                   NULL)) {
+		atomic_store(&s_profiler.running, false);
+		fclose(file);
+		s_profiler.file = NULL;
+		return false;
+	}
 
 	if (!s_profiler.display) {
 		s_profiler.display = display;
@@ -141,40 +478,150 @@ tw_profiler_open(struct wl_display *display, const char *fname)
 		wl_display_add_destroy_listener(display,
 		                                &s_profiler.display_destroy);
 	}
-	write_header(file);
 	return true;
 }
 
 WL_EXPORT void
 tw_profiler_start_timer(const char *name)
 {
-	struct timespec spec;
-	struct tw_profiler_scope *scope;
-
-        assert(s_profiler.depth < MAX_SCOPES);
-        scope = &s_profiler.scopes[s_profiler.depth];
-        scope->name = name;
-        scope->tid = THREAD_ID();
-	clock_gettime(CLOCK_MONOTONIC, &spec);
-	scope->start_time = (spec.tv_sec*1000000 + spec.tv_nsec/1000);
-	write_start(scope, s_profiler.file, !s_profiler.empty);
-	s_profiler.empty = false;
-	s_profiler.depth+=1;
+	profiler_record(name, PROFILER_PHASE_BEGIN, 0, 0);
 }
 
 WL_EXPORT void
 tw_profiler_stop_timer(const char *name)
 {
-	int32_t depth = s_profiler.depth-1;
-	struct tw_profiler_scope *scope;
-	struct timespec spec;
+	profiler_record(name, PROFILER_PHASE_END, 0, 0);
+}
 
-	assert(depth >= 0);
-	assert(s_profiler.scopes[depth].name == name);
-	s_profiler.depth-=1;
-	scope = &s_profiler.scopes[depth];
-	clock_gettime(CLOCK_MONOTONIC, &spec);
-	scope->end_time = (spec.tv_sec*1000000 + spec.tv_nsec/1000);
-	write_end(scope, s_profiler.file, !s_profiler.empty);
-	s_profiler.empty = false;
+WL_EXPORT void
+tw_profiler_counter(const char *name, int64_t value)
+{
+	profiler_record(name, PROFILER_PHASE_COUNTER, 0, value);
+}
+
+WL_EXPORT void
+tw_profiler_instant(const char *name, uint64_t id)
+{
+	profiler_record(name, PROFILER_PHASE_INSTANT, id, 0);
+}
+
+WL_EXPORT void
+tw_profiler_flow_begin(const char *name, uint64_t id)
+{
+	profiler_record(name, PROFILER_PHASE_FLOW_BEGIN, id, 0);
+}
+
+WL_EXPORT void
+tw_profiler_flow_step(const char *name, uint64_t id)
+{
+	profiler_record(name, PROFILER_PHASE_FLOW_STEP, id, 0);
+}
+
+WL_EXPORT void
+tw_profiler_flow_end(const char *name, uint64_t id)
+{
+	profiler_record(name, PROFILER_PHASE_FLOW_END, id, 0);
+}
+
+/******************************************************************************
+ * converter
+ *****************************************************************************/
+
+static void
+write_event(FILE *file, const struct profiler_file_event *event,
+            const char *name, bool comma)
+{
+	fprintf(file, "%s{\"cat\":\"function\",\"name\":\"%s\","
+	        "\"ph\":\"%c\",\"pid\":0,\"tid\":%u,\"ts\":%.3f",
+	        comma ? "," : "", name, event->phase, event->tid,
+	        event->ts / 1000.0);
+	switch (event->phase) {
+	case PROFILER_PHASE_COUNTER:
+		fprintf(file, ",\"args\":{\"%s\":%" PRId64 "}",
+		        name, event->value);
+		break;
+	case PROFILER_PHASE_INSTANT:
+		fprintf(file, ",\"s\":\"t\",\"args\":{\"id\":%" PRIu64 "}",
+		        event->id);
+		break;
+	case PROFILER_PHASE_FLOW_END:
+		//bind to the enclosing slice instead of the next one
+		fprintf(file, ",\"bp\":\"e\"");
+		/* fallthrough */
+	case PROFILER_PHASE_FLOW_BEGIN:
+	case PROFILER_PHASE_FLOW_STEP:
+		fprintf(file, ",\"id\":\"0x%" PRIx64 "\"", event->id);
+		break;
+	default:
+		break;
+	}
+	fprintf(file, "}\n");
+}
+
+WL_EXPORT bool
+tw_profiler_convert(const char *trace_file, const char *json_file)
+{
+	bool ret = false, comma = false;
+	char magic[sizeof(PROFILER_MAGIC)] = {0};
+	struct wl_array names;
+	FILE *in = NULL, *out = NULL;
+	uint8_t kind;
+
+	wl_array_init(&names);
+	if (!(in = fopen(trace_file, "rb")) || !(out = fopen(json_file, "w")))
+		goto out;
+	if (fread(magic, 1, strlen(PROFILER_MAGIC), in) !=
+	    strlen(PROFILER_MAGIC) || strcmp(magic, PROFILER_MAGIC))
+		goto out;
+
+	fprintf(out, "{\"otherData\": {},\"traceEvents\":[\n");
+	while (fread(&kind, 1, 1, in) == 1) {
+		if (kind == PROFILER_RECORD_STRING) {
+			struct profiler_file_string record;
+			char **slot, *str;
+
+			record.kind = kind;
+			if (fread((char *)&record + 1, sizeof(record) - 1, 1,
+			          in) != 1)
+				break;
+			if (record.id != names.size / sizeof(char *))
+				goto out;
+			str = calloc(1, record.len + 1);
+			slot = wl_array_add(&names, sizeof(char *));
+			if (!str || !slot ||
+			    fread(str, 1, record.len, in) != record.len) {
+				free(str);
+				goto out;
+			}
+			*slot = str;
+		} else if (kind == PROFILER_RECORD_EVENT) {
+			struct profiler_file_event record;
+			const char *name = "unknown";
+
+			record.kind = kind;
+			if (fread((char *)&record + 1, sizeof(record) - 1, 1,
+			          in) != 1)
+				break;
+			if (record.name < names.size / sizeof(char *))
+				name = ((char **)names.data)[record.name];
+			write_event(out, &record, name, comma);
+			comma = true;
+		} else {
+			goto out;
+		}
+	}
+	fprintf(out, "]}\n");
+	ret = true;
+out:
+	if (names.data) {
+		char **name;
+		wl_array_for_each(name, &names)
+			free(*name);
+	}
+	wl_array_release(&names);
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	return ret;
 }
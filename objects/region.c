@@ -70,7 +70,8 @@ region_destroy_resource(struct wl_resource *resource)
 
 	wl_signal_emit(&region->destroy, region);
 	pixman_region32_fini(&region->region);
-	free(region);
+	assert(region->alloc);
+	region->alloc->free(region, &wl_region_interface);
 }
 
 WL_EXPORT struct tw_region *
@@ -33,8 +33,44 @@
 #include <taiwins/objects/seat.h>
 #include <taiwins/objects/cursor.h>
 
+#define SEAT_CLIENT_BUCKETS 32 /* initial size, power of 2 */
+
 static const struct wl_seat_interface seat_impl;
 
+static inline struct wl_list *
+seat_client_bucket(struct wl_list *buckets, uint32_t size,
+                   struct wl_client *client)
+{
+	uintptr_t v = (uintptr_t)client;
+
+	v ^= v >> 16;
+	v *= 0x45d9f3b;
+	v ^= v >> 16;
+	return &buckets[v & (size - 1)];
+}
+
+static bool
+seat_client_table_init(struct tw_seat *seat, uint32_t size)
+{
+	struct wl_list *buckets = calloc(size, sizeof(*buckets));
+	struct tw_seat_client *s;
+
+	if (!buckets)
+		return false;
+	for (uint32_t i = 0; i < size; i++)
+		wl_list_init(&buckets[i]);
+	//rehash the existing clients
+	wl_list_for_each(s, &seat->clients, link) {
+		wl_list_remove(&s->hash_link);
+		wl_list_insert(seat_client_bucket(buckets, size, s->client),
+		               &s->hash_link);
+	}
+	free(seat->client_table.buckets);
+	seat->client_table.buckets = buckets;
+	seat->client_table.size = size;
+	return true;
+}
+
 static struct tw_seat_client *
 tw_seat_client_new(struct tw_seat *seat, struct wl_client *client)
 {
@@ -49,6 +85,12 @@ tw_seat_client_new(struct tw_seat *seat, struct wl_client *client)
 	wl_list_init(&s->pointers);
 	wl_list_init(&s->touches);
 	wl_list_insert(&seat->clients, &s->link);
+	wl_list_insert(seat_client_bucket(seat->client_table.buckets,
+	                                  seat->client_table.size, client),
+	               &s->hash_link);
+	//keep the chains short, failing to grow only makes lookup slower
+	if (++seat->client_table.count > seat->client_table.size * 2)
+		seat_client_table_init(seat, seat->client_table.size * 2);
 	return s;
 }
 
@@ -242,6 +284,8 @@ handle_client_resource_destroy(struct wl_resource *seat_resource)
 		return;
 
 	wl_list_remove(&sc->link);
+	wl_list_remove(&sc->hash_link);
+	sc->seat->client_table.count--;
 	wl_resource_for_each_safe(resource, tmp, &sc->keyboards)
 		wl_resource_destroy(resource);
 	wl_resource_for_each_safe(resource, tmp, &sc->pointers)
@@ -304,11 +348,27 @@ tw_seat_create(struct wl_display *display, struct tw_cursor *seat_cursor,
 	seat->last_pointer_serial = 0;
 	seat->last_touch_serial = 0;
 	seat->cursor = seat_cursor;
+	seat->keyboard.keymap_fd = -1;
+	if (!seat_client_table_init(seat, SEAT_CLIENT_BUCKETS)) {
+		free(seat);
+		return NULL;
+	}
+	if (!tw_serial_engine_init(&seat->serials, display, TW_SERIAL_DEPTH)) {
+		free(seat->client_table.buckets);
+		free(seat);
+		return NULL;
+	}
 
 	wl_signal_init(&seat->destroy_signal);
 	wl_signal_init(&seat->focus_signal);
 	seat->global = wl_global_create(display, &wl_seat_interface, 7,
 	                                seat, bind_seat);
+	if (!seat->global) {
+		tw_serial_engine_fini(&seat->serials);
+		free(seat->client_table.buckets);
+		free(seat);
+		return NULL;
+	}
 	return seat;
 }
 
@@ -330,6 +390,8 @@ tw_seat_destroy(struct tw_seat *seat)
 				break;
 		}
 	}
+	tw_serial_engine_fini(&seat->serials);
+	free(seat->client_table.buckets);
 	free(seat);
 }
 
@@ -392,9 +454,14 @@ tw_seat_send_capabilities(struct tw_seat *seat)
 WL_EXPORT bool
 tw_seat_valid_serial(struct tw_seat *seat, uint32_t serial)
 {
-	return serial == seat->last_pointer_serial ||
-		serial == seat->last_touch_serial ||
-		serial == seat->last_keyboard_serial;
+	return tw_serial_engine_verify_serial(&seat->serials, serial,
+	                                      TW_SERIAL_ANY);
+}
+
+WL_EXPORT bool
+tw_seat_verify_serial(struct tw_seat *seat, uint32_t serial, uint32_t types)
+{
+	return tw_serial_engine_verify_serial(&seat->serials, serial, types);
 }
 
 WL_EXPORT struct tw_seat_client *
@@ -413,7 +480,11 @@ WL_EXPORT struct tw_seat_client *
 tw_seat_client_find(struct tw_seat *seat, struct wl_client *client)
 {
 	struct tw_seat_client *seat_client = NULL;
-	wl_list_for_each(seat_client, &seat->clients, link) {
+	struct wl_list *bucket =
+		seat_client_bucket(seat->client_table.buckets,
+		                   seat->client_table.size, client);
+
+	wl_list_for_each(seat_client, bucket, hash_link) {
 		if (seat_client->client == client)
 			return seat_client;
 	}
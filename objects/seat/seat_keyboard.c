@@ -57,7 +57,8 @@ notify_keyboard_key(struct tw_seat_keyboard_grab *grab, uint32_t time_msec,
 	uint32_t serial;
 
 	if (client) {
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_KEYBOARD_KEY);
 		wl_resource_for_each(keyboard, &client->keyboards)
 			wl_keyboard_send_key(keyboard, serial, time_msec,
 			                     key, state);
@@ -76,7 +77,8 @@ notify_keyboard_modifiers(struct tw_seat_keyboard_grab *grab,
 	uint32_t serial;
 
 	if (client) {
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_KEYBOARD_MODIFIERS);
 		wl_resource_for_each(keyboard, &client->keyboards)
 			wl_keyboard_send_modifiers(keyboard, serial,
 			                           mods_depressed,
@@ -109,6 +111,18 @@ notify_focused_disappear(struct wl_listener *listener, void *data)
 	wl_list_init(&listener->link);
 }
 
+static void
+keyboard_reset_keymap(struct tw_keyboard *keyboard)
+{
+	if (keyboard->keymap_string)
+		free(keyboard->keymap_string);
+	if (keyboard->keymap_fd >= 0)
+		close(keyboard->keymap_fd);
+	keyboard->keymap_string = NULL;
+	keyboard->keymap_fd = -1;
+	keyboard->keymap_size = 0;
+}
+
 WL_EXPORT struct tw_keyboard *
 tw_seat_new_keyboard(struct tw_seat *seat)
 {
@@ -120,6 +134,7 @@ tw_seat_new_keyboard(struct tw_seat *seat)
 	seat->keyboard.focused_surface = NULL;
 	seat->keyboard.keymap_size = 0;
 	seat->keyboard.keymap_string = NULL;
+	seat->keyboard.keymap_fd = -1;
 
 	seat->keyboard.default_grab.data = NULL;
 	seat->keyboard.default_grab.seat = seat;
@@ -150,10 +165,7 @@ tw_seat_remove_keyboard(struct tw_seat *seat)
 		wl_resource_for_each_safe(resource, next, &client->keyboards)
 			tw_reset_wl_list(wl_resource_get_link(resource));
 
-	if (keyboard->keymap_string)
-		free(keyboard->keymap_string);
-	keyboard->keymap_string = NULL;
-	keyboard->keymap_size = 0;
+	keyboard_reset_keymap(keyboard);
 	keyboard->focused_client = NULL;
 	keyboard->focused_surface = NULL;
 	tw_reset_wl_list(&keyboard->focused_destroy.link);
@@ -184,12 +196,16 @@ tw_keyboard_set_keymap(struct tw_keyboard *keyboard,
 	struct tw_seat_client *client;
 	struct tw_seat *seat = wl_container_of(keyboard, seat, keyboard);
 
-	if (keyboard->keymap_string)
-		free(keyboard->keymap_string);
+	keyboard_reset_keymap(keyboard);
 	keyboard->keymap_string =
 		xkb_keymap_get_as_string(keymap,
 		                         XKB_KEYMAP_FORMAT_TEXT_V1);
-	keyboard->keymap_size = strlen(keyboard->keymap_string);
+	if (!keyboard->keymap_string)
+		return;
+	//serialize once with the terminating null, every client shares it.
+	keyboard->keymap_size = strlen(keyboard->keymap_string) + 1;
+	keyboard->keymap_fd = os_create_sealed_file(keyboard->keymap_string,
+	                                            keyboard->keymap_size);
 
 	//send the keymap to all clients.
 	wl_list_for_each(client, &seat->clients, link) {
@@ -198,34 +214,55 @@ tw_keyboard_set_keymap(struct tw_keyboard *keyboard,
 	}
 }
 
-WL_EXPORT void
-tw_keyboard_send_keymap(struct tw_keyboard *keyboard,
-                        struct wl_resource *resource)
+WL_EXPORT int
+tw_keyboard_acquire_keymap_fd(struct tw_keyboard *keyboard)
 {
 	int keymap_fd;
 	void *ptr;
+
 	if (!keyboard->keymap_string)
-		return;
+		return -1;
+	if (keyboard->keymap_fd >= 0)
+		return keyboard->keymap_fd;
 
+	//no sealing support, every client gets its own copy.
 	keymap_fd = os_create_anonymous_file(keyboard->keymap_size);
 	if (keymap_fd < 0) {
-		tw_logl("error creating kaymap file for %u bytes\n",
+		tw_logl("error creating kaymap file for %zu bytes\n",
 		        keyboard->keymap_size);
-		return;
+		return -1;
 	}
 	ptr = mmap(NULL, keyboard->keymap_size, PROT_READ | PROT_WRITE,
 	           MAP_SHARED, keymap_fd, 0);
 	if (ptr == MAP_FAILED) {
-		tw_logl("error in mmap() for %u bytes\n",
+		tw_logl("error in mmap() for %zu bytes\n",
 		        keyboard->keymap_size);
 		close(keymap_fd);
-		return;
+		return -1;
 	}
-	strcpy(ptr, keyboard->keymap_string);
+	memcpy(ptr, keyboard->keymap_string, keyboard->keymap_size);
 	munmap(ptr, keyboard->keymap_size);
+	return keymap_fd;
+}
+
+WL_EXPORT void
+tw_keyboard_release_keymap_fd(struct tw_keyboard *keyboard, int fd)
+{
+	if (fd >= 0 && fd != keyboard->keymap_fd)
+		close(fd);
+}
+
+WL_EXPORT void
+tw_keyboard_send_keymap(struct tw_keyboard *keyboard,
+                        struct wl_resource *resource)
+{
+	int keymap_fd = tw_keyboard_acquire_keymap_fd(keyboard);
+
+	if (keymap_fd < 0)
+		return;
 	wl_keyboard_send_keymap(resource, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
 	                        keymap_fd, keyboard->keymap_size);
-	close(keymap_fd);
+	tw_keyboard_release_keymap_fd(keyboard, keymap_fd);
 }
 
 WL_EXPORT void
@@ -247,7 +284,8 @@ tw_keyboard_set_focus(struct tw_keyboard *keyboard,
 	if (client && !wl_list_empty(&client->keyboards)) {
 		tw_keyboard_clear_focus(keyboard);
 
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_KEYBOARD_ENTER);
 		wl_resource_for_each(res, &client->keyboards)
 			wl_keyboard_send_enter(res, serial, wl_surface,
 			                       focus_keys);
@@ -271,7 +309,8 @@ tw_keyboard_clear_focus(struct tw_keyboard *keyboard)
 
         if (keyboard->focused_surface && keyboard->focused_client) {
 		client = keyboard->focused_client;
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_KEYBOARD_LEAVE);
 		wl_resource_for_each(res, &client->keyboards)
 			wl_keyboard_send_leave(res, serial,
 			                       keyboard->focused_surface);
@@ -62,7 +62,8 @@ notify_pointer_button(struct tw_seat_pointer_grab *grab,
 	struct tw_seat_client *client = pointer->focused_client;
 	uint32_t serial;
 	if (client) {
-		serial = wl_display_next_serial(grab->seat->display);
+		serial = tw_serial_engine_next_serial(&grab->seat->serials,
+		                                      TW_SERIAL_POINTER_BUTTON);
 		wl_resource_for_each(resource, &client->pointers)
 			wl_pointer_send_button(resource, serial, time_msec,
 			                       button, state);
@@ -187,6 +188,38 @@ tw_seat_remove_pointer(struct tw_seat *seat)
 	pointer->focused_client = NULL;
 	pointer->focused_surface = NULL;
 	tw_reset_wl_list(&pointer->focused_destroy.link);
+	//drop the held events, there is no one to send.
+	pointer->coalesce.motion_pending = false;
+	pointer->coalesce.frame_pending = false;
+	pointer->coalesce.passthrough = false;
+	pointer->coalesce.axis[0].pending = false;
+	pointer->coalesce.axis[1].pending = false;
+}
+
+static void
+pointer_flush_coalesced(struct tw_pointer *pointer, bool with_frame)
+{
+	struct tw_seat_pointer_grab *grab = pointer->grab;
+
+	if (pointer->coalesce.motion_pending && grab && grab->impl->motion)
+		grab->impl->motion(grab, pointer->coalesce.motion_time,
+		                   pointer->coalesce.sx, pointer->coalesce.sy);
+	pointer->coalesce.motion_pending = false;
+
+	for (int i = 0; i < 2; i++) {
+		struct tw_pointer_coalesced_axis *axis =
+			&pointer->coalesce.axis[i];
+		if (axis->pending && grab && grab->impl->axis)
+			grab->impl->axis(grab, axis->time_msec, i,
+			                 axis->value, axis->value_discrete,
+			                 axis->source);
+		axis->pending = false;
+	}
+	if (with_frame && pointer->coalesce.frame_pending &&
+	    grab && grab->impl->frame)
+		grab->impl->frame(grab);
+	if (with_frame)
+		pointer->coalesce.frame_pending = false;
 }
 
 WL_EXPORT void
@@ -195,6 +228,8 @@ tw_pointer_start_grab(struct tw_pointer *pointer,
 {
 	struct tw_seat *seat = wl_container_of(pointer, seat, pointer);
 
+	//held events belong to the previous grab
+	pointer_flush_coalesced(pointer, true);
 	pointer->grab = grab;
 	grab->seat = seat;
 }
@@ -202,6 +237,7 @@ tw_pointer_start_grab(struct tw_pointer *pointer,
 WL_EXPORT void
 tw_pointer_end_grab(struct tw_pointer *pointer)
 {
+	pointer_flush_coalesced(pointer, true);
 	if (pointer->grab && pointer->grab != &pointer->default_grab &&
 	    pointer->grab->impl->cancel)
 		pointer->grab->impl->cancel(pointer->grab);
@@ -222,7 +258,8 @@ tw_pointer_set_focus(struct tw_pointer *pointer,
 	if (client && !wl_list_empty(&client->pointers) ) {
 		tw_pointer_clear_focus(pointer);
 
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_POINTER_ENTER);
 		wl_resource_for_each(res, &client->pointers)
 			wl_pointer_send_enter(res, serial, wl_surface,
 			                      wl_fixed_from_double(sx),
@@ -246,7 +283,8 @@ tw_pointer_clear_focus(struct tw_pointer *pointer)
 
 	if (pointer->focused_surface && pointer->focused_client) {
 		client = pointer->focused_client;
-		serial = wl_display_next_serial(seat->display);
+		serial = tw_serial_engine_next_serial(&seat->serials,
+		                                      TW_SERIAL_POINTER_LEAVE);
 		wl_resource_for_each(res, &client->pointers)
 			wl_pointer_send_leave(res, serial,
 			                      pointer->focused_surface);
@@ -260,14 +298,26 @@ tw_pointer_notify_enter(struct tw_pointer *pointer,
                         struct wl_resource *wl_surface,
                         double sx, double sy)
 {
+	pointer_flush_coalesced(pointer, true);
 	if (pointer->grab && pointer->grab->impl->enter)
 		pointer->grab->impl->enter(pointer->grab, wl_surface, sx, sy);
+	pointer->coalesce.passthrough = true;
 }
 
 WL_EXPORT void
 tw_pointer_notify_motion(struct tw_pointer *pointer, uint32_t time_msec,
                          double sx, double sy)
 {
+	if (pointer->coalesce.mode != TW_POINTER_COALESCE_NONE) {
+		//only the last position matters
+		if (pointer->coalesce.motion_pending)
+			pointer->coalesce.events_saved++;
+		pointer->coalesce.motion_pending = true;
+		pointer->coalesce.motion_time = time_msec;
+		pointer->coalesce.sx = sx;
+		pointer->coalesce.sy = sy;
+		return;
+	}
 	if (pointer->grab && pointer->grab->impl->motion)
 		pointer->grab->impl->motion(pointer->grab, time_msec, sx, sy);
 }
@@ -276,9 +326,12 @@ WL_EXPORT void
 tw_pointer_notify_button(struct tw_pointer *pointer, uint32_t time_msec,
                          uint32_t button, enum wl_pointer_button_state state)
 {
+	//keep the button ordered after the motion leading to it.
+	pointer_flush_coalesced(pointer, true);
 	if (pointer->grab && pointer->grab->impl->button)
 		pointer->grab->impl->button(pointer->grab, time_msec,
 		                                   button, state);
+	pointer->coalesce.passthrough = true;
 }
 
 WL_EXPORT void
@@ -286,14 +339,63 @@ tw_pointer_notify_axis(struct tw_pointer *pointer, uint32_t time_msec,
                        enum wl_pointer_axis axis, double val, int val_disc,
                        enum wl_pointer_axis_source source)
 {
+	struct tw_pointer_coalesced_axis *held =
+		&pointer->coalesce.axis[axis == WL_POINTER_AXIS_HORIZONTAL_SCROLL];
+
+	if (pointer->coalesce.mode != TW_POINTER_COALESCE_NONE && val) {
+		//deltas of the same source add up
+		if (held->pending && held->source == source) {
+			held->value += val;
+			held->value_discrete += val_disc;
+			held->time_msec = time_msec;
+			pointer->coalesce.events_saved++;
+			return;
+		} else if (!held->pending) {
+			held->pending = true;
+			held->value = val;
+			held->value_discrete = val_disc;
+			held->time_msec = time_msec;
+			held->source = source;
+			return;
+		}
+	}
+	//axis stop or a new source, send the held deltas first.
+	pointer_flush_coalesced(pointer, false);
 	if (pointer->grab && pointer->grab->impl->axis)
 		pointer->grab->impl->axis(pointer->grab, time_msec, axis,
 		                          val, val_disc, source);
+	pointer->coalesce.passthrough = true;
 }
 
 WL_EXPORT void
 tw_pointer_notify_frame(struct tw_pointer *pointer)
 {
+	//held frames only carry the coalesced motion and axis
+	if (pointer->coalesce.mode == TW_POINTER_COALESCE_REFRESH &&
+	    !pointer->coalesce.passthrough) {
+		if (pointer->coalesce.frame_pending)
+			pointer->coalesce.events_saved++;
+		pointer->coalesce.frame_pending = true;
+		return;
+	}
+	pointer_flush_coalesced(pointer, false);
+	pointer->coalesce.frame_pending = false;
+	pointer->coalesce.passthrough = false;
 	if (pointer->grab && pointer->grab->impl->frame)
 		pointer->grab->impl->frame(pointer->grab);
 }
+
+WL_EXPORT void
+tw_pointer_set_coalesce_mode(struct tw_pointer *pointer,
+                             enum tw_pointer_coalesce_mode mode)
+{
+	if (mode != pointer->coalesce.mode)
+		pointer_flush_coalesced(pointer, true);
+	pointer->coalesce.mode = mode;
+}
+
+WL_EXPORT void
+tw_pointer_flush_coalesced(struct tw_pointer *pointer)
+{
+	pointer_flush_coalesced(pointer, true);
+}
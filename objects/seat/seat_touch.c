@@ -45,7 +45,8 @@ notify_touch_down(struct tw_seat_touch_grab *grab, uint32_t time_msec,
 	uint32_t serial;
 
         if (touch->focused_client) {
-		serial = wl_display_get_serial(grab->seat->display);
+		serial = tw_serial_engine_next_serial(&grab->seat->serials,
+		                                      TW_SERIAL_TOUCH_DOWN);
 
 		wl_resource_for_each(touch_res,
 		                     &touch->focused_client->touches) {
@@ -70,7 +71,8 @@ notify_touch_up(struct tw_seat_touch_grab *grab, uint32_t time_msec,
 	uint32_t serial;
 
 	if (touch->focused_client) {
-		serial = wl_display_get_serial(grab->seat->display);
+		serial = tw_serial_engine_next_serial(&grab->seat->serials,
+		                                      TW_SERIAL_TOUCH_UP);
 		wl_resource_for_each(touch_res,
 		                     &touch->focused_client->touches) {
 			wl_touch_send_up(touch_res, serial, time_msec,
@@ -20,42 +20,115 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
+#include <wayland-server-core.h>
 #include <wayland-util.h>
 #include <taiwins/objects/serial_engine.h>
 
+static inline uint32_t
+serial_hash(struct tw_serial_engine *engine, uint32_t serial)
+{
+	return (serial * 2654435761u) >> 16 & (engine->depth - 1);
+}
 
-WL_EXPORT void
-tw_serial_engine_init(struct tw_serial_engine *engine)
+static void
+serial_engine_unlink(struct tw_serial_engine *engine, int32_t idx)
+{
+	int32_t *prev =
+		&engine->buckets[serial_hash(engine, engine->slots[idx].serial)];
+
+	while (*prev != -1 && *prev != idx)
+		prev = &engine->slots[*prev].next;
+	if (*prev == idx)
+		*prev = engine->slots[idx].next;
+}
+
+static inline bool
+serial_engine_in_window(struct tw_serial_engine *engine, uint32_t serial)
+{
+	uint32_t oldest = engine->slots[(engine->head - engine->count) &
+	                                 (engine->depth - 1)].serial;
+	//unsigned distance handles the wraparound of serials
+	return engine->count &&
+		engine->curr_serial - serial <= engine->curr_serial - oldest;
+}
+
+WL_EXPORT bool
+tw_serial_engine_init(struct tw_serial_engine *engine,
+                      struct wl_display *display, uint32_t depth)
 {
+	uint32_t size = 1;
+
+	depth = depth ? depth : TW_SERIAL_DEPTH;
+	depth = depth > TW_SERIAL_MAX_DEPTH ? TW_SERIAL_MAX_DEPTH : depth;
+	while (size < depth)
+		size <<= 1;
+
+	engine->display = display;
 	engine->curr_serial = 0;
-	wl_list_init(&engine->serials);
-	for (int i = 0; i < TW_SERIAL_DEPTH; i++) {
-		engine->lasts[i].serial = 0;
-		wl_list_init(&engine->lasts[i].link);
-		wl_list_insert(engine->serials.prev, &engine->lasts[i].link);
+	engine->depth = size;
+	engine->head = 0;
+	engine->count = 0;
+	engine->slots = calloc(size, sizeof(*engine->slots));
+	engine->buckets = calloc(size, sizeof(*engine->buckets));
+	if (!engine->slots || !engine->buckets) {
+		tw_serial_engine_fini(engine);
+		return false;
 	}
+	for (uint32_t i = 0; i < size; i++)
+		engine->buckets[i] = -1;
+	return true;
+}
+
+WL_EXPORT void
+tw_serial_engine_fini(struct tw_serial_engine *engine)
+{
+	free(engine->slots);
+	free(engine->buckets);
+	engine->slots = NULL;
+	engine->buckets = NULL;
+	engine->count = 0;
 }
 
 WL_EXPORT uint32_t
-tw_serial_engine_next_serial(struct tw_serial_engine *engine)
+tw_serial_engine_next_serial(struct tw_serial_engine *engine,
+                             enum tw_serial_type type)
 {
-	struct tw_serial_slot *slot =
-		wl_container_of(engine->serials.prev, slot, link);
-	wl_list_remove(&slot->link);
-	engine->curr_serial += 1;
+	int32_t idx = engine->head & (engine->depth - 1);
+	struct tw_serial_slot *slot = &engine->slots[idx];
+	uint32_t hash;
+
+	//the oldest one is overwritten
+	if (engine->count == engine->depth)
+		serial_engine_unlink(engine, idx);
+	else
+		engine->count++;
+
+	engine->curr_serial = engine->display ?
+		wl_display_next_serial(engine->display) :
+		engine->curr_serial + 1;
+	hash = serial_hash(engine, engine->curr_serial);
 	slot->serial = engine->curr_serial;
-	wl_list_insert(&engine->serials, &slot->link);
+	slot->type = type;
+	slot->next = engine->buckets[hash];
+	engine->buckets[hash] = idx;
+	engine->head++;
+
 	return engine->curr_serial;
 }
 
 WL_EXPORT bool
 tw_serial_engine_verify_serial(struct tw_serial_engine *engine,
-                               uint32_t serial)
+                               uint32_t serial, uint32_t types)
 {
-	struct tw_serial_slot *slot = NULL;
-	wl_list_for_each(slot, &engine->serials, link) {
-		if (slot->serial == serial)
-			return true;
+	int32_t idx;
+
+	if (!serial_engine_in_window(engine, serial))
+		return false;
+	for (idx = engine->buckets[serial_hash(engine, serial)]; idx != -1;
+	     idx = engine->slots[idx].next) {
+		if (engine->slots[idx].serial == serial)
+			return (engine->slots[idx].type & types) != 0;
 	}
 	return false;
 }
@@ -0,0 +1,402 @@
+/*
+ * shm_upload.c - taiwins asynchronous shm upload
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <wayland-server.h>
+#include <pixman.h>
+
+#include <taiwins/objects/logger.h>
+#include <taiwins/objects/utils.h>
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/pixel_convert.h>
+#include <taiwins/objects/shm_upload.h>
+
+struct tw_shm_upload_job {
+	struct wl_list link;
+	struct tw_shm_staging *staging;
+	/* NULL once the client destroyed the buffer */
+	struct wl_resource *wl_buffer;
+	struct wl_shm_buffer *shm;
+	/* pinned so resizing the pool does not remap it under the worker */
+	struct wl_shm_pool *pool;
+	struct wl_listener buffer_destroy;
+
+	uint32_t format;
+	int width, height, stride;
+	bool full;
+	pixman_region32_t damage;
+};
+
+static void
+upload_job_destroy(struct tw_shm_upload_job *job)
+{
+	if (job->wl_buffer) {
+		wl_buffer_send_release(job->wl_buffer);
+		tw_reset_wl_list(&job->buffer_destroy.link);
+	}
+	if (job->pool)
+		wl_shm_pool_unref(job->pool);
+	pixman_region32_fini(&job->damage);
+	free(job);
+}
+
+static void
+notify_upload_job_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct tw_shm_upload_job *job =
+		wl_container_of(listener, job, buffer_destroy);
+	struct tw_shm_uploader *uploader = job->staging->uploader;
+
+	//the worker may still be reading the buffer, wait for it
+	pthread_mutex_lock(&uploader->lock);
+	while (uploader->running == job)
+		pthread_cond_wait(&uploader->job_cond, &uploader->lock);
+	job->shm = NULL;
+	job->wl_buffer = NULL;
+	pthread_mutex_unlock(&uploader->lock);
+	tw_reset_wl_list(&job->buffer_destroy.link);
+}
+
+/******************************************************************************
+ * worker
+ *****************************************************************************/
+
+static void
+staging_copy_stale(struct tw_shm_staging *staging)
+{
+	struct tw_shm_staging_buffer *front = &staging->front;
+	struct tw_shm_staging_buffer *back = &staging->back;
+	pixman_box32_t *boxes;
+	int n;
+
+	boxes = pixman_region32_rectangles(&staging->stale, &n);
+	for (int i = 0; i < n; i++) {
+		size_t offset = boxes[i].x1 * 4;
+		size_t size = (boxes[i].x2 - boxes[i].x1) * 4;
+
+		for (int y = boxes[i].y1; y < boxes[i].y2; y++)
+			memcpy((uint8_t *)back->data + y * back->stride + offset,
+			       (uint8_t *)front->data + y * front->stride +
+			       offset, size);
+	}
+}
+
+static bool
+upload_job_run(struct tw_shm_upload_job *job)
+{
+	struct tw_shm_staging *staging = job->staging;
+	struct tw_shm_staging_buffer *back = &staging->back;
+	bool full = job->full, ret;
+	void *data;
+
+	if (back->width != job->width || back->height != job->height) {
+		data = realloc(back->data, (size_t)job->width * 4 *
+		               job->height);
+		if (!data)
+			return false;
+		back->data = data;
+		back->width = job->width;
+		back->height = job->height;
+		back->stride = job->width * 4;
+		full = true;
+	}
+	//bring the back buffer up to date with the front first
+	if (staging->front.width != job->width ||
+	    staging->front.height != job->height)
+		full = true;
+	if (!full)
+		staging_copy_stale(staging);
+	pixman_region32_clear(&staging->stale);
+
+	back->has_alpha = job->format == WL_SHM_FORMAT_ARGB8888 ||
+		job->format == WL_SHM_FORMAT_ABGR8888;
+	wl_shm_buffer_begin_access(job->shm);
+	ret = tw_pixel_convert_to_argb8888(job->format,
+	                                   wl_shm_buffer_get_data(job->shm),
+	                                   job->stride, job->width,
+	                                   job->height, back->data,
+	                                   back->stride,
+	                                   full ? NULL : &job->damage);
+	wl_shm_buffer_end_access(job->shm);
+	if (full)
+		pixman_region32_union_rect(&job->damage, &job->damage, 0, 0,
+		                           job->width, job->height);
+	return ret;
+}
+
+/* the first queued job whose staging has no finished upload waiting for the
+ * swap, writing the back buffer again would delay the swap indefinitely. */
+static struct tw_shm_upload_job *
+uploader_next_job(struct tw_shm_uploader *uploader)
+{
+	struct tw_shm_upload_job *job;
+
+	wl_list_for_each(job, &uploader->queued, link)
+		if (!job->staging->back_dirty)
+			return job;
+	return NULL;
+}
+
+static void *
+uploader_thread(void *data)
+{
+	struct tw_shm_uploader *uploader = data;
+	struct tw_shm_upload_job *job;
+	uint64_t one = 1;
+	bool done;
+
+	pthread_mutex_lock(&uploader->lock);
+	while (!uploader->quit) {
+		if (!(job = uploader_next_job(uploader))) {
+			pthread_cond_wait(&uploader->work_cond,
+			                  &uploader->lock);
+			continue;
+		}
+		wl_list_remove(&job->link);
+		uploader->running = job;
+		pthread_mutex_unlock(&uploader->lock);
+
+		done = job->shm && upload_job_run(job);
+
+		pthread_mutex_lock(&uploader->lock);
+		if (done) {
+			pixman_region32_union(&job->staging->damage,
+			                      &job->staging->damage,
+			                      &job->damage);
+			job->staging->back_dirty = true;
+		}
+		uploader->running = NULL;
+		wl_list_insert(uploader->done.prev, &job->link);
+		pthread_cond_broadcast(&uploader->job_cond);
+		if (write(uploader->eventfd, &one, sizeof(one)) < 0)
+			tw_logl_level(TW_LOG_WARN, "failed to notify upload");
+	}
+	pthread_mutex_unlock(&uploader->lock);
+	return NULL;
+}
+
+/******************************************************************************
+ * main thread
+ *****************************************************************************/
+
+/* swap in the back buffer if it has finished uploads and the worker is not
+ * writing it, the queued uploads of the staging continue on the new back. */
+static void
+staging_swap(struct tw_shm_staging *staging)
+{
+	struct tw_shm_uploader *uploader = staging->uploader;
+	struct tw_shm_staging_buffer tmp;
+	pixman_region32_t damage;
+
+	pthread_mutex_lock(&uploader->lock);
+	if (!staging->back_dirty ||
+	    (uploader->running && uploader->running->staging == staging)) {
+		pthread_mutex_unlock(&uploader->lock);
+		return;
+	}
+	tmp = staging->front;
+	staging->front = staging->back;
+	staging->back = tmp;
+	staging->back_dirty = false;
+	//the old front misses what just got uploaded
+	pixman_region32_copy(&staging->stale, &staging->damage);
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &staging->damage);
+	pixman_region32_clear(&staging->damage);
+	//the queued uploads of the staging can go now
+	pthread_cond_signal(&uploader->work_cond);
+	pthread_mutex_unlock(&uploader->lock);
+
+	wl_signal_emit(&staging->signals.ready, &damage);
+	pixman_region32_fini(&damage);
+}
+
+static int
+handle_uploads_done(int fd, uint32_t mask, void *data)
+{
+	struct tw_shm_uploader *uploader = data;
+	struct tw_shm_upload_job *job, *tmp;
+	struct tw_shm_staging *staging;
+	struct wl_list done;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0)
+		return 0;
+
+	wl_list_init(&done);
+	pthread_mutex_lock(&uploader->lock);
+	wl_list_insert_list(&done, &uploader->done);
+	wl_list_init(&uploader->done);
+	pthread_mutex_unlock(&uploader->lock);
+
+	wl_list_for_each_safe(job, tmp, &done, link) {
+		staging = job->staging;
+		upload_job_destroy(job);
+		staging->pending--;
+		//a running upload of the staging swaps when it is done
+		staging_swap(staging);
+	}
+	return 0;
+}
+
+WL_EXPORT bool
+tw_shm_uploader_init(struct tw_shm_uploader *uploader,
+                     struct wl_display *display)
+{
+	struct wl_event_loop *loop = wl_display_get_event_loop(display);
+
+	memset(uploader, 0, sizeof(*uploader));
+	wl_list_init(&uploader->queued);
+	wl_list_init(&uploader->done);
+	uploader->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (uploader->eventfd < 0)
+		return false;
+	uploader->event = wl_event_loop_add_fd(loop, uploader->eventfd,
+	                                       WL_EVENT_READABLE,
+	                                       handle_uploads_done, uploader);
+	if (!uploader->event)
+		goto err_event;
+
+	pthread_mutex_init(&uploader->lock, NULL);
+	pthread_cond_init(&uploader->work_cond, NULL);
+	pthread_cond_init(&uploader->job_cond, NULL);
+	if (pthread_create(&uploader->thread, NULL, uploader_thread,
+	                   uploader) != 0)
+		goto err_thread;
+	return true;
+err_thread:
+	pthread_cond_destroy(&uploader->job_cond);
+	pthread_cond_destroy(&uploader->work_cond);
+	pthread_mutex_destroy(&uploader->lock);
+	wl_event_source_remove(uploader->event);
+err_event:
+	close(uploader->eventfd);
+	return false;
+}
+
+WL_EXPORT void
+tw_shm_uploader_fini(struct tw_shm_uploader *uploader)
+{
+	struct tw_shm_upload_job *job, *tmp;
+
+	pthread_mutex_lock(&uploader->lock);
+	uploader->quit = true;
+	pthread_cond_signal(&uploader->work_cond);
+	pthread_mutex_unlock(&uploader->lock);
+	pthread_join(uploader->thread, NULL);
+
+	wl_list_insert_list(&uploader->done, &uploader->queued);
+	wl_list_for_each_safe(job, tmp, &uploader->done, link) {
+		job->staging->pending--;
+		upload_job_destroy(job);
+	}
+	wl_event_source_remove(uploader->event);
+	close(uploader->eventfd);
+	pthread_cond_destroy(&uploader->job_cond);
+	pthread_cond_destroy(&uploader->work_cond);
+	pthread_mutex_destroy(&uploader->lock);
+}
+
+WL_EXPORT void
+tw_shm_staging_init(struct tw_shm_staging *staging,
+                    struct tw_shm_uploader *uploader)
+{
+	memset(staging, 0, sizeof(*staging));
+	staging->uploader = uploader;
+	pixman_region32_init(&staging->stale);
+	pixman_region32_init(&staging->damage);
+	wl_signal_init(&staging->signals.ready);
+}
+
+WL_EXPORT void
+tw_shm_staging_fini(struct tw_shm_staging *staging)
+{
+	struct tw_shm_uploader *uploader = staging->uploader;
+	struct tw_shm_upload_job *job, *tmp;
+	struct wl_list dropped;
+
+	wl_list_init(&dropped);
+	pthread_mutex_lock(&uploader->lock);
+	while (uploader->running && uploader->running->staging == staging)
+		pthread_cond_wait(&uploader->job_cond, &uploader->lock);
+	wl_list_for_each_safe(job, tmp, &uploader->queued, link)
+		if (job->staging == staging) {
+			wl_list_remove(&job->link);
+			wl_list_insert(&dropped, &job->link);
+		}
+	wl_list_for_each_safe(job, tmp, &uploader->done, link)
+		if (job->staging == staging) {
+			wl_list_remove(&job->link);
+			wl_list_insert(&dropped, &job->link);
+		}
+	pthread_mutex_unlock(&uploader->lock);
+
+	wl_list_for_each_safe(job, tmp, &dropped, link)
+		upload_job_destroy(job);
+	free(staging->front.data);
+	free(staging->back.data);
+	pixman_region32_fini(&staging->stale);
+	pixman_region32_fini(&staging->damage);
+	staging->pending = 0;
+}
+
+WL_EXPORT bool
+tw_shm_staging_queue(struct tw_shm_staging *staging,
+                     struct tw_event_buffer_uploading *event)
+{
+	struct tw_shm_uploader *uploader = staging->uploader;
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+	struct tw_shm_upload_job *job;
+
+	if (!shm || !tw_pixel_convert_supported(wl_shm_buffer_get_format(shm)))
+		return false;
+	if (!(job = calloc(1, sizeof(*job))))
+		return false;
+	job->staging = staging;
+	job->wl_buffer = event->wl_buffer;
+	job->shm = shm;
+	job->pool = wl_shm_buffer_ref_pool(shm);
+	job->format = wl_shm_buffer_get_format(shm);
+	job->width = wl_shm_buffer_get_width(shm);
+	job->height = wl_shm_buffer_get_height(shm);
+	job->stride = wl_shm_buffer_get_stride(shm);
+	job->full = event->new_upload || !event->damages;
+	pixman_region32_init(&job->damage);
+	if (!job->full)
+		pixman_region32_copy(&job->damage, event->damages);
+	job->buffer_destroy.notify = notify_upload_job_buffer_destroy;
+	wl_resource_add_destroy_listener(event->wl_buffer,
+	                                 &job->buffer_destroy);
+	staging->pending++;
+
+	pthread_mutex_lock(&uploader->lock);
+	wl_list_insert(uploader->queued.prev, &job->link);
+	pthread_cond_signal(&uploader->work_cond);
+	pthread_mutex_unlock(&uploader->lock);
+
+	event->release_deferred = true;
+	return true;
+}
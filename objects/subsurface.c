@@ -33,7 +33,7 @@
 static const struct wl_subsurface_interface subsurface_impl;
 
 void
-subsurface_commit_for_parent(struct tw_subsurface *subsurface, bool sync);
+subsurface_commit_cached(struct tw_subsurface *subsurface);
 
 static void subsurface_commit_role(struct tw_surface *surf) {
 	struct tw_subsurface *sub = surf->role.commit_private;
@@ -165,7 +165,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 	if (subsurface->sync) {
 		subsurface->sync = false;
 		if (!tw_subsurface_is_synched(subsurface))
-			subsurface_commit_for_parent(subsurface, true);
+			subsurface_commit_cached(subsurface);
 	}
 }
 
@@ -212,7 +212,8 @@ subsurface_destroy(struct tw_subsurface *subsurface)
 		subsurface_unset_role(subsurface);
 
 	subsurface->parent = NULL;
-	free(subsurface);
+	assert(subsurface->alloc);
+	subsurface->alloc->free(subsurface, &wl_subsurface_interface);
 }
 
 static void
@@ -31,11 +31,14 @@
 #include <wayland-util.h>
 #include <taiwins/objects/matrix.h>
 #include <taiwins/objects/utils.h>
+#include <taiwins/objects/profiler.h>
 #include <taiwins/objects/surface.h>
 
 #define CALLBACK_VERSION 1
 #define SURFACE_VERSION 4
 
+static uint32_t s_surface_trace_id = 0;
+
 /******************************************************************************
  * wl_surface implementation
  *****************************************************************************/
@@ -221,6 +224,124 @@ surface_buffer_has_transform(struct tw_view *current)
 	        surface_has_scale(current));
 }
 
+/* without viewporter, the damage conversion only involves wl_output_transform
+ * and integer buffer scale, which we can do in exact integer precision. */
+static inline bool
+surface_buffer_has_exact_transform(struct tw_view *current)
+{
+	return !surface_has_crop(current) && !surface_has_scale(current);
+}
+
+/* tw_mat3_wl_transform_boxes and tw_mat3_transform_rect in y-down follow the
+ * y-up matrices, in which flipped 90 and flipped 270 are swapped from the
+ * wl_surface.set_buffer_transform semantics, this is the one moving surface
+ * coordinates to buffer in them. */
+static inline enum wl_output_transform
+surface_to_buffer_transform(enum wl_output_transform transform)
+{
+	if (transform == WL_OUTPUT_TRANSFORM_FLIPPED_90)
+		return WL_OUTPUT_TRANSFORM_FLIPPED_270;
+	else if (transform == WL_OUTPUT_TRANSFORM_FLIPPED_270)
+		return WL_OUTPUT_TRANSFORM_FLIPPED_90;
+	return transform;
+}
+
+static inline enum wl_output_transform
+surface_invert_transform(enum wl_output_transform transform)
+{
+	//only 90 and 270 are not self inverse
+	if (transform == WL_OUTPUT_TRANSFORM_90)
+		return WL_OUTPUT_TRANSFORM_270;
+	else if (transform == WL_OUTPUT_TRANSFORM_270)
+		return WL_OUTPUT_TRANSFORM_90;
+	return transform;
+}
+
+static inline int32_t
+div_floor(int32_t a, int32_t b)
+{
+	return (a >= 0) ? (a / b) : -((-a + b - 1) / b);
+}
+
+static inline int32_t
+div_ceil(int32_t a, int32_t b)
+{
+	return -div_floor(-a, b);
+}
+
+#define SURFACE_DAMAGE_STACK_RECTS 64
+
+/* transform all the boxes of src into dst in one pass, dst is replaced */
+static void
+surface_damage_exact_transform(pixman_region32_t *dst, pixman_region32_t *src,
+                               enum wl_output_transform transform,
+                               int32_t width, int32_t height,
+                               int32_t scale, bool upscale)
+{
+	int n;
+	pixman_box32_t stack_boxes[SURFACE_DAMAGE_STACK_RECTS];
+	pixman_box32_t *boxes = stack_boxes;
+	pixman_box32_t *rects = pixman_region32_rectangles(src, &n);
+
+	if (n > SURFACE_DAMAGE_STACK_RECTS)
+		boxes = malloc(n * sizeof(pixman_box32_t));
+	if (!boxes)
+		return;
+	if (upscale) {
+		tw_mat3_wl_transform_boxes(boxes, rects, n, transform,
+		                           width, height);
+		for (int i = 0; scale != 1 && i < n; i++) {
+			boxes[i].x1 *= scale;
+			boxes[i].y1 *= scale;
+			boxes[i].x2 *= scale;
+			boxes[i].y2 *= scale;
+		}
+	} else {
+		//rounding outwards so we never lose damage
+		for (int i = 0; i < n; i++) {
+			boxes[i].x1 = div_floor(rects[i].x1, scale);
+			boxes[i].y1 = div_floor(rects[i].y1, scale);
+			boxes[i].x2 = div_ceil(rects[i].x2, scale);
+			boxes[i].y2 = div_ceil(rects[i].y2, scale);
+		}
+		tw_mat3_wl_transform_boxes(boxes, boxes, n, transform,
+		                           width, height);
+	}
+	pixman_region32_fini(dst);
+	pixman_region32_init_rects(dst, boxes, n);
+
+	if (boxes != stack_boxes)
+		free(boxes);
+}
+
+/* surface to buffer is the same transform surface_to_buffer is built from,
+ * buffer to surface in surface_update_damage is the inverse of it. */
+static void
+surface_to_buffer_damage_exact(struct tw_surface *surface,
+                               pixman_region32_t *surface_damage)
+{
+	struct tw_view *view = surface->current;
+	int32_t scale = view->buffer_scale;
+	int32_t width = surface->buffer.width / scale;
+	int32_t height = surface->buffer.height / scale;
+	enum wl_output_transform transform =
+		surface_to_buffer_transform(view->transform);
+	pixman_region32_t buffer_damage;
+
+	//the source space is the surface, rotated from the buffer
+	if (view->transform & WL_OUTPUT_TRANSFORM_90) {
+		int32_t tmp = width;
+		width = height;
+		height = tmp;
+	}
+	pixman_region32_init(&buffer_damage);
+	surface_damage_exact_transform(&buffer_damage, surface_damage,
+	                               transform, width, height, scale, true);
+	pixman_region32_union(&view->buffer_damage, &view->buffer_damage,
+	                      &buffer_damage);
+	pixman_region32_fini(&buffer_damage);
+}
+
 static void
 surface_to_buffer_damage(struct tw_surface *surface)
 {
@@ -243,6 +364,8 @@ surface_to_buffer_damage(struct tw_surface *surface)
 		pixman_region32_union(&surface->current->buffer_damage,
 		                      &surface->current->buffer_damage,
 		                      &surface_damage);
+	} else if (surface_buffer_has_exact_transform(view)) {
+		surface_to_buffer_damage_exact(surface, &surface_damage);
 	} else {
 		rects = pixman_region32_rectangles(&surface_damage, &n);
 		for (int i = 0; i < n; i++) {
@@ -265,14 +388,23 @@ static void
 surface_build_buffer_matrix(struct tw_surface *surface)
 {
 	struct tw_view *current = surface->current;
-	float src_width, src_height, dst_width, dst_height;
+	int32_t scale = current->buffer_scale;
+	float width, height, src_width, src_height, dst_width, dst_height;
 	struct tw_mat3 tmp, *transform = &current->surface_to_buffer;
 
 	//generate a matrix move surface coordinates to buffer
-	//1. get the surface dimension, make sure surface has a buffer
+	//1. the buffer dimension in surface coordinates
+	width = surface->buffer.width / scale;
+	height = surface->buffer.height / scale;
+	if (current->transform & WL_OUTPUT_TRANSFORM_90) {
+		float t = width;
+		width = height;
+		height = t;
+	}
+	//2. the source rect of the viewport
 	if (!current->crop.w || !current->crop.h) {
-		src_width = surface->buffer.width;
-		src_height = surface->buffer.height;
+		src_width = width;
+		src_height = height;
 	} else {
 		src_width = current->crop.w;
 		src_height = current->crop.h;
@@ -294,11 +426,26 @@ surface_build_buffer_matrix(struct tw_surface *surface)
 		tw_mat3_translate(&tmp, current->crop.x, current->crop.y);
 		tw_mat3_multiply(transform, &tmp, transform);
 	}
-	tw_mat3_transform_rect(&tmp, current->transform, false, //ydown
-	                       src_width, src_height, current->buffer_scale);
+	//3. into the buffer, which the client transformed and scaled
+	tw_mat3_transform_rect(&tmp, false, //ydown
+	                       surface_to_buffer_transform(current->transform),
+	                       width, height, scale);
 	tw_mat3_multiply(transform, &tmp, transform);
 }
 
+static inline void
+surface_simplify_damage(struct tw_surface *surface, pixman_region32_t *damage,
+                        struct tw_damage_stats *stats)
+{
+	const struct tw_damage_policy *policy = surface->damage.policy;
+
+	if (!policy || (!policy->merge_waste && !policy->max_rects))
+		return;
+	tw_damage_simplify(damage, policy, stats);
+}
+
+/* the buffer damage is simplified once it has the surface damage, the stats
+ * count it once per commit */
 static void
 surface_update_buffer(struct tw_surface *surface)
 {
@@ -311,9 +458,13 @@ surface_update_buffer(struct tw_surface *surface)
 		tw_surface_buffer_release(&surface->buffer);
 		surface->previous->buffer_resource = NULL;
 	}
-	//if there is no buffer for us, we can leave
-	if (!resource)
+	//if there is no buffer for us, we can leave, a NULL attach unmaps
+	if (!resource) {
+		if (surface->current->commit_state & TW_SURFACE_ATTACHED)
+			surface->is_mapped = false;
 		return;
+	}
+	surface->is_mapped = true;
 
 	//try to update the texture
 	if (tw_surface_has_texture(surface)) {
@@ -324,6 +475,8 @@ surface_update_buffer(struct tw_surface *surface)
 
 		surface_build_buffer_matrix(surface);
 		surface_to_buffer_damage(surface);
+		surface_simplify_damage(surface, damage,
+		                        surface->damage.stats);
 		//if updating did not work, we need to re-new the surface
 		if (!tw_surface_buffer_update(&surface->buffer, resource,
 		                              damage)) {
@@ -333,6 +486,7 @@ surface_update_buffer(struct tw_surface *surface)
 			tw_surface_buffer_new(&surface->buffer, resource);
 			surface_build_buffer_matrix(surface);
 			surface_to_buffer_damage(surface);
+			surface_simplify_damage(surface, damage, NULL);
 		}
 		pixman_region32_fini(&buffer_damage);
 
@@ -340,6 +494,8 @@ surface_update_buffer(struct tw_surface *surface)
 		tw_surface_buffer_new(&surface->buffer, resource);
 		surface_build_buffer_matrix(surface);
 		surface_to_buffer_damage(surface);
+		surface_simplify_damage(surface, damage,
+		                        surface->damage.stats);
 	}
 	//release the buffer now.
 	if (surface->buffer.resource) {
@@ -394,8 +550,10 @@ surface_build_geometry_matrix(struct tw_surface *surface)
 	tw_mat3_inverse(inverse, transform);
 }
 
-static void
-surface_update_geometry(struct tw_surface *surface)
+/* build the geometry for the surface alone and accumulate the old and new
+ * bounding box into the dirty region, returns true if the bbox changed. */
+static bool
+surface_update_geometry_local(struct tw_surface *surface)
 {
 	pixman_box32_t box = {-1, -1, 1, 1};
 	//update new geometry
@@ -417,8 +575,22 @@ surface_update_geometry(struct tw_surface *surface)
 		surface->geometry.xywh.y = box.y1;
 		surface->geometry.xywh.width = box.x2-box.x1;
 		surface->geometry.xywh.height = box.y2-box.y1;
-		tw_surface_dirty_geometry(surface);
+		pixman_region32_union_rect(&surface->geometry.dirty,
+		                           &surface->geometry.dirty,
+		                           surface->geometry.xywh.x,
+		                           surface->geometry.xywh.y,
+		                           surface->geometry.xywh.width,
+		                           surface->geometry.xywh.height);
+		return true;
 	}
+	return false;
+}
+
+static void
+surface_update_geometry(struct tw_surface *surface)
+{
+	if (surface_update_geometry_local(surface))
+		tw_surface_dirty_geometry(surface);
 }
 
 /* surface_buffer_to_surface_damage */
@@ -434,14 +606,27 @@ surface_update_damage(struct tw_surface *surface)
 	if (!pixman_region32_not_empty(&view->buffer_damage))
 		return;
 
-	tw_mat3_inverse(&inverse, &view->surface_to_buffer);
 	pixman_region32_clear(&view->surface_damage);
 	if (!surface_buffer_has_transform(view)) {
 		pixman_region32_translate(&view->buffer_damage,
 		                          -view->dx, -view->dy);
 		pixman_region32_copy(&view->surface_damage,
 		                     &view->buffer_damage);
+	} else if (surface_buffer_has_exact_transform(view)) {
+		enum wl_output_transform transform =
+			surface_to_buffer_transform(view->transform);
+
+		transform = surface_invert_transform(transform);
+		surface_damage_exact_transform(&view->surface_damage,
+		                               &view->buffer_damage,
+		                               transform,
+		                               surface->buffer.width /
+		                               view->buffer_scale,
+		                               surface->buffer.height /
+		                               view->buffer_scale,
+		                               view->buffer_scale, false);
 	} else {
+		tw_mat3_inverse(&inverse, &view->surface_to_buffer);
 		rects = pixman_region32_rectangles(&view->buffer_damage,&n);
 		for (int i = 0; i < n; i++) {
 			tw_mat3_vec_transform(&inverse,
@@ -470,15 +655,17 @@ surface_copy_state(struct tw_view *dst, struct tw_view *src)
 	pixman_region32_copy(&dst->opaque_region, &src->opaque_region);
 }
 
-static void
-surface_commit_state(struct tw_surface *surface)
+/* rotate the views and apply the pending state, returns false if there is
+ * nothing to commit. */
+static bool
+surface_commit_view(struct tw_surface *surface)
 {
 	struct tw_view *committed = surface->current;
 	struct tw_view *pending = surface->pending;
 	struct tw_view *previous = surface->previous;
 
 	if (!surface->pending->commit_state)
-		return;
+		return false;
 
         surface->current = pending;
 	surface->previous = committed;
@@ -488,10 +675,21 @@ surface_commit_state(struct tw_surface *surface)
 	pixman_region32_clear(&surface->pending->surface_damage);
 	pixman_region32_clear(&surface->pending->buffer_damage);
 	surface_copy_state(surface->pending, surface->current);
+	//less to transform, not counted, it is only half of the damage
+	surface_simplify_damage(surface, &surface->current->surface_damage,
+	                        NULL);
 
 	surface_update_buffer(surface);
-	surface_update_geometry(surface);
 	surface_update_damage(surface);
+	return true;
+}
+
+static void
+surface_commit_state(struct tw_surface *surface)
+{
+	if (!surface_commit_view(surface))
+		return;
+	surface_update_geometry(surface);
 
 	if (pixman_region32_not_empty(&surface->current->surface_damage))
 		wl_signal_emit(&surface->signals.dirty, surface);
@@ -500,65 +698,162 @@ surface_commit_state(struct tw_surface *surface)
 		surface->role.commit(surface);
 }
 
-void
-subsurface_commit_for_parent(struct tw_subsurface *subsurface, bool sync)
+static void
+surface_commit_subsurface_order(struct tw_surface *surface)
+{
+	struct tw_subsurface *subsurface;
+
+	wl_list_for_each_reverse(subsurface, &surface->subsurfaces_pending,
+	                         parent_pending_link) {
+		wl_list_remove(&subsurface->parent_link);
+		wl_list_insert(&surface->subsurfaces,
+		               &subsurface->parent_link);
+	}
+}
+
+/******************************************************************************
+ * surface transaction
+ *
+ * A commit on a surface with synchronized subsurfaces commits the whole tree
+ * atomically. Instead of committing every child recursively (which rebuilds
+ * the geometry of a subtree once per level), the transaction collects the
+ * surfaces in the tree top-down, then applies the state in passes: views and
+ * buffers first, then geometry once per surface with parents before children,
+ * finally the dirty signals and role commits.
+ *****************************************************************************/
+
+struct surface_transaction_entry {
+	struct tw_surface *surface;
+	bool committed;
+	bool moved;
+};
+
+struct surface_transaction {
+	struct wl_array entries;
+};
+
+static void
+surface_transaction_collect(struct surface_transaction *transaction,
+                            struct tw_surface *surface)
 {
-	//I feel like the logic here is not right at all. But I don't know,
-	//handling subsurfaces is, in any case, we do not have test example
-	//here, so I cannot be sure.
 	struct tw_subsurface *child;
-	struct tw_surface *surface = subsurface->surface;
-	if (sync && subsurface->sync) {
-		//we do not have a change state like in wlroots, instead, the
-		//pending state does not commit if we are in sync.
-		surface_commit_state(surface);
-		wl_list_for_each(child, &surface->subsurfaces, parent_link)
-			subsurface_commit_for_parent(child, true);
+	struct surface_transaction_entry *entry =
+		wl_array_add(&transaction->entries, sizeof(*entry));
+
+	if (!entry) {
+		wl_resource_post_no_memory(surface->resource);
+		return;
 	}
+	entry->surface = surface;
+	entry->committed = surface->pending->commit_state != 0;
+	entry->moved = false;
+	//the stacking order is also the state of parent.
+	surface_commit_subsurface_order(surface);
+
+	wl_list_for_each(child, &surface->subsurfaces, parent_link)
+		if (child->sync)
+			surface_transaction_collect(transaction,
+			                            child->surface);
 }
 
-static inline bool
-surface_commit_as_subsurface(struct tw_surface *surface, bool forced)
+/* placing the subsurface relative to its parent, parent's geometry is always
+ * updated before its children in a transaction. */
+static inline void
+surface_transaction_place(struct tw_surface *surface)
 {
-	struct tw_subsurface *subsurface = surface->role.commit_private;
-	//only commit if is not synchronized.
-	if (forced || !tw_subsurface_is_synched(subsurface)) {
-		surface_commit_state(subsurface->surface);
-		return true;
+	struct tw_subsurface *sub = tw_surface_get_subsurface(surface);
+
+	if (sub && sub->parent) {
+		surface->geometry.x = sub->parent->geometry.x + sub->sx;
+		surface->geometry.y = sub->parent->geometry.y + sub->sy;
 	}
-	return false;
 }
 
 static void
-surface_commit(struct wl_client *client,
-              struct wl_resource *resource)
+surface_transaction_apply(struct surface_transaction *transaction)
 {
-	bool committed = true;
-	struct tw_subsurface *subsurface;
-	struct tw_surface *surface = tw_surface_from_resource(resource);
+	struct surface_transaction_entry *entry;
+	struct tw_subsurface *child;
+	struct tw_surface *surface;
+
+	wl_array_for_each(entry, &transaction->entries)
+		if (entry->committed)
+			surface_commit_view(entry->surface);
+
+	wl_array_for_each(entry, &transaction->entries) {
+		surface_transaction_place(entry->surface);
+		entry->moved = surface_update_geometry_local(entry->surface);
+		//desynchronized children are not in the transaction, they
+		//still need to follow the parent.
+		if (!entry->moved)
+			continue;
+		wl_list_for_each(child, &entry->surface->subsurfaces,
+		                 parent_link)
+			if (!child->sync)
+				tw_subsurface_update_pos(child, child->sx,
+				                         child->sy);
+	}
+
+	wl_array_for_each(entry, &transaction->entries) {
+		surface = entry->surface;
+		if (entry->moved || (entry->committed &&
+		    pixman_region32_not_empty(&surface->current->surface_damage)))
+			wl_signal_emit(&surface->signals.dirty, surface);
+	}
+
+	wl_array_for_each(entry, &transaction->entries) {
+		surface = entry->surface;
+		if (entry->committed && surface->role.commit)
+			surface->role.commit(surface);
+	}
+}
+
+static void
+surface_commit_transaction(struct tw_surface *surface)
+{
+	struct surface_transaction transaction;
 
-	if (tw_surface_is_subsurface(surface))
-		committed = surface_commit_as_subsurface(surface, false);
-	else
+	//fast path, nothing to synchronize
+	if (wl_list_empty(&surface->subsurfaces) &&
+	    wl_list_empty(&surface->subsurfaces_pending)) {
 		surface_commit_state(surface);
+		return;
+	}
+	wl_array_init(&transaction.entries);
+	surface_transaction_collect(&transaction, surface);
+	surface_transaction_apply(&transaction);
+	wl_array_release(&transaction.entries);
+}
 
-	if (committed) {
-		wl_list_for_each_reverse(subsurface,
-		                         &surface->subsurfaces_pending,
-		                         parent_pending_link) {
-			wl_list_remove(&subsurface->parent_link);
-			wl_list_insert(&surface->subsurfaces,
-			               &subsurface->parent_link);
-		}
-		//TODO I should not need to update the damage for subsurfaces
-		//here. Stacking order of subsurfaces should work the same as
+void
+subsurface_commit_cached(struct tw_subsurface *subsurface)
+{
+	surface_commit_transaction(subsurface->surface);
+}
+
+static void
+surface_commit(struct wl_client *client,
+              struct wl_resource *resource)
+{
+	struct tw_surface *surface = tw_surface_from_resource(resource);
+	struct tw_subsurface *subsurface = tw_surface_get_subsurface(surface);
+
+	tw_profiler_start_timer("surface_commit");
+	surface->trace.commit++;
+	tw_profiler_flow_begin("surface_frame", tw_surface_trace_flow(surface));
+	//synchronized subsurface caches its state until parent commits.
+	if (!subsurface || !tw_subsurface_is_synched(subsurface)) {
+		surface_commit_transaction(surface);
+		tw_profiler_counter("surface_damage_rects",
+		                    pixman_region32_n_rects(
+			                    &surface->current->surface_damage));
+	} else {
+		tw_profiler_instant("surface_commit_cached",
+		                    surface->trace.id);
 	}
-        // if this surface committed, all the subsurface would commit with it if
-        // they did not commit
-	wl_list_for_each(subsurface, &surface->subsurfaces, parent_link)
-		subsurface_commit_for_parent(subsurface, committed);
 
 	wl_signal_emit(&surface->signals.commit, surface);
+	tw_profiler_stop_timer("surface_commit");
 }
 
 static const struct wl_surface_interface surface_impl = {
@@ -692,6 +987,8 @@ tw_surface_flush_frame(struct tw_surface *surface, uint32_t time)
 		surface, time,
 	};
 
+	tw_profiler_start_timer("surface_flush_frame");
+	tw_profiler_flow_step("surface_frame", tw_surface_trace_flow(surface));
 	pixman_region32_clear(&surface->current->surface_damage);
 	pixman_region32_clear(&surface->current->buffer_damage);
 	wl_resource_for_each_safe(callback, next, &surface->frame_callbacks) {
@@ -701,6 +998,7 @@ tw_surface_flush_frame(struct tw_surface *surface, uint32_t time)
 	pixman_region32_clear(&surface->geometry.dirty);
 	//handlers like presentation feedback may happen here.
 	wl_signal_emit(&surface->signals.frame, &event);
+	tw_profiler_stop_timer("surface_flush_frame");
 }
 
 static void
@@ -731,6 +1029,7 @@ surface_destroy_resource(struct wl_resource *resource)
 		tw_surface_buffer_release(&surface->buffer);
 
 	pixman_region32_fini(&surface->geometry.dirty);
+	pixman_region32_fini(&surface->culling.visible);
 
 	assert(surface->alloc);
 	surface->alloc->free(surface, &wl_surface_interface);
@@ -762,6 +1061,12 @@ tw_surface_create(struct wl_client *client, uint32_t ver, uint32_t id,
 	wl_signal_init(&surface->signals.dirty);
 	wl_signal_init(&surface->signals.destroy);
 	pixman_region32_init(&surface->geometry.dirty);
+	pixman_region32_init(&surface->culling.visible);
+	surface->culling.occluded = false;
+	surface->damage.policy = NULL;
+	surface->damage.stats = NULL;
+	surface->trace.id = ++s_surface_trace_id;
+	surface->trace.commit = 0;
 
 	for (int i = 0; i < MAX_VIEW_LINKS; i++)
 		wl_list_init(&surface->links[i]);
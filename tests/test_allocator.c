@@ -0,0 +1,111 @@
+/*
+ * test_allocator.c - taiwins slab allocator tests
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/utils.h>
+#include <taiwins/objects/surface.h>
+
+/* a reset with live objects keeps their slabs, destroying them afterwards
+ * frees through the slab as usual. */
+static void
+test_reset_live_region(struct wl_client *client)
+{
+	struct tw_slab_stats stats;
+	struct tw_region *live, *dead;
+
+	live = tw_region_create(client, 1, 0, &tw_slab_allocator);
+	dead = tw_region_create(client, 1, 0, &tw_slab_allocator);
+	assert(live && dead);
+	wl_resource_destroy(dead->resource);
+
+	tw_slab_allocator_reset(NULL);
+	tw_slab_allocator_get_stats(&stats);
+	assert(stats.objects == 1);
+	assert(stats.slabs == 1);
+
+	//still usable
+	pixman_region32_union_rect(&live->region, &live->region,
+	                           0, 0, 64, 64);
+	assert(pixman_region32_not_empty(&live->region));
+	wl_resource_destroy(live->resource);
+
+	tw_slab_allocator_get_stats(&stats);
+	assert(stats.objects == 0);
+	tw_slab_allocator_reset(NULL);
+	tw_slab_allocator_get_stats(&stats);
+	assert(stats.pools == 0);
+	assert(stats.slabs == 0);
+}
+
+/* a region allocated after the reset gets a new pool */
+static void
+test_reset_reuse(struct wl_client *client)
+{
+	struct tw_slab_stats stats;
+	struct tw_region *regions[256];
+
+	for (int i = 0; i < 256; i++) {
+		regions[i] = tw_region_create(client, 1, 0,
+		                              &tw_slab_allocator);
+		assert(regions[i]);
+	}
+	//keep every other one alive over the reset
+	for (int i = 0; i < 256; i += 2)
+		wl_resource_destroy(regions[i]->resource);
+	tw_slab_allocator_reset(&wl_region_interface);
+	for (int i = 0; i < 256; i += 2) {
+		regions[i] = tw_region_create(client, 1, 0,
+		                              &tw_slab_allocator);
+		assert(regions[i]);
+	}
+	for (int i = 0; i < 256; i++)
+		wl_resource_destroy(regions[i]->resource);
+
+	tw_slab_allocator_get_stats(&stats);
+	assert(stats.objects == 0);
+	assert(stats.allocs == stats.frees);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wl_display *display = wl_display_create();
+	struct wl_client *client;
+	int fds[2];
+
+	assert(display);
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+	client = wl_client_create(display, fds[0]);
+	assert(client);
+
+	test_reset_live_region(client);
+	test_reset_reuse(client);
+
+	wl_client_destroy(client);
+	close(fds[1]);
+	wl_display_destroy(display);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * test_gles2_transform.c - buffer transforms through the gles2 renderer
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/gles2_renderer.h>
+
+#include "bench.h"
+
+/*
+ * A client commits a buffer of unique pixels with every buffer transform, the
+ * surface is drawn into a target of its size and every pixel read back has to
+ * be the one wl_surface.set_buffer_transform puts there.
+ */
+
+#define WIDTH 8
+#define HEIGHT 4
+//meson counts it as skipped
+#define TEST_SKIP 77
+
+static void
+init_surface(struct tw_surface *surface, void *data)
+{
+	tw_gles2_renderer_init_surface(data, surface);
+}
+
+/* the buffer pixel shown at (x, y) of a surface of width x height, as in the
+ * description of wl_output_transform */
+static void
+surface_to_buffer(enum wl_output_transform transform, int width, int height,
+                  int x, int y, int *bx, int *by)
+{
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	default:
+		*bx = x; *by = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		*bx = y; *by = width - 1 - x;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		*bx = width - 1 - x; *by = height - 1 - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		*bx = height - 1 - y; *by = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		*bx = width - 1 - x; *by = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		*bx = y; *by = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*bx = x; *by = height - 1 - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*bx = height - 1 - y; *by = width - 1 - x;
+		break;
+	}
+}
+
+static void
+test_transform(struct tw_gles2_renderer *renderer,
+               struct bench_server *server, struct bench_client *client,
+               struct bench_surface *surface, enum wl_output_transform t)
+{
+	struct tw_gles2_render_target target;
+	uint32_t *buffer = bench_surface_get_data(surface);
+	int width = (t & WL_OUTPUT_TRANSFORM_90) ? HEIGHT : WIDTH;
+	int height = (t & WL_OUTPUT_TRANSFORM_90) ? WIDTH : HEIGHT;
+	unsigned char pixels[WIDTH * HEIGHT * 4];
+
+	bench_surface_set_transform(surface, t, 1);
+	bench_surface_commit_damage(surface, 0, 0, width, height);
+	bench_roundtrip(server, client);
+	assert(server->surfaces[0]->geometry.xywh.width == (unsigned)width);
+	assert(server->surfaces[0]->geometry.xywh.height == (unsigned)height);
+
+	assert(tw_gles2_render_target_init(renderer, &target, 0, 0,
+	                                   width, height));
+	tw_gles2_renderer_draw(renderer, &target, server->layers, NULL);
+	assert(tw_gles2_render_target_read_pixels(renderer, &target,
+	                                          pixels));
+	tw_gles2_render_target_fini(renderer, &target);
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			unsigned char *p = pixels + (y * width + x) * 4;
+			uint32_t expect;
+			int bx, by;
+
+			surface_to_buffer(t, width, height, x, y, &bx, &by);
+			expect = buffer[by * WIDTH + bx];
+			if (p[0] != ((expect >> 16) & 0xff) ||
+			    p[1] != ((expect >> 8) & 0xff) ||
+			    p[2] != (expect & 0xff)) {
+				fprintf(stderr, "transform %d at (%d, %d): "
+				        "got %02x%02x%02x, expect %06x\n",
+				        t, x, y, p[0], p[1], p[2],
+				        expect & 0xffffff);
+				abort();
+			}
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tw_gles2_renderer renderer;
+	struct bench_server server;
+	struct bench_client *client;
+	struct bench_surface *surface;
+
+	assert(bench_server_init(&server));
+	if (!tw_gles2_renderer_init(&renderer, server.display)) {
+		bench_server_fini(&server);
+		return TEST_SKIP;
+	}
+	server.new_surface = init_surface;
+	server.new_surface_data = &renderer;
+
+	client = bench_client_connect(&server);
+	assert(client);
+	surface = bench_surface_create(client, NULL, 0, 0, WIDTH, HEIGHT,
+	                               true);
+	assert(surface);
+	bench_roundtrip(&server, client);
+	assert(server.n_surfaces == 1);
+	bench_server_show_surface(&server, server.surfaces[0], 0, 0);
+
+	for (int t = WL_OUTPUT_TRANSFORM_NORMAL;
+	     t <= WL_OUTPUT_TRANSFORM_FLIPPED_270; t++)
+		test_transform(&renderer, &server, client, surface, t);
+
+	//the surfaces outlive the renderer, even the one never imported
+	assert(bench_surface_create(client, NULL, 0, 0, WIDTH, HEIGHT, true));
+	bench_roundtrip(&server, client);
+	assert(server.n_surfaces == 2);
+	tw_gles2_renderer_fini(&renderer);
+	for (int i = 0; i < 2; i++) {
+		assert(!server.surfaces[i]->buffer.buffer_import.buffer_import);
+		assert(!server.surfaces[i]->buffer.handle.ptr);
+	}
+
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	return 0;
+}
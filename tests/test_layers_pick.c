@@ -0,0 +1,124 @@
+/*
+ * test_layers_pick.c - picking surfaces without reordering the layers
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/layers.h>
+
+#include "bench.h"
+
+/*
+ * The layers and subsurfaces change through the layer API and the client
+ * requests only, the grid has to follow without tw_layers_manager_reorder.
+ */
+
+//only keeps the size, the geometry of the surface comes from it
+static bool
+test_buffer_import(struct tw_event_buffer_uploading *event, void *callback)
+{
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+
+	assert(shm);
+	event->buffer->width = wl_shm_buffer_get_width(shm);
+	event->buffer->height = wl_shm_buffer_get_height(shm);
+	event->buffer->handle.ptr = callback;
+	return true;
+}
+
+static void
+init_surface(struct tw_surface *surface, void *data)
+{
+	surface->buffer.buffer_import.buffer_import = test_buffer_import;
+	surface->buffer.buffer_import.callback = data;
+}
+
+static struct tw_surface *
+pick(struct bench_server *server, float x, float y)
+{
+	return tw_layers_manager_pick_surface(server->layers, x, y);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_server server;
+	struct bench_client *client;
+	struct bench_surface *a, *b, *c;
+	struct tw_surface *sa, *sb, *sc;
+	//any non NULL handle
+	static int texture;
+
+	assert(bench_server_init(&server));
+	server.new_surface = init_surface;
+	server.new_surface_data = &texture;
+	client = bench_client_connect(&server);
+	assert(client);
+	a = bench_surface_create(client, NULL, 0, 0, 64, 64, true);
+	b = bench_surface_create(client, NULL, 0, 0, 64, 64, true);
+	assert(a && b);
+	bench_surface_commit(a);
+	bench_surface_commit(b);
+	bench_roundtrip(&server, client);
+	assert(server.n_surfaces == 2);
+	sa = server.surfaces[0];
+	sb = server.surfaces[1];
+
+	bench_server_show_surface(&server, sa, 0, 0);
+	bench_server_show_surface(&server, sb, 32, 32);
+	assert(pick(&server, 8, 8) == sa);
+	assert(pick(&server, 40, 40) == sb);
+	assert(pick(&server, 90, 90) == sb);
+	assert(!pick(&server, 200, 200));
+	//showing it again raises it
+	bench_server_show_surface(&server, sa, 0, 0);
+	assert(pick(&server, 40, 40) == sa);
+
+	//the subsurface is stacked on the commit of the parent
+	c = bench_surface_create(client, a, 4, 4, 16, 16, true);
+	assert(c);
+	bench_surface_commit(c);
+	bench_surface_commit(a);
+	bench_roundtrip(&server, client);
+	assert(server.n_surfaces == 3);
+	sc = server.surfaces[2];
+	assert(pick(&server, 8, 8) == sc);
+	assert(pick(&server, 40, 40) == sa);
+
+	tw_layer_remove_surface(sa);
+	assert(!pick(&server, 8, 8));
+	assert(pick(&server, 40, 40) == sb);
+	bench_server_show_surface(&server, sa, 0, 0);
+	assert(pick(&server, 8, 8) == sc);
+
+	tw_layer_unset_position(server.layer);
+	assert(!pick(&server, 40, 40));
+	tw_layer_set_position(server.layer, TW_LAYER_POS_DESKTOP_MID,
+	                      server.layers);
+	assert(pick(&server, 8, 8) == sc);
+	assert(pick(&server, 40, 40) == sa);
+	assert(pick(&server, 90, 90) == sb);
+
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	return 0;
+}
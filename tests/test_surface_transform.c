@@ -0,0 +1,188 @@
+/*
+ * test_surface_transform.c - damage through the buffer transforms
+ *
+ * Copyright (c) 2020 Xichen Zhou
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+
+#include <taiwins/objects/surface.h>
+#include <taiwins/objects/matrix.h>
+
+#include "bench.h"
+
+/*
+ * Without viewporter the surface damage goes to the buffer in integers, it
+ * has to be the same as mapping it through surface_to_buffer, which the
+ * renderers sample the buffer with, and map back to the same surface damage.
+ */
+
+#define WIDTH 64
+#define HEIGHT 32
+
+static const pixman_box32_t damage = {2, 3, 7, 7};
+
+//only keeps the size, the surface needs a texture for updating damage
+static bool
+test_buffer_import(struct tw_event_buffer_uploading *event, void *callback)
+{
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(event->wl_buffer);
+
+	assert(shm);
+	event->buffer->width = wl_shm_buffer_get_width(shm);
+	event->buffer->height = wl_shm_buffer_get_height(shm);
+	event->buffer->handle.ptr = callback;
+	return true;
+}
+
+static void
+init_surface(struct tw_surface *surface, void *data)
+{
+	surface->buffer.buffer_import.buffer_import = test_buffer_import;
+	surface->buffer.buffer_import.callback = data;
+}
+
+/* the buffer point of (x, y) on a surface of width x height, as in the
+ * description of wl_output_transform */
+static void
+surface_to_buffer(enum wl_output_transform transform, int width, int height,
+                  int x, int y, int *bx, int *by)
+{
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	default:
+		*bx = x; *by = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		*bx = y; *by = width - x;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		*bx = width - x; *by = height - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		*bx = height - y; *by = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		*bx = width - x; *by = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		*bx = y; *by = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*bx = x; *by = height - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*bx = height - y; *by = width - x;
+		break;
+	}
+}
+
+static bool
+box_equal(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 == b->x1 && a->y1 == b->y1 &&
+		a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+static void
+assert_box(const char *what, enum wl_output_transform t, int32_t scale,
+           const pixman_box32_t *got, const pixman_box32_t *expect)
+{
+	if (box_equal(got, expect))
+		return;
+	fprintf(stderr, "transform %d scale %d, %s: got (%d, %d, %d, %d), "
+	        "expect (%d, %d, %d, %d)\n", t, scale, what,
+	        got->x1, got->y1, got->x2, got->y2,
+	        expect->x1, expect->y1, expect->x2, expect->y2);
+	abort();
+}
+
+static void
+test_transform(struct bench_server *server, struct bench_client *client,
+               struct bench_surface *surface, enum wl_output_transform t,
+               int32_t scale)
+{
+	struct tw_view *view;
+	pixman_box32_t mapped, expect;
+	int width = (t & WL_OUTPUT_TRANSFORM_90) ? HEIGHT : WIDTH;
+	int height = (t & WL_OUTPUT_TRANSFORM_90) ? WIDTH : HEIGHT;
+	int x1, y1, x2, y2;
+
+	width /= scale;
+	height /= scale;
+	bench_surface_set_transform(surface, t, scale);
+	//the first commit of a transform may damage the whole buffer
+	for (int i = 0; i < 2; i++) {
+		bench_surface_commit_damage(surface, damage.x1, damage.y1,
+		                            damage.x2 - damage.x1,
+		                            damage.y2 - damage.y1);
+		bench_roundtrip(server, client);
+	}
+	view = server->surfaces[0]->current;
+	assert(view->transform == t && view->buffer_scale == scale);
+	assert(pixman_region32_n_rects(&view->buffer_damage) == 1);
+	assert(pixman_region32_n_rects(&view->surface_damage) == 1);
+
+	surface_to_buffer(t, width, height, damage.x1, damage.y1, &x1, &y1);
+	surface_to_buffer(t, width, height, damage.x2, damage.y2, &x2, &y2);
+	expect.x1 = (x1 < x2 ? x1 : x2) * scale;
+	expect.y1 = (y1 < y2 ? y1 : y2) * scale;
+	expect.x2 = (x1 < x2 ? x2 : x1) * scale;
+	expect.y2 = (y1 < y2 ? y2 : y1) * scale;
+	tw_mat3_box_transform(&view->surface_to_buffer, &mapped, &damage);
+
+	assert_box("buffer damage", t, scale,
+	           pixman_region32_extents(&view->buffer_damage), &expect);
+	assert_box("surface_to_buffer", t, scale, &mapped, &expect);
+	assert_box("surface damage", t, scale,
+	           pixman_region32_extents(&view->surface_damage), &damage);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_server server;
+	struct bench_client *client;
+	struct bench_surface *surface;
+	//any non NULL handle
+	static int texture;
+
+	assert(bench_server_init(&server));
+	server.new_surface = init_surface;
+	server.new_surface_data = &texture;
+
+	client = bench_client_connect(&server);
+	assert(client);
+	surface = bench_surface_create(client, NULL, 0, 0, WIDTH, HEIGHT,
+	                               true);
+	assert(surface);
+	bench_roundtrip(&server, client);
+	assert(server.n_surfaces == 1);
+
+	for (int scale = 1; scale <= 2; scale++)
+		for (int t = WL_OUTPUT_TRANSFORM_NORMAL;
+		     t <= WL_OUTPUT_TRANSFORM_FLIPPED_270; t++)
+			test_transform(&server, client, surface, t, scale);
+
+	bench_client_destroy(client);
+	bench_server_fini(&server);
+	return 0;
+}